@@ -1,8 +1,11 @@
 /**
  * @file httpproxy.cpp
  * @brief HTTP Proxy Server
- * Same as the TCP proxy example, but checks the HTTP requests are valid
- * @see proxy.cpp
+ * Forwards requests to upstream servers, reusing upstream connections
+ * Several servers can be given as host[:port],host[:port],... and are load balanced
+ * Responses are cached in memory (cache_mb, 0 for no cache), and on disk if cache_dir is given
+ * @see proxy.cpp - TCP proxy
+ * @see reverseproxy.h
  */
 
 #include "foxbox.h"
@@ -14,29 +17,28 @@ int main(int argc, char ** argv)
 {
 	
 	if (argc < 2)
-		Fatal("Usage: %s target_address [target_port=80] [listen_port=8080]", argv[0]);
+		Fatal("Usage: %s target_address[:port][,...] [target_port=80] [listen_port=8080] [io_threads=2] [workers=8] [cache_mb=64] [cache_dir]", argv[0]);
 	
 	char * target = argv[1];
 	int target_port = (argc > 2) ? atoi(argv[2]) : 80;
 	int listen_port = (argc > 3) ? atoi(argv[3]) : 8080;
+	unsigned io_threads = (argc > 4) ? atoi(argv[4]) : 2;
+	unsigned workers = (argc > 5) ? atoi(argv[5]) : 8;
+	size_t cache_mb = (argc > 6) ? atoi(argv[6]) : 64;
+	string cache_dir = (argc > 7) ? argv[7] : "";
 	
-	TCP::Server server(listen_port);
-	while (true)
-	{
-		server.Listen();
-		HTTP::Request req;
-		if (req.Receive(server))
-		{
-			Debug("Forwarding request...");
-			TCP::Client client(target, target_port);
-			Socket::Cat(client, server, server, client);
-			client.Close();
-		}
-		else
-		{
-			Debug("Bad Request.");
-			server.Send("Bad Request.");
-		}
-		server.Close();
-	}
+	UpstreamGroup upstreams;
+	upstreams.MaxIdle(workers);
+	if (upstreams.Parse(target, target_port) == 0)
+		Fatal("No targets in \"%s\"", target);
+	HTTP::ReverseProxy proxy(upstreams);
+	// Declared after the proxy so it is destroyed first
+	HTTP::Cache cache(cache_mb << 20, cache_dir);
+	if (cache_mb > 0)
+		proxy.SetCache(&cache);
+	HTTP::Server server(listen_port, io_threads, workers);
+	server.KeepAlive(true);
+	server.SetHandler(proxy.Handler());
+	Debug("Forwarding port %d to %s:%d", listen_port, target, target_port);
+	server.Run();
 }
@@ -1,106 +1,94 @@
 /**
  * @file httpserver.cpp
- * @brief Simple single threaded HTTP API implemented using libfoxbox
+ * @brief Simple multithreaded HTTP API implemented using libfoxbox
+ * WebSockets to any path on the same port are echoed
+ * Usage: httpserver [port] [io_threads] [workers] [access_log]
  *
  */
  
 #include "foxbox.h"
-#include <map>
-#include <sstream>
+#include <atomic>
+#include <memory>
 
 using namespace std;
 using namespace Foxbox;
 
-bool g_running = true;
-
-void Serve(int port, int id)
-{
-	int count = 0;
-	TCP::Server server(port);
-	while (g_running)
-	{
-		
-		server.Listen();
-		while (server.Valid())
-		{
-			//Warn("Thread %d has file descriptor %d", DebugUtils::ThreadID(), server.GetFD());
-			Debug("Connected; wait for request");
-			HTTP::Request req;
-			if (!req.Receive(server))
-			{
-				Debug("Invalid request!");
-				server.Close();
-				server.Listen();
-				continue;
-			}
-			Debug("Got request! Path is: %s", req.Path().c_str());
-		
-			string & api = req.SplitPath().front();
-			if (api == "cookies")
-			{
-				HTTP::SendJSON(server, req.Cookies());
-			}
-			else if (api == "headers")
-			{
-				HTTP::SendJSON(server, req.Headers());
-			}
-			else if (api == "echo")
-			{
-				HTTP::SendJSON(server, req.Params());
-			}
-			else if (api == "meta")
-			{
-				stringstream s; s << ++count;
-				map<string,string> m;
-				m["request_number"] = s.str();
-				s.clear();
-				s << id;
-				m["thread_number"] = s.str();
-				HTTP::SendJSON(server, m);
-			}
-			else if (api == "file")
-			{
-				HTTP::SendFile(server, req.SplitPath().back());
-			}
-			else if (api == "cgi")
-			{
-				Debug("Got CGI request");
-				req.CGI(server, req.SplitPath().back().c_str());
-				Debug("Finished parsing CGI request.");
-			}
-			else if (api == "quit")
-			{
-				g_running = false;
-				HTTP::SendPlain(server, 200, "Dying now.");
-				Fatal("Quit.");
-			}
-			else
-			{
-				HTTP::SendFile(server, "index.html");
-			}
-			server.Close();
-			if (g_running)
-				server.Listen();
-		}
-	}
-}
-#define POOL_SIZE 2
-
 int main(int argc, char ** argv)
 {
-	int port = (argc == 2) ? atoi(argv[1]) : 8080;
-	thread pool[POOL_SIZE];
-	for (unsigned i = 0; i < POOL_SIZE; ++i)
+	int port = (argc >= 2) ? atoi(argv[1]) : 8080;
+	unsigned io_threads = (argc >= 3) ? atoi(argv[2]) : 2;
+	unsigned workers = (argc >= 4) ? atoi(argv[3]) : 4;
+	
+	HTTP::Server server(port, io_threads, workers);
+	unique_ptr<HTTP::AccessLog> access_log;
+	if (argc >= 5)
 	{
-		Debug("Serve thread %d", i);
-		pool[i] = thread(Serve,port, i);
+		access_log.reset(new HTTP::AccessLog(argv[4]));
+		server.SetAccessLog(access_log.get());
 	}
+	atomic<int> count(0);
+	HTTP::Router router;
+	router.Get("cookies", [](HTTP::Request & req, TCP::Socket & socket, const HTTP::Router::Match &)
+	{
+		HTTP::SendJSON(socket, req.Cookies(), 200);
+	});
+	router.Get("headers", [](HTTP::Request & req, TCP::Socket & socket, const HTTP::Router::Match &)
+	{
+		HTTP::SendJSON(socket, req.Headers(), 200);
+	});
+	router.Get("echo", [](HTTP::Request & req, TCP::Socket & socket, const HTTP::Router::Match &)
+	{
+		HTTP::SendJSON(socket, req.Params(), 200);
+	});
+	router.Get("meta", [&](HTTP::Request & req, TCP::Socket & socket, const HTTP::Router::Match &)
+	{
+		JSON::Writer json;
+		json.BeginObject()
+			.Field("request_number", ++count)
+			.Field("thread_number", DebugUtils::ThreadID())
+			.Key("path").BeginArray();
+		for (auto & segment : req.SplitPath())
+			json.String(segment);
+		json.EndArray().EndObject();
+		HTTP::SendJSON(socket, json, 200);
+	});
+	router.Get("file/:name", [](HTTP::Request & req, TCP::Socket & socket, const HTTP::Router::Match & match)
+	{
+		HTTP::SendFile(socket, req, match.Param("name"));
+	});
+	router.Add("*", "cgi/:program", [](HTTP::Request & req, TCP::Socket & socket, const HTTP::Router::Match & match)
+	{
+		Debug("Got CGI request");
+		req.CGI(socket, match.Param("program").c_str());
+		Debug("Finished parsing CGI request.");
+	});
+	router.Get("quit", [&](HTTP::Request & req, TCP::Socket & socket, const HTTP::Router::Match &)
+	{
+		HTTP::SendPlain(socket, 200, "Dying now.");
+		server.Stop();
+	});
+	router.Default([](HTTP::Request & req, TCP::Socket & socket, const HTTP::Router::Match &)
+	{
+		HTTP::SendFile(socket, "index.html");
+	});
 	
-	for (unsigned i = 0; i < POOL_SIZE; ++i)
+	WS::EventServer websockets(-1, 1);
+	websockets.OnMessage([](const WS::EventServer::SessionPtr & session, WS::Opcode opcode, const StringRef & message)
 	{
-		pool[i].join();
-		Debug("Joined thread %d", i);
-	}
-	Debug("All threads done.");
+		session->Send(opcode, message.data(), message.size());
+	});
+	websockets.Start();
+	server.SetUpgradeHandler("websocket", [&](HTTP::Request & req, int fd, string & rest)
+	{
+		websockets.Adopt(req, fd, rest);
+	});
 
+	server.SetHandler([&](HTTP::Request & req, TCP::Socket & socket)
+	{
+		Debug("Got request! Path is: %s", req.Path().c_str());
+		router.Dispatch(req, socket);
+	});
+	Debug("Serving on port %d with %u IO threads and %u workers", port, io_threads, workers);
+	server.Run();
+	Debug("Server stopped.");
 }
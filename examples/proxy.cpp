@@ -2,9 +2,11 @@
  * @file proxy.cpp
  * @brief TCP Proxy Server
  * Listens for TCP connections then cats between them and a remote server
+ * Several servers can be given as host[:port],host[:port],... and are load balanced
  */
 
 #include "foxbox.h"
+#include <chrono>
 
 using namespace std;
 using namespace Foxbox;
@@ -13,19 +15,41 @@ int main(int argc, char ** argv)
 {
 	
 	if (argc < 2)
-		Fatal("Usage: %s target_address [target_port=80] [listen_port=8080]", argv[0]);
+		Fatal("Usage: %s target_address[:port][,...] [target_port=80] [listen_port=8080]", argv[0]);
 	
 	char * target = argv[1];
 	int target_port = (argc > 2) ? atoi(argv[2]) : 80;
 	int listen_port = (argc > 3) ? atoi(argv[3]) : 8080;
 	
+	UpstreamGroup upstreams;
+	if (upstreams.Parse(target, target_port) == 0)
+		Fatal("No targets in \"%s\"", target);
+	
 	TCP::Server server(listen_port);
 	while (true)
 	{
 		server.Listen();
-		TCP::Client client(target, target_port);
-		Socket::Cat(client, server, server, client);
-		client.Close();
+		Upstream * upstream = NULL;
+		for (size_t attempt = 0; attempt < upstreams.Size(); ++attempt)
+		{
+			upstream = upstreams.Pick(upstream);
+			if (upstream == NULL)
+				break;
+			auto start = chrono::steady_clock::now();
+			try
+			{
+				TCP::Client client(upstream->Host().c_str(), upstream->Port());
+				double latency = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+				Socket::Cat(client, server, server, client);
+				client.Close();
+				upstreams.Report(upstream, true, latency);
+				break;
+			}
+			catch (Exception & e)
+			{
+				upstreams.Report(upstream, false, 0);
+			}
+		}
 		server.Close();
 	}
 }
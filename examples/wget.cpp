@@ -2,56 +2,264 @@
  * @file wget.cpp
  * @brief wget using libfoxbox
  * Note most of the work is argument parsing.
+ * -n segments: with an output file, fetch that many Range segments at once
+ * 	(if the server accepts ranges), each written in place with pwrite
+ * -i list: fetch every URL in a file (- for stdin) into the output directory,
+ * 	segments at a time, reusing keep-alive connections to each server
  */
 
 #include "foxbox.h"
 
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
 using namespace std;
 using namespace Foxbox;
 
-int main(int argc, char ** argv)
+/** Attempts at each segment; a retry resumes where the last one stopped **/
+#define SEGMENT_ATTEMPTS 3
+
+/** Split [http://]host[:port][/path] **/
+static void SplitURL(string url, string & host, int & port, string & path)
 {
-	if (argc < 2)
-		Fatal("Usage: %s url [output]", argv[0]);
-	
-	FILE * o = (argc > 2) ? fopen(argv[2], "w") : stdout;
-	Socket output(o);
-	int port = 80;
-	char * url = argv[1];
-	char * path = strchr(url, '/');
-	char * p = strchr(url, ':');
-	
-	if (path != NULL && *path != '\0')
-	{
-		*path = '\0';
-		++path;
-		
+	if (url.compare(0, 7, "http://") == 0)
+		url.erase(0, 7);
+	size_t slash = url.find('/');
+	path = (slash == string::npos) ? "/" : url.substr(slash);
+	url.resize(min(slash, url.size()));
+	size_t colon = url.find(':');
+	port = (colon == string::npos) ? 80 : atoi(url.c_str() + colon + 1);
+	host = url.substr(0, colon);
+}
+
+/** Write all of data at offset **/
+static bool WriteAt(int fd, const char * data, size_t size, off_t offset)
+{
+	while (size > 0)
+	{
+		ssize_t written = pwrite(fd, data, size, offset);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		data += written;
+		size -= written;
+		offset += written;
 	}
-	else
+	return true;
+}
+
+/** Is a 206's Content-Range ("bytes first-last/total") the one asked for, from offset to at most end **/
+static bool RangeMatches(HTTP::Response & response, long long offset, long long end, long long size)
+{
+	long long first, last, total;
+	string range(response.Headers().Get(HTTP::HEADER_CONTENT_RANGE));
+	if (sscanf(range.c_str(), "bytes %lld-%lld/%lld", &first, &last, &total) != 3)
+		return false;
+	return first == offset && last >= first && last < end && total == size;
+}
+
+/** Download path in segments concurrent ranges @returns false if the server doesn't do ranges **/
+static bool Segmented(HTTP::Client & client, const string & path, const char * filename, unsigned segments)
+{
+	HTTP::Response head;
+	if (!client.Send("HEAD", path, head) || head.Status() != 200)
+		return false;
+	HTTP::Headers & headers = head.Headers();
+	string length(headers.Get(HTTP::HEADER_CONTENT_LENGTH));
+	if (length.empty() || !headers.Get(HTTP::HEADER_ACCEPT_RANGES).EqualsIgnoreCase("bytes"))
+		return false;
+	long long size = atoll(length.c_str());
+	if (size <= 0)
+		return false;
+
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		Fatal("Couldn't open \"%s\" - %s", filename, StrError(errno));
+	// Allocated up front, so segments are written in place rather than extending the file
+	if (posix_fallocate(fd, 0, size) != 0 && ftruncate(fd, size) != 0)
+		Fatal("Couldn't allocate %lld bytes for \"%s\" - %s", size, filename, StrError(errno));
+
+	long long each = (size + segments - 1) / segments;
+	atomic<bool> failed(false);
+	vector<thread> threads;
+	for (long long start = 0; start < size; start += each)
 	{
-		path = (char*)("");
+		long long end = min(size, start + each);
+		threads.push_back(thread([&, start, end]()
+		{
+			long long offset = start;
+			for (int attempt = 0; attempt < SEGMENT_ATTEMPTS && offset < end && !failed; ++attempt)
+			{
+				HTTP::Fields range;
+				char value[64];
+				snprintf(value, sizeof(value), "bytes=%lld-%lld", offset, end - 1);
+				range.Add("Range", value);
+				HTTP::Response response;
+				bool checked = false;
+				client.Send("GET", path, response, StringRef(), &range, [&](const char * data, size_t n)
+				{
+					if (response.Status() != 206 || offset + (long long)n > end)
+						return false;
+					// A different range (coalesced, clamped, moved) would be written in the wrong place
+					if (!checked && !RangeMatches(response, offset, end, size))
+					{
+						Error("Segment %lld-%lld of %s: unexpected Content-Range \"%s\"", offset, end - 1, path.c_str(),
+							response.Headers().Get(HTTP::HEADER_CONTENT_RANGE).str().c_str());
+						return false;
+					}
+					checked = true;
+					if (!WriteAt(fd, data, n, offset))
+					{
+						Error("Couldn't write to \"%s\" - %s", filename, StrError(errno));
+						failed = true;
+						return false;
+					}
+					offset += n;
+					return true;
+				});
+				if (response.Status() != 0 && response.Status() != 206)
+					break;
+			}
+			if (offset < end)
+			{
+				Error("Segment %lld-%lld of %s stopped at %lld", start, end - 1, path.c_str(), offset);
+				failed = true;
+			}
+		}));
 	}
-	
-	if (p != NULL && *p != '\0') 
+	for (auto & t : threads)
+		t.join();
+	close(fd);
+	if (failed)
+		Fatal("Download of %s failed", path.c_str());
+	return true;
+}
+
+/** Download every URL in a list into directory, workers at a time @returns number that failed **/
+static unsigned Batch(istream & list, const string & directory, unsigned workers)
+{
+	struct Job {string host; int port; string path; string filename; HTTP::Client * client;};
+	vector<Job> jobs;
+	map<string, unique_ptr<HTTP::Client> > clients; // One pool of connections per server
+	string url;
+	while (list >> url)
 	{
-		*p = '\0';
-		port = atoi(p+1);
+		Job job;
+		SplitURL(url, job.host, job.port, job.path);
+		string name(job.path.substr(job.path.find_last_of('/') + 1));
+		name.resize(min(name.find('?'), name.size()));
+		job.filename = directory + "/" + (name.empty() ? "index.html" : name);
+		unique_ptr<HTTP::Client> & client = clients[job.host + ":" + to_string(job.port)];
+		if (!client)
+			client.reset(new HTTP::Client(job.host, job.port, workers));
+		// Found now, so the workers don't share the map
+		job.client = client.get();
+		jobs.push_back(job);
 	}
-	TCP::Client input(url, port);
-	HTTP::Request req(url, "GET", path);
-	req.Send(input);
-	map<string, string> m;
-	string s("");
-	unsigned response_code = HTTP::ParseResponseHeaders(input, &m, &s);
-	if (response_code == 200)
-	{
-		//output.Send("Code %u, reason %s\n", response_code, s.c_str());
-		//HTTP::SendJSON(output, m, false);
-		Socket::Cat(input, output, input, output);
+
+	atomic<size_t> next(0);
+	atomic<unsigned> failures(0);
+	vector<thread> threads;
+	for (unsigned i = 0; i < workers && i < jobs.size(); ++i)
+	{
+		threads.push_back(thread([&]()
+		{
+			for (size_t j = next++; j < jobs.size(); j = next++)
+			{
+				Job & job = jobs[j];
+				HTTP::Client & client = *(job.client);
+				int fd = open(job.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				if (fd < 0)
+				{
+					Error("Couldn't open \"%s\" - %s", job.filename.c_str(), StrError(errno));
+					++failures;
+					continue;
+				}
+				HTTP::Response response;
+				off_t offset = 0;
+				bool ok = client.Send("GET", job.path, response, StringRef(), NULL, [&](const char * data, size_t n)
+				{
+					if (response.Status() != 200 || !WriteAt(fd, data, n, offset))
+						return false;
+					offset += n;
+					return true;
+				});
+				close(fd);
+				if (!ok || response.Status() != 200)
+				{
+					Error("%s:%d%s: %u %s", job.host.c_str(), job.port, job.path.c_str(), response.Status(),
+						response.Reason().c_str());
+					++failures;
+				}
+			}
+		}));
 	}
-	else
+	for (auto & t : threads)
+		t.join();
+	return failures;
+}
+
+int main(int argc, char ** argv)
+{
+	unsigned segments = 1;
+	const char * list = NULL;
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; ++arg)
+	{
+		if (strcmp(argv[arg], "-n") == 0 && arg+1 < argc)
+			segments = max(1, atoi(argv[++arg]));
+		else if (strcmp(argv[arg], "-i") == 0 && arg+1 < argc)
+			list = argv[++arg];
+		else
+			break;
+	}
+	if (list != NULL)
+	{
+		string directory = (arg < argc) ? argv[arg] : ".";
+		unsigned failures = 0;
+		if (strcmp(list, "-") == 0)
+			failures = Batch(cin, directory, segments);
+		else
+		{
+			ifstream file(list);
+			if (!file)
+				Fatal("Couldn't open \"%s\"", list);
+			failures = Batch(file, directory, segments);
+		}
+		return (failures == 0) ? 0 : 1;
+	}
+	if (arg >= argc)
+		Fatal("Usage: %s [-n segments] url [output]\n       %s [-n workers] -i url_list [directory]", argv[0], argv[0]);
+
+	string host, path;
+	int port = 80;
+	SplitURL(argv[arg], host, port, path);
+	const char * filename = (arg+1 < argc) ? argv[arg+1] : NULL;
+	HTTP::Client client(host, port, segments);
+	if (filename != NULL && segments > 1 && Segmented(client, path, filename, segments))
+		return 0;
+
+	FILE * o = (filename != NULL) ? fopen(filename, "w") : stdout;
+	Socket output(o);
+	HTTP::Response response;
+	// Stream a successful body straight to the output
+	bool ok = client.Send("GET", path, response, StringRef(), NULL, [&](const char * data, size_t size)
+	{
+		return (response.Status() != 200) ? (response.Body().append(data, size), true)
+			: output.SendRaw(data, size) == (int)size;
+	});
+	if (!ok)
+		Fatal("No response from %s:%d", host.c_str(), port);
+	if (response.Status() != 200)
 	{
-		output.Send("Response code was \"%u %s\"\nHeaders were:\n", response_code, s.c_str());
-		HTTP::SendJSON(output, m, false);
+		output.Send("Response code was \"%u %s\"\nHeaders were:\n", response.Status(), response.Reason().c_str());
+		HTTP::SendJSON(output, response.Headers(), false);
 	}
 }
@@ -0,0 +1,220 @@
+/**
+ * @file wsbench.cpp
+ * @brief Load generator for WebSocket servers (see wsserver.cpp)
+ * Opens clients connections, each on its own thread, for seconds, and reports
+ * 	messages per second and percentiles of their latency. Each message starts
+ * 	with the time it was sent, so the server must run on the same machine.
+ * 	echo: each client sends size byte messages, at most rate a second (0 for
+ * 		as fast as they come back), and times each echo.
+ * 	fanout: clients subscribe to a topic and one more publishes to it rate
+ * 		times a second; every subscriber times every message.
+ * Usage: wsbench [host] [port] [clients] [size] [rate] [seconds] [echo|fanout]
+ */
+
+#include "foxbox.h"
+#include "timerwheel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace Foxbox;
+
+/** Seconds subscribers get to subscribe before publishing starts **/
+#define WSBENCH_SETTLE 0.5
+
+struct Options
+{
+	const char * host;
+	int port;
+	unsigned clients;
+	size_t size;
+	double rate;
+	double seconds;
+	bool fanout;
+};
+
+/** Latencies (nanoseconds) and bytes received, from every thread **/
+struct Results
+{
+	Results() : mutex(), latencies(), bytes(0), failed(0) {}
+	std::mutex mutex;
+	vector<int64_t> latencies;
+	uint64_t bytes;
+	unsigned failed;
+
+	void Add(const vector<int64_t> & some, uint64_t some_bytes)
+	{
+		lock_guard<std::mutex> lock(mutex);
+		latencies.insert(latencies.end(), some.begin(), some.end());
+		bytes += some_bytes;
+	}
+	void Failed()
+	{
+		lock_guard<std::mutex> lock(mutex);
+		++failed;
+	}
+};
+
+/** @returns NULL (and counts a failure) if the connection or handshake fails; Nagle is off **/
+static WS::Client * Connect(const Options & options, Results & results)
+{
+	try
+	{
+		unique_ptr<WS::Client> client(new WS::Client(options.host, options.port, "/", "wsbench"));
+		// Otherwise Nagle holds back small messages until delayed acks arrive, and that is what gets timed
+		int tmp = 1;
+		if (client->Valid() && setsockopt(client->GetFD(), IPPROTO_TCP, TCP_NODELAY, &tmp, sizeof(tmp)) == 0)
+			return client.release();
+	}
+	catch (Exception & e)
+	{
+	}
+	results.Failed();
+	return NULL;
+}
+
+/** A message sent now: the time, then padding to size (so strtoll stops within it) **/
+static string Stamp(const string & prefix, size_t size)
+{
+	string message(prefix + to_string(TimerWheel::Now()) + " ");
+	if (message.size() < size)
+		message.append(size - message.size(), 'x');
+	return message;
+}
+
+/** Sleep until the next message is due (when a rate was set) **/
+static void Pace(const Options & options, int64_t start, uint64_t sent)
+{
+	if (options.rate <= 0)
+		return;
+	int64_t due = start + (int64_t)(sent * 1e9 / options.rate);
+	int64_t now = TimerWheel::Now();
+	if (due > now)
+		usleep((due - now) / 1000);
+}
+
+static void Echo(const Options & options, Results & results, int64_t end)
+{
+	unique_ptr<WS::Client> client(Connect(options, results));
+	if (!client)
+		return;
+	vector<int64_t> latencies;
+	uint64_t bytes = 0;
+	StringRef reply;
+	int64_t start = TimerWheel::Now();
+	while (TimerWheel::Now() < end)
+	{
+		Pace(options, start, latencies.size());
+		if (!client->Send(Stamp("", options.size)) || !client->GetMessage(reply))
+			break;
+		latencies.push_back(TimerWheel::Now() - strtoll(reply.data(), NULL, 10));
+		bytes += reply.size();
+	}
+	results.Add(latencies, bytes);
+}
+
+static void Subscribe(const Options & options, Results & results, int64_t end, atomic<unsigned> & subscribed)
+{
+	unique_ptr<WS::Client> client(Connect(options, results));
+	if (client && !client->Send(string("subscribe bench")))
+	{
+		results.Failed();
+		client.reset();
+	}
+	++subscribed;
+	if (!client)
+		return;
+	vector<int64_t> latencies;
+	uint64_t bytes = 0;
+	StringRef message;
+	// Allow for messages still queued when publishing stops
+	while (TimerWheel::Now() < end + (int64_t)1e9 && client->GetMessage(message, 1))
+	{
+		latencies.push_back(TimerWheel::Now() - strtoll(message.data(), NULL, 10));
+		bytes += message.size();
+	}
+	results.Add(latencies, bytes);
+}
+
+static uint64_t Publish(const Options & options, Results & results, int64_t end)
+{
+	unique_ptr<WS::Client> client(Connect(options, results));
+	uint64_t sent = 0;
+	int64_t start = TimerWheel::Now();
+	while (client && TimerWheel::Now() < end)
+	{
+		Pace(options, start, sent);
+		if (!client->Send(Stamp("publish bench ", options.size + 14)))
+			break;
+		++sent;
+	}
+	return sent;
+}
+
+static double Percentile(const vector<int64_t> & sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	size_t i = min(sorted.size() - 1, (size_t)(p * sorted.size()));
+	return sorted[i] / 1e6;
+}
+
+int main(int argc, char ** argv)
+{
+	Options options;
+	options.host = (argc >= 2) ? argv[1] : "127.0.0.1";
+	options.port = (argc >= 3) ? atoi(argv[2]) : 7681;
+	options.clients = (argc >= 4) ? atoi(argv[3]) : 10;
+	options.size = (argc >= 5) ? strtoul(argv[4], NULL, 10) : 64;
+	options.rate = (argc >= 6) ? atof(argv[5]) : 0;
+	options.seconds = (argc >= 7) ? atof(argv[6]) : 5;
+	options.fanout = (argc >= 8) && strcmp(argv[7], "fanout") == 0;
+
+	Results results;
+	vector<thread> threads;
+	uint64_t published = 0;
+	int64_t start = TimerWheel::Now();
+	if (!options.fanout)
+	{
+		int64_t end = start + (int64_t)(options.seconds * 1e9);
+		for (unsigned i = 0; i < options.clients; ++i)
+			threads.push_back(thread(Echo, cref(options), ref(results), end));
+	}
+	else
+	{
+		atomic<unsigned> subscribed(0);
+		int64_t end = start + (int64_t)((WSBENCH_SETTLE + options.seconds) * 1e9);
+		for (unsigned i = 0; i < options.clients; ++i)
+			threads.push_back(thread(Subscribe, cref(options), ref(results), end, ref(subscribed)));
+		while (subscribed < options.clients)
+			usleep(10000);
+		usleep(WSBENCH_SETTLE * 1e6);
+		start = TimerWheel::Now();
+		published = Publish(options, results, end);
+	}
+	for (auto & t : threads)
+		t.join();
+	double elapsed = min((TimerWheel::Now() - start) / 1e9, options.seconds);
+
+	sort(results.latencies.begin(), results.latencies.end());
+	size_t received = results.latencies.size();
+	printf("%s: %u clients (%u failed), %zu byte messages, %.1f s\n", options.fanout ? "fanout" : "echo",
+		options.clients, results.failed, options.size, elapsed);
+	if (options.fanout)
+	{
+		printf("published %lu, received %zu of %lu\n", (unsigned long)published, received,
+			(unsigned long)(published * (options.clients - min(results.failed, options.clients))));
+	}
+	printf("%.0f messages/s, %.1f MB/s\n", received / elapsed, results.bytes / elapsed / 1e6);
+	printf("latency ms: p50 %.3f p99 %.3f p999 %.3f max %.3f\n", Percentile(results.latencies, 0.5),
+		Percentile(results.latencies, 0.99), Percentile(results.latencies, 0.999),
+		received ? results.latencies.back() / 1e6 : 0.0);
+	return (results.failed == 0 && received > 0) ? 0 : 1;
+}
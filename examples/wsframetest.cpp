@@ -0,0 +1,65 @@
+/**
+ * @file wsframetest.cpp
+ * @brief Regression checks for WS::FrameParser against hostile frame lengths
+ * A 5 byte fragment followed by a continuation claiming 2^64 - 5 bytes once
+ * 	wrapped the size checks, so the parser unmasked (and validated) far past
+ * 	its buffer. Both a server's and a client's parser must fail it instead.
+ * Usage: wsframetest (exits 1 if a check fails)
+ */
+
+#include "foxbox.h"
+
+using namespace std;
+using namespace Foxbox;
+
+/** A frame with a payload of data, claiming size bytes **/
+static string MakeFrame(unsigned opcode, bool fin, bool masked, uint64_t size, const string & data)
+{
+	WS::Header header(opcode, size, fin);
+	header.masked = masked;
+	header.key = 0x12345678;
+	uint8_t buffer[WSFRAME_MAX_HEADER];
+	string frame((char*)buffer, WS::EncodeHeader(buffer, header));
+	string payload(data);
+	if (masked)
+		WS::Mask(&payload[0], payload.size(), header.key);
+	return frame + payload;
+}
+
+/** Feed the frames to a parser @returns the close code it failed with (0 if it didn't) **/
+static unsigned Parse(bool masked, const string & frames)
+{
+	WS::FrameParser parser(masked);
+	parser.Append(frames.data(), frames.size());
+	WS::FrameParser::Message message;
+	WS::FrameParser::Result result;
+	while ((result = parser.Next(message)) != WS::FrameParser::MORE)
+	{
+		if (result == WS::FrameParser::FAILED)
+			return parser.Failure();
+	}
+	return 0;
+}
+
+static bool Check(const char * name, bool masked, uint64_t size, unsigned expected)
+{
+	string frames = MakeFrame(WS::TEXT, false, masked, 5, "hello")
+		+ MakeFrame(WS::CONTINUATION, true, masked, size, string(64, 'x'));
+	unsigned code = Parse(masked, frames);
+	printf("%s %s, %s parser, length %#llx: %u (expected %u)\n", (code == expected) ? "PASS" : "FAIL", name,
+		masked ? "server" : "client", (unsigned long long)size, code, expected);
+	return code == expected;
+}
+
+int main()
+{
+	bool ok = true;
+	for (int masked = 1; masked >= 0; --masked)
+	{
+		ok &= Check("top bit", masked, 0xfffffffffffffffbULL, WS::CLOSE_PROTOCOL_ERROR);
+		ok &= Check("over limit", masked, 0x7ffffffffffffffbULL, WS::CLOSE_TOO_BIG);
+		ok &= Check("incomplete", masked, 65, 0);
+		ok &= Check("complete", masked, 64, 0);
+	}
+	return ok ? 0 : 1;
+}
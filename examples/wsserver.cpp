@@ -1,50 +1,59 @@
 /**
  * @file wsserver.cpp
  * @brief A Websocket server example
+ * Echoes every message back to its sender, for any number of clients, except:
+ * 	"subscribe <topic>" and "coalesce <topic>" subscribe to a topic (the second
+ * 	for only the latest message when slow), "unsubscribe <topic>" stops, and
+ * 	"publish <topic> <message>" sends message to its subscribers
+ * Clients are pinged every 2s, and dropped if they miss 3 pings
+ * Usage: wsserver [port] [io_threads] [deflate]
  */
- 
+
 #include "foxbox.h"
-#include <unistd.h>
 
 using namespace std;
 using namespace Foxbox;
- 
+
 int main(int argc, char ** argv)
 {
-	int port = (argc == 2) ? atoi(argv[1]) : 7681;
-	
-	Socket input(stdin);
-	Socket output(stdout);
-	while (true)
+	int port = (argc >= 2) ? atoi(argv[1]) : 7681;
+	unsigned io_threads = (argc >= 3) ? atoi(argv[2]) : 2;
+
+	WS::EventServer server(port, io_threads);
+	server.KeepAlive(2);
+	if (argc >= 4 && strcmp(argv[3], "deflate") == 0)
+		server.Compression(WS::DeflateConfig());
+	WS::Hub hub;
+	server.OnOpen([&](const WS::EventServer::SessionPtr & session)
 	{
-		WS::Server server(port);
-		while (true)
+		Debug("Connected %s to %s (%zu open)", session->Peer(), session->Request().Path().c_str(), server.Sessions());
+	});
+	server.OnMessage([&](const WS::EventServer::SessionPtr & session, WS::Opcode opcode, const StringRef & message)
+	{
+		string text(message.data(), min(message.size(), (size_t)256));
+		stringstream s(text);
+		string command, topic;
+		s >> command >> topic;
+		if (opcode != WS::TEXT || topic.empty())
+			session->Send(opcode, message.data(), message.size());
+		else if (command == "subscribe" || command == "coalesce")
+			hub.Subscribe(session, topic, (command == "coalesce") ? WS::Hub::COALESCE : WS::Hub::DROP);
+		else if (command == "unsubscribe")
+			hub.Unsubscribe(session, topic);
+		else if (command == "publish")
 		{
-			Debug("Listen");
-			server.Listen();
-			Debug("Connected");
-			if (!server.Valid())
-			{
-				Debug("Invalide!");
-				HTTP::SendPlain(server.TCP(), 400, "This is a WebSocket server");
-				server.Close();
-				continue;
-			}
-			while (server.Valid())
-			{
-				Debug("Send Ping! %d", server.Send("Ping!\n"));
-				
-				sleep(1);
-				string message("");
-				//server.GetMessage(message);
-				// GetToken returns false if the token is empty.
-				if (server.GetToken(message, "\n"))
-					Debug("Response is %s", message.c_str());
-				//else
-				//	Debug("Response is empty.");
-				
-			}
-			server.Close();
+			size_t start = min(command.size() + topic.size() + 2, message.size());
+			hub.Publish(topic, WS::TEXT, message.data() + start, message.size() - start);
 		}
-	}
+		else
+			session->Send(opcode, message.data(), message.size());
+	});
+	server.OnClose([&](const WS::EventServer::SessionPtr & session, unsigned code)
+	{
+		hub.Unsubscribe(session);
+		Debug("Closed %s with %u (round trip %.3fms)", session->Peer(), code, 1e3 * session->RTT());
+	});
+	Debug("Serving WebSockets on port %d with %u IO threads", port, io_threads);
+	server.Run();
+	return 0;
 }
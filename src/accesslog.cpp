@@ -0,0 +1,233 @@
+/**
+ * @file accesslog.cpp
+ * @brief Asynchronous HTTP access log - Definitions
+ * @see accesslog.h - Declarations
+ */
+
+#include "accesslog.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+using namespace std;
+
+namespace Foxbox {namespace HTTP
+{
+
+/** How often the writer drains the rings, in milliseconds **/
+#define ACCESSLOG_INTERVAL 100
+
+static atomic<uint64_t> g_next_id(1);
+
+AccessLog::AccessLog(const string & filename, Format format, size_t rotate_bytes, unsigned keep)
+	: m_filename(filename), m_format(format), m_rotate_bytes(rotate_bytes), m_keep(max(keep, 1u)),
+	m_id(g_next_id++), m_fd(-1), m_size(0), m_buffer(), m_json(false), m_rings_mutex(), m_rings(),
+	m_dropped(0), m_drain_mutex(), m_mutex(), m_wake(), m_running(true), m_thread()
+{
+	Open();
+	m_thread = thread(&AccessLog::Run, this);
+}
+
+AccessLog::~AccessLog()
+{
+	m_mutex.lock();
+	m_running = false;
+	m_mutex.unlock();
+	m_wake.notify_all();
+	m_thread.join();
+	Flush();
+	if (m_fd >= 0)
+		close(m_fd);
+	for (auto ring : m_rings)
+		delete ring;
+}
+
+void AccessLog::Open()
+{
+	m_fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (m_fd < 0)
+	{
+		Error("Couldn't open access log \"%s\" - %s", m_filename.c_str(), StrError(errno));
+		return;
+	}
+	off_t end = lseek(m_fd, 0, SEEK_END);
+	m_size = (end < 0) ? 0 : end;
+}
+
+void AccessLog::Rotate()
+{
+	close(m_fd);
+	m_fd = -1;
+	for (unsigned i = m_keep; i > 1; --i)
+		rename((m_filename + "." + to_string(i-1)).c_str(), (m_filename + "." + to_string(i)).c_str());
+	if (rename(m_filename.c_str(), (m_filename + ".1").c_str()) != 0)
+		Error("Couldn't rotate access log \"%s\" - %s", m_filename.c_str(), StrError(errno));
+	Open();
+}
+
+AccessLog::Ring * AccessLog::LocalRing()
+{
+	// Logs are told apart by id, so a destroyed log's entry can never be mistaken for a new one's
+	static thread_local vector<pair<uint64_t, Ring*> > rings;
+	for (auto & r : rings)
+	{
+		if (r.first == m_id)
+			return r.second;
+	}
+	Ring * ring = new Ring();
+	m_rings_mutex.lock();
+	m_rings.push_back(ring);
+	m_rings_mutex.unlock();
+	rings.push_back(make_pair(m_id, ring));
+	return ring;
+}
+
+/** Copy s into a fixed size, null terminated field **/
+static inline void Copy(char * field, size_t size, const StringRef & s)
+{
+	size_t n = min(s.size(), size - 1);
+	memcpy(field, s.data(), n);
+	field[n] = '\0';
+}
+
+void AccessLog::Add(const StringRef & method, const StringRef & path, unsigned status, uint64_t bytes,
+	double seconds, const StringRef & peer)
+{
+	Ring * ring = LocalRing();
+	uint64_t head = ring->head.load(memory_order_relaxed);
+	uint64_t queued = head - ring->tail.load(memory_order_acquire);
+	if (queued >= ACCESSLOG_RING)
+	{
+		++m_dropped;
+		return;
+	}
+	Record & r = ring->records[head % ACCESSLOG_RING];
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	r.time = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	r.latency = (uint32_t)min(max(seconds, 0.0) * 1e6, 4e9);
+	r.status = status;
+	r.bytes = bytes;
+	Copy(r.method, sizeof(r.method), method);
+	Copy(r.peer, sizeof(r.peer), peer);
+	r.path_size = min(path.size(), sizeof(r.path));
+	memcpy(r.path, path.data(), r.path_size);
+	ring->head.store(head + 1, memory_order_release);
+	// Don't wait for the next interval if a burst is filling the ring (notify never blocks)
+	if (queued == ACCESSLOG_RING / 2)
+		m_wake.notify_one();
+}
+
+void AccessLog::Run()
+{
+	unique_lock<mutex> lock(m_mutex);
+	while (m_running)
+	{
+		m_wake.wait_for(lock, chrono::milliseconds(ACCESSLOG_INTERVAL));
+		lock.unlock();
+		Flush();
+		lock.lock();
+	}
+}
+
+void AccessLog::Flush()
+{
+	lock_guard<mutex> lock(m_drain_mutex);
+	Drain();
+}
+
+void AccessLog::Drain()
+{
+	m_rings_mutex.lock();
+	vector<Ring*> rings(m_rings);
+	m_rings_mutex.unlock();
+	for (auto ring : rings)
+	{
+		uint64_t tail = ring->tail.load(memory_order_relaxed);
+		uint64_t head = ring->head.load(memory_order_acquire);
+		for (uint64_t i = tail; i < head; ++i)
+			Append(ring->records[i % ACCESSLOG_RING]);
+		ring->tail.store(head, memory_order_release);
+	}
+	if (m_buffer.empty())
+		return;
+	if (m_fd < 0)
+		Open();
+	// The whole batch in one write
+	const char * p = m_buffer.data();
+	size_t left = m_buffer.size();
+	while (m_fd >= 0 && left > 0)
+	{
+		ssize_t written = write(m_fd, p, left);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+		{
+			Error("Couldn't write access log \"%s\" - %s", m_filename.c_str(), StrError(errno));
+			break;
+		}
+		p += written;
+		left -= written;
+		m_size += written;
+	}
+	m_buffer.clear();
+	if (m_fd >= 0 && m_rotate_bytes > 0 && m_size >= m_rotate_bytes)
+		Rotate();
+}
+
+/** Append s with '"', '\' and non printable characters as \xHH (as Apache does) **/
+static void AppendEscaped(string & out, const char * s, size_t size)
+{
+	static const char hex[] = "0123456789abcdef";
+	for (size_t i = 0; i < size; ++i)
+	{
+		unsigned char c = s[i];
+		if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\')
+		{
+			out += "\\x";
+			out += hex[c >> 4];
+			out += hex[c & 0xf];
+		}
+		else
+			out += c;
+	}
+}
+
+void AccessLog::Append(const Record & r)
+{
+	time_t seconds = r.time / 1000000;
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	char date[64];
+	const char * method = (r.method[0] == '\0') ? "-" : r.method;
+	const char * peer = (r.peer[0] == '\0') ? "-" : r.peer;
+	if (m_format == JSON)
+	{
+		size_t n = strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+		n += snprintf(date + n, sizeof(date) - n, ".%06uZ", (unsigned)(r.time % 1000000));
+		m_json.Clear();
+		m_json.BeginObject().Field("time", StringRef(date, n)).Field("peer", peer).Field("method", method)
+			.Field("path", StringRef(r.path, r.path_size)).Field("status", (unsigned)r.status)
+			.Field("bytes", (unsigned long long)r.bytes).Field("latency_us", r.latency).EndObject();
+		m_buffer += m_json.Str();
+		m_buffer += '\n';
+		return;
+	}
+	strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+	char line[128];
+	m_buffer += peer;
+	m_buffer.append(line, snprintf(line, sizeof(line), " - - [%s] \"", date));
+	m_buffer += method;
+	m_buffer += ' ';
+	AppendEscaped(m_buffer, r.path, r.path_size);
+	if (r.bytes == 0)
+		m_buffer.append(line, snprintf(line, sizeof(line), " HTTP/1.1\" %u - %u\n", r.status, r.latency));
+	else
+		m_buffer.append(line, snprintf(line, sizeof(line), " HTTP/1.1\" %u %llu %u\n", r.status,
+			(unsigned long long)r.bytes, r.latency));
+}
+
+}}
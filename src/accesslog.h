@@ -0,0 +1,132 @@
+/**
+ * @file accesslog.h
+ * @brief Asynchronous HTTP access log - Declarations
+ * @see accesslog.cpp - Definitions
+ * @see httpserver.h - HTTP::Server logs each request to an AccessLog
+ */
+
+#ifndef _ACCESSLOG_H
+#define _ACCESSLOG_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "http.h"
+#include "json.h"
+
+namespace Foxbox
+{
+	namespace HTTP
+	{
+		/** Records each thread can queue before the writer catches up (more are dropped) **/
+		#define ACCESSLOG_RING 1024
+		/** Longest path recorded (longer ones are truncated) **/
+		#define ACCESSLOG_PATH 256
+
+		/**
+		 * Logs requests to a file without blocking the threads handling them
+		 * Each thread logging gets its own single producer, single consumer ring
+		 * 	of fixed size records; Add copies into the next slot and publishes it
+		 * 	with one atomic store (if the ring is full the record is dropped and
+		 * 	counted). A writer thread drains every ring periodically and writes
+		 * 	the batch with one write(2), rotating the file when it is too big; a
+		 * 	ring filling up wakes it early.
+		 * Records from different threads may be written slightly out of order.
+		 * Formats:
+		 * 	CLF: peer - - [10/Oct/2000:13:55:36 +0000] "GET /a HTTP/1.1" 200 2326 1234
+		 * 		(Common Log Format plus latency in microseconds; bytes include headers)
+		 * 	JSON: one object per line, with the same fields
+		 * Usage: server.SetAccessLog(&log);
+		 */
+		class AccessLog
+		{
+			public:
+				enum Format {CLF, JSON};
+
+				/**
+				 * @param filename File to append to
+				 * @param rotate_bytes Rotate when the file reaches this size (0 never)
+				 * @param keep Rotated files kept (filename.1 is the newest)
+				 */
+				AccessLog(const std::string & filename, Format format = CLF, size_t rotate_bytes = 0, unsigned keep = 4);
+				/** Writes whatever is queued **/
+				virtual ~AccessLog();
+
+				/**
+				 * Record a request; never blocks
+				 * @param seconds Time taken to respond
+				 */
+				void Add(const StringRef & method, const StringRef & path, unsigned status, uint64_t bytes,
+					double seconds, const StringRef & peer);
+				void Add(Request & req, unsigned status, uint64_t bytes, double seconds, const StringRef & peer)
+				{
+					Add(req.Method(), req.URI(), status, bytes, seconds, peer);
+				}
+
+				/** Write everything queued so far **/
+				void Flush();
+				/** Records dropped because a ring was full **/
+				uint64_t Dropped() const {return m_dropped;}
+
+			private:
+				AccessLog(const AccessLog & cpy) = delete;
+				AccessLog & operator=(const AccessLog & cpy) = delete;
+
+				struct Record
+				{
+					int64_t time; /** Microseconds since the epoch **/
+					uint32_t latency; /** Microseconds **/
+					uint16_t status;
+					uint16_t path_size;
+					uint64_t bytes;
+					char method[16];
+					char peer[48];
+					char path[ACCESSLOG_PATH];
+				};
+				/** A ring written by one thread and read by the writer; head and tail on separate cache lines **/
+				struct Ring
+				{
+					Ring() : head(0), tail(0) {}
+					std::atomic<uint64_t> head; /** Next record to write **/
+					char pad[64 - sizeof(std::atomic<uint64_t>)];
+					std::atomic<uint64_t> tail; /** Next record to read **/
+					char pad2[64 - sizeof(std::atomic<uint64_t>)];
+					Record records[ACCESSLOG_RING];
+				};
+
+				/** The calling thread's ring (created on first use) **/
+				Ring * LocalRing();
+				void Run();
+				/** Write out every ring (m_drain_mutex held) **/
+				void Drain();
+				void Append(const Record & record);
+				void Open();
+				void Rotate();
+
+				std::string m_filename;
+				Format m_format;
+				size_t m_rotate_bytes;
+				unsigned m_keep;
+				uint64_t m_id; /** Distinguishes this log in threads' lists of rings **/
+				int m_fd;
+				size_t m_size; /** Of the file **/
+				std::string m_buffer;
+				JSON::Writer m_json;
+				std::mutex m_rings_mutex;
+				std::vector<Ring*> m_rings;
+				std::atomic<uint64_t> m_dropped;
+				std::mutex m_drain_mutex; /** Held by whichever thread is draining (only one reads the rings) **/
+				std::mutex m_mutex;
+				std::condition_variable m_wake;
+				bool m_running;
+				std::thread m_thread;
+		};
+	}
+}
+
+#endif //_ACCESSLOG_H
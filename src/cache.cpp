@@ -0,0 +1,625 @@
+/**
+ * @file cache.cpp
+ * @brief HTTP cache with memory and memory-mapped disk tiers - Definitions
+ * @see cache.h - Declarations
+ */
+
+#include "cache.h"
+#include "reverseproxy.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+namespace Foxbox {namespace HTTP
+{
+
+/** Segments in the disk tier; the oldest is dropped to make room for a new one **/
+#define CACHE_SEGMENTS 8
+/** First word of each record in a segment ("FXC1") **/
+#define CACHE_MAGIC 0x31435846
+/** Longest heuristic freshness lifetime (RFC 7234 4.2.2), in seconds **/
+#define CACHE_HEURISTIC_MAX 86400
+
+/** A file of records, mapped into memory; entries in it keep it alive **/
+struct Cache::Segment
+{
+	Segment() : fd(-1), map(NULL), size(0), used(0), keys() {}
+	~Segment()
+	{
+		if (map != NULL)
+			munmap(map, size);
+		if (fd >= 0)
+			close(fd);
+	}
+
+	/** Create (and map) a segment file in directory dir **/
+	bool Open(const string & dir, size_t bytes)
+	{
+		string path(dir + "/foxbox-cache.XXXXXX");
+		vector<char> name(path.begin(), path.end());
+		name.push_back('\0');
+		fd = mkstemp(name.data());
+		if (fd < 0)
+		{
+			Error("Couldn't create cache segment in %s - %s", dir.c_str(), StrError(errno));
+			return false;
+		}
+		// Scratch space; the file goes when its last mapping does
+		unlink(name.data());
+		// Blocks are allocated now; a sparse file could SIGBUS a write through the mapping when the disk fills
+		int err = posix_fallocate(fd, 0, bytes);
+		if (err != 0)
+		{
+			Error("Couldn't allocate %zu bytes for cache segment - %s", bytes, StrError(err));
+			return false;
+		}
+		void * m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (m == MAP_FAILED)
+		{
+			Error("Couldn't map cache segment - %s", StrError(errno));
+			return false;
+		}
+		map = (char*)m;
+		size = bytes;
+		return true;
+	}
+
+	int fd;
+	char * map;
+	size_t size;
+	size_t used;
+	vector<string> keys; /** Keys of the records written to it **/
+};
+
+/** Next comma separated item of a header value, without surrounding space @returns false at the end **/
+static bool NextItem(const char *& p, const char * end, StringRef & item)
+{
+	while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) ++p;
+	if (p >= end)
+		return false;
+	const char * start = p;
+	while (p < end && *p != ',') ++p;
+	const char * last = p;
+	while (last > start && (last[-1] == ' ' || last[-1] == '\t')) --last;
+	item = StringRef(start, last - start);
+	return true;
+}
+
+/** Non negative decimal number of seconds, or -1 **/
+static long Seconds(const StringRef & s)
+{
+	const char * p = s.begin();
+	const char * end = s.end();
+	if (p < end && *p == '"') ++p;
+	if (p >= end || *p < '0' || *p > '9')
+		return -1;
+	long seconds = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; ++p)
+		seconds = (seconds > (1L << 40)) ? seconds : seconds * 10 + (*p - '0');
+	return seconds;
+}
+
+/** An RFC 1123 date (as in Date, Expires, ...), or -1 **/
+static time_t ParseDate(const StringRef & s)
+{
+	char buffer[64];
+	if (s.empty() || s.size() >= sizeof(buffer))
+		return -1;
+	memcpy(buffer, s.data(), s.size());
+	buffer[s.size()] = '\0';
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	if (strptime(buffer, "%a, %d %b %Y %H:%M:%S", &tm) == NULL)
+		return -1;
+	return timegm(&tm);
+}
+
+/** Cache-Control directives (-1 for absent numbers) **/
+struct CacheControl
+{
+	CacheControl(const StringRef & value) : no_store(false), no_cache(false), is_private(false),
+		must_revalidate(false), max_age(-1), s_maxage(-1), stale_while_revalidate(-1)
+	{
+		const char * p = value.begin();
+		StringRef item;
+		while (NextItem(p, value.end(), item))
+		{
+			const char * equals = (const char*)memchr(item.data(), '=', item.size());
+			StringRef name(item.data(), (equals == NULL) ? item.size() : equals - item.data());
+			StringRef arg = (equals == NULL) ? StringRef() : StringRef(equals + 1, item.end() - equals - 1);
+			if (name.EqualsIgnoreCase("no-store"))
+				no_store = true;
+			else if (name.EqualsIgnoreCase("no-cache"))
+				no_cache = true;
+			else if (name.EqualsIgnoreCase("private"))
+				is_private = true;
+			else if (name.EqualsIgnoreCase("must-revalidate") || name.EqualsIgnoreCase("proxy-revalidate"))
+				must_revalidate = true;
+			else if (name.EqualsIgnoreCase("max-age"))
+				max_age = Seconds(arg);
+			else if (name.EqualsIgnoreCase("s-maxage"))
+				s_maxage = Seconds(arg);
+			else if (name.EqualsIgnoreCase("stale-while-revalidate"))
+				stale_while_revalidate = Seconds(arg);
+		}
+	}
+	bool no_store;
+	bool no_cache;
+	bool is_private;
+	bool must_revalidate;
+	long max_age;
+	long s_maxage;
+	long stale_while_revalidate;
+};
+
+/** Append the headers a cache keeps ("name: value\r\n" each); framing, Age and hop-by-hop headers are not **/
+static void AppendEndToEnd(string & s, Headers & headers)
+{
+	StringRef connection(headers.Get(HEADER_CONNECTION));
+	for (size_t i = 0; i < headers.Size(); ++i)
+	{
+		HeaderID id = headers.ID(i);
+		if (id == HEADER_CONTENT_LENGTH || id == HEADER_AGE || HopByHop(id, headers.Name(i), connection))
+			continue;
+		s.append(headers.Name(i).data(), headers.Name(i).size());
+		s += ": ";
+		s.append(headers.Value(i).data(), headers.Value(i).size());
+		s += "\r\n";
+	}
+}
+
+/** Copy an entry, body reference included (but not its revalidating flag) **/
+static void CopyEntry(Cache::Entry & to, const Cache::Entry & from)
+{
+	to.key = from.key;
+	to.status = from.status;
+	to.status_line = from.status_line;
+	to.head = from.head;
+	to.body = from.body;
+	to.body_size = from.body_size;
+	to.storage = from.storage;
+	to.response_time = from.response_time;
+	to.age = from.age;
+	to.lifetime = from.lifetime;
+	to.stale_while_revalidate = from.stale_while_revalidate;
+	to.must_revalidate = from.must_revalidate;
+	to.etag = from.etag;
+	to.last_modified = from.last_modified;
+	to.request = from.request;
+}
+
+Cache::Cache(size_t memory_bytes, const string & disk_path, size_t disk_bytes, size_t max_object)
+	: m_memory_bytes(memory_bytes), m_disk_path(disk_path), m_segment_bytes(disk_bytes / CACHE_SEGMENTS),
+	m_max_object(max_object), m_mutex(), m_index(), m_uris(), m_lru(), m_memory_used(0), m_segments(),
+	m_background(1)
+{
+	// Segments are mapped whole, so they are a multiple of the page size
+	size_t page = sysconf(_SC_PAGESIZE);
+	m_segment_bytes -= m_segment_bytes % page;
+	if (m_segment_bytes == 0)
+		m_disk_path.clear();
+}
+
+Cache::~Cache()
+{
+	// Revalidations finish before the index goes
+	m_background.Stop();
+}
+
+bool Cache::Cacheable(Request & req)
+{
+	if (req.Method() != "GET" && req.Method() != "HEAD")
+		return false;
+	Headers & headers = req.Headers();
+	if (headers.Has(HEADER_AUTHORIZATION) || headers.Has(HEADER_RANGE))
+		return false;
+	return !CacheControl(headers.Get(HEADER_CACHE_CONTROL)).no_store;
+}
+
+bool Cache::Storable(Response & response) const
+{
+	switch (response.Status())
+	{
+		case 200: case 203: case 204: case 300: case 301: case 308: case 404: case 410:
+			break;
+		default:
+			return false;
+	}
+	Headers & headers = response.Headers();
+	CacheControl cc(headers.Get(HEADER_CACHE_CONTROL));
+	if (cc.no_store || cc.is_private || headers.Has(HEADER_SET_COOKIE) || headers.Has(HEADER_TRANSFER_ENCODING))
+		return false;
+	StringRef vary(headers.Get(HEADER_VARY));
+	if (memchr(vary.data(), '*', vary.size()) != NULL)
+		return false;
+	// Only bodies of known size are stored, so one too big is never buffered
+	if (headers.Has(HEADER_CONTENT_LENGTH))
+	{
+		long length = Seconds(headers.Get(HEADER_CONTENT_LENGTH));
+		if (length < 0 || (size_t)length > m_max_object)
+			return false;
+	}
+	else if (response.Status() != 204)
+		return false;
+	// Worth keeping if it can be fresh, or can be revalidated
+	return cc.max_age >= 0 || cc.s_maxage >= 0 || headers.Has(HEADER_EXPIRES)
+		|| headers.Has(HEADER_ETAG) || headers.Has(HEADER_LAST_MODIFIED);
+}
+
+string Cache::Key(const string & uri, const StringRef & vary, const Headers & request)
+{
+	string key(uri);
+	const char * p = vary.begin();
+	StringRef name;
+	while (NextItem(p, vary.end(), name))
+	{
+		key += '\n';
+		for (size_t i = 0; i < name.size(); ++i)
+			key += tolower(name[i]);
+		key += '=';
+		StringRef value(request.Get(name));
+		key.append(value.data(), value.size());
+	}
+	return key;
+}
+
+void Cache::Freshen(Entry & entry, Headers & headers, time_t now)
+{
+	CacheControl cc(headers.Get(HEADER_CACHE_CONTROL));
+	time_t date = ParseDate(headers.Get(HEADER_DATE));
+	if (date < 0)
+		date = now;
+	// RFC 7234 4.2.3, taking the response delay as 0
+	long age = Seconds(headers.Get(HEADER_AGE));
+	entry.response_time = now;
+	entry.age = max((time_t)max(age, 0L), (now > date) ? now - date : 0);
+
+	entry.lifetime = 0;
+	if (cc.no_cache)
+		entry.lifetime = 0;
+	else if (cc.s_maxage >= 0)
+		entry.lifetime = cc.s_maxage;
+	else if (cc.max_age >= 0)
+		entry.lifetime = cc.max_age;
+	else if (headers.Has(HEADER_EXPIRES))
+	{
+		// An invalid date means already expired
+		time_t expires = ParseDate(headers.Get(HEADER_EXPIRES));
+		entry.lifetime = (expires > date) ? expires - date : 0;
+	}
+	else
+	{
+		// A tenth of the time since it was last modified
+		time_t modified = ParseDate(headers.Get(HEADER_LAST_MODIFIED));
+		if (modified >= 0 && modified < date)
+			entry.lifetime = min((time_t)CACHE_HEURISTIC_MAX, (date - modified) / 10);
+	}
+	entry.stale_while_revalidate = max(cc.stale_while_revalidate, 0L);
+	entry.must_revalidate = cc.must_revalidate || cc.no_cache;
+	entry.etag = headers.Get(HEADER_ETAG).str();
+	entry.last_modified = headers.Get(HEADER_LAST_MODIFIED).str();
+}
+
+Cache::Freshness Cache::Check(const Entry & entry, const Headers & request, time_t now)
+{
+	CacheControl cc(request.Get(HEADER_CACHE_CONTROL));
+	if (cc.no_cache || (!request.Has(HEADER_CACHE_CONTROL) && request.Get(HEADER_PRAGMA).EqualsIgnoreCase("no-cache")))
+		return STALE;
+	time_t age = entry.Age(now);
+	// A client asking for a maximum age doesn't want anything stale either
+	if (cc.max_age >= 0 && age > cc.max_age)
+		return STALE;
+	if (age < entry.lifetime)
+		return FRESH;
+	if (!entry.must_revalidate && age < entry.lifetime + entry.stale_while_revalidate)
+		return STALE_WHILE_REVALIDATE;
+	return STALE;
+}
+
+Cache::EntryPtr Cache::Find(const string & uri, const Headers & request)
+{
+	lock_guard<mutex> lock(m_mutex);
+	auto u = m_uris.find(uri);
+	if (u == m_uris.end())
+		return EntryPtr();
+	auto it = m_index.find(Key(uri, u->second.vary, request));
+	if (it == m_index.end())
+		return EntryPtr();
+	if (it->second.in_memory)
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+	return it->second.entry;
+}
+
+Cache::EntryPtr Cache::Store(const string & uri, const Headers & request, Response & response)
+{
+	Headers & headers = response.Headers();
+	StringRef vary(headers.Get(HEADER_VARY));
+	shared_ptr<Entry> entry(new Entry());
+	entry->key = Key(uri, vary, request);
+	entry->status = response.Status();
+	char status[32];
+	entry->status_line.append(status, snprintf(status, sizeof(status), "HTTP/1.1 %u ", response.Status()));
+	entry->status_line += response.Reason();
+	entry->status_line += "\r\n";
+	AppendEndToEnd(entry->head, headers);
+	Freshen(*entry, headers, time(NULL));
+	const char * p = vary.begin();
+	StringRef name;
+	while (NextItem(p, vary.end(), name))
+		entry->request.Add(name, request.Get(name));
+
+	shared_ptr<string> body(new string());
+	body->swap(response.Body());
+	entry->body = body->data();
+	entry->body_size = body->size();
+	entry->storage = body;
+	if (entry->body_size > m_max_object || entry->Size() > m_memory_bytes)
+		return entry;
+
+	lock_guard<mutex> lock(m_mutex);
+	auto u = m_uris.find(uri);
+	if (u != m_uris.end() && vary != u->second.vary)
+	{
+		// Variants keyed on other headers can't be found any more
+		vector<string> keys(u->second.keys);
+		for (auto & key : keys)
+			Erase(key);
+	}
+	m_uris[uri].vary = vary.str();
+	Insert(entry);
+	Evict();
+	return entry;
+}
+
+Cache::EntryPtr Cache::Refresh(const EntryPtr & entry, Response & response)
+{
+	// Stored headers are replaced by those in the 304 (RFC 7234 4.3.4)
+	shared_ptr<Entry> fresh(new Entry());
+	CopyEntry(*fresh, *entry);
+	Headers & headers = response.Headers();
+	const string & old = entry->head;
+	fresh->head.clear();
+	for (size_t pos = 0; pos < old.size(); )
+	{
+		size_t eol = old.find("\r\n", pos);
+		eol = (eol == string::npos) ? old.size() : eol + 2;
+		size_t colon = old.find(':', pos);
+		if (colon > eol || !headers.Has(StringRef(old.data() + pos, colon - pos)))
+			fresh->head.append(old, pos, eol - pos);
+		pos = eol;
+	}
+	AppendEndToEnd(fresh->head, headers);
+	Headers merged;
+	ParseResponseHead(fresh->status_line + fresh->head + "\r\n", merged);
+	Freshen(*fresh, merged, time(NULL));
+
+	lock_guard<mutex> lock(m_mutex);
+	auto it = m_index.find(fresh->key);
+	if (it == m_index.end() || it->second.entry.get() != entry.get())
+		return fresh;
+	if (it->second.in_memory)
+	{
+		m_memory_used -= entry->Size();
+		m_memory_used += fresh->Size();
+	}
+	it->second.entry = fresh;
+	Evict();
+	return fresh;
+}
+
+void Cache::Remove(const string & uri)
+{
+	lock_guard<mutex> lock(m_mutex);
+	auto u = m_uris.find(uri);
+	if (u == m_uris.end())
+		return;
+	vector<string> keys(u->second.keys);
+	for (auto & key : keys)
+		Erase(key);
+}
+
+size_t Cache::Size()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_index.size();
+}
+
+void Cache::Insert(const shared_ptr<Entry> & entry)
+{
+	Erase(entry->key);
+	m_lru.push_front(entry->key);
+	Slot & slot = m_index[entry->key];
+	slot.entry = entry;
+	slot.lru = m_lru.begin();
+	slot.in_memory = true;
+	m_memory_used += entry->Size();
+	m_uris[entry->URI()].keys.push_back(entry->key);
+}
+
+void Cache::Erase(const string & key)
+{
+	auto it = m_index.find(key);
+	if (it == m_index.end())
+		return;
+	string uri(it->second.entry->URI());
+	if (it->second.in_memory)
+	{
+		m_memory_used -= it->second.entry->Size();
+		m_lru.erase(it->second.lru);
+	}
+	m_index.erase(it);
+	auto u = m_uris.find(uri);
+	if (u == m_uris.end())
+		return;
+	vector<string> & keys = u->second.keys;
+	keys.erase(remove(keys.begin(), keys.end(), key), keys.end());
+	if (keys.empty())
+		m_uris.erase(u);
+}
+
+void Cache::Evict()
+{
+	while (m_memory_used > m_memory_bytes && !m_lru.empty())
+	{
+		string key(m_lru.back());
+		shared_ptr<Entry> entry(m_index[key].entry);
+		shared_ptr<Entry> disk(m_disk_path.empty() ? NULL : Demote(*entry));
+		if (disk == NULL)
+		{
+			Erase(key);
+			continue;
+		}
+		Slot & slot = m_index[key];
+		m_memory_used -= entry->Size();
+		m_lru.pop_back();
+		slot.entry = disk;
+		slot.in_memory = false;
+	}
+}
+
+shared_ptr<Cache::Entry> Cache::Demote(const Entry & entry)
+{
+	size_t size = sizeof(RecordHeader) + entry.key.size() + entry.status_line.size() + entry.head.size() + entry.body_size;
+	size = (size + 7) & ~(size_t)7;
+	if (size > m_segment_bytes)
+		return NULL;
+	if (m_segments.empty() || m_segments.back()->used + size > m_segments.back()->size)
+	{
+		if (m_segments.size() >= CACHE_SEGMENTS)
+		{
+			// Entries still in the oldest segment go with it; a sender holding one keeps the mapping until done
+			shared_ptr<Segment> oldest(m_segments.front());
+			m_segments.pop_front();
+			for (auto & key : oldest->keys)
+			{
+				auto it = m_index.find(key);
+				if (it != m_index.end() && !it->second.in_memory && it->second.entry->storage.get() == oldest.get())
+					Erase(key);
+			}
+		}
+		shared_ptr<Segment> segment(new Segment());
+		if (!segment->Open(m_disk_path, m_segment_bytes))
+		{
+			Warn("Cache disk tier disabled");
+			m_disk_path.clear();
+			return NULL;
+		}
+		m_segments.push_back(segment);
+	}
+
+	Segment & segment = *(m_segments.back());
+	char * record = segment.map + segment.used;
+	RecordHeader header;
+	header.magic = CACHE_MAGIC;
+	header.key_size = entry.key.size();
+	header.status_line_size = entry.status_line.size();
+	header.head_size = entry.head.size();
+	header.body_size = entry.body_size;
+	header.response_time = entry.response_time;
+	char * p = record;
+	memcpy(p, &header, sizeof(header));
+	p += sizeof(header);
+	memcpy(p, entry.key.data(), entry.key.size());
+	p += entry.key.size();
+	memcpy(p, entry.status_line.data(), entry.status_line.size());
+	p += entry.status_line.size();
+	memcpy(p, entry.head.data(), entry.head.size());
+	p += entry.head.size();
+	memcpy(p, entry.body, entry.body_size);
+	segment.used += size;
+	segment.keys.push_back(entry.key);
+
+	shared_ptr<Entry> disk(new Entry());
+	CopyEntry(*disk, entry);
+	disk->body = p;
+	disk->storage = m_segments.back();
+	return disk;
+}
+
+/** True if an If-None-Match value lists etag (compared weakly, RFC 7232 3.2) **/
+static bool MatchETag(const StringRef & list, const string & etag)
+{
+	StringRef mine(etag);
+	if (mine.size() > 2 && mine[0] == 'W' && mine[1] == '/')
+		mine = StringRef(mine.data() + 2, mine.size() - 2);
+	const char * p = list.begin();
+	StringRef item;
+	while (NextItem(p, list.end(), item))
+	{
+		if (item.size() > 2 && item[0] == 'W' && item[1] == '/')
+			item = StringRef(item.data() + 2, item.size() - 2);
+		if (item == "*" || item == mine)
+			return true;
+	}
+	return false;
+}
+
+bool Cache::Send(Socket & socket, Request & req, const Entry & entry, const char * state)
+{
+	Headers & headers = req.Headers();
+	bool not_modified = false;
+	if (entry.status == 200 && headers.Has(HEADER_IF_NONE_MATCH))
+		not_modified = !entry.etag.empty() && MatchETag(headers.Get(HEADER_IF_NONE_MATCH), entry.etag);
+	else if (entry.status == 200 && headers.Has(HEADER_IF_MODIFIED_SINCE))
+	{
+		time_t since = ParseDate(headers.Get(HEADER_IF_MODIFIED_SINCE));
+		time_t modified = ParseDate(entry.last_modified);
+		not_modified = (since >= 0 && modified >= 0 && modified <= since);
+	}
+
+	static thread_local string head;
+	head = not_modified ? "HTTP/1.1 304 Not Modified\r\n" : entry.status_line;
+	head += entry.head;
+	char line[128];
+	head.append(line, snprintf(line, sizeof(line), "Age: %lld\r\nX-Cache: %s\r\n",
+		(long long)entry.Age(time(NULL)), state));
+	bool has_body = !not_modified && entry.status != 204;
+	if (has_body)
+		head.append(line, snprintf(line, sizeof(line), "Content-Length: %zu\r\n", entry.body_size));
+	head += "\r\n";
+
+	// Head and body in one system call; the body straight from memory or the segment's mapping
+	struct iovec iov[2];
+	iov[0].iov_base = (void*)head.data();
+	iov[0].iov_len = head.size();
+	iov[1].iov_base = (void*)entry.body;
+	iov[1].iov_len = (has_body && req.Method() != "HEAD") ? entry.body_size : 0;
+	size_t body = iov[1].iov_len;
+	struct iovec * v = iov;
+	int count = (iov[1].iov_len > 0) ? 2 : 1;
+	while (count > 0)
+	{
+		ssize_t written = writev(socket.GetFD(), v, count);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			Error("Couldn't send cached response - %s", StrError(errno));
+			return false;
+		}
+		while (count > 0 && (size_t)written >= v->iov_len)
+		{
+			written -= v->iov_len;
+			++v;
+			--count;
+		}
+		if (count > 0)
+		{
+			v->iov_base = (char*)v->iov_base + written;
+			v->iov_len -= written;
+		}
+	}
+	// Counted as sent, head and body separately, since Sent may read what it is given
+	socket.Sent(head.data(), head.size());
+	if (body > 0)
+		socket.Sent(entry.body, body);
+	return true;
+}
+
+}}
@@ -0,0 +1,186 @@
+/**
+ * @file cache.h
+ * @brief HTTP cache with memory and memory-mapped disk tiers - Declarations
+ * @see cache.cpp - Definitions
+ * @see reverseproxy.h - HTTP::ReverseProxy answers requests from a Cache
+ * @see RFC 7234 https://tools.ietf.org/html/rfc7234
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <atomic>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <time.h>
+
+#include "http.h"
+#include "httpclient.h"
+#include "pool.h"
+
+namespace Foxbox
+{
+	namespace HTTP
+	{
+		/**
+		 * A shared cache of responses to GET requests
+		 * New responses are kept in memory, least recently used out first. With a
+		 * 	disk tier, responses leaving memory are appended to segment files that
+		 * 	are mapped into memory, and sent straight from the mapping; when the
+		 * 	disk tier is full its oldest segment is dropped with everything in it.
+		 * Freshness follows Cache-Control (max-age, s-maxage, no-cache, no-store,
+		 * 	private, must-revalidate, stale-while-revalidate), Expires, Date and
+		 * 	Age; responses with Vary are stored per variant.
+		 * Entries are never modified once added (revalidating one replaces it), so
+		 * 	a response can be sent without holding any lock.
+		 * Thread safe.
+		 */
+		class Cache
+		{
+			public:
+				/** A cached response **/
+				class Entry
+				{
+					public:
+						Entry() : key(), status(0), status_line(), head(), body(NULL), body_size(0), storage(),
+							response_time(0), age(0), lifetime(0), stale_while_revalidate(0), must_revalidate(false),
+							etag(), last_modified(), request(), revalidating(false) {}
+
+						std::string key; /** URI, then "\n" and name=value for each header named by Vary **/
+						unsigned status;
+						std::string status_line; /** "HTTP/1.1 200 OK\r\n" **/
+						std::string head; /** End-to-end headers, each ending "\r\n" (no Content-Length or Age) **/
+						const char * body;
+						size_t body_size;
+						std::shared_ptr<void> storage; /** Owns the body (a std::string, or a disk segment) **/
+						time_t response_time; /** When the response (or its last revalidation) arrived **/
+						time_t age; /** Age of the response when it arrived **/
+						time_t lifetime; /** Freshness lifetime **/
+						time_t stale_while_revalidate;
+						bool must_revalidate; /** Never used stale **/
+						std::string etag;
+						std::string last_modified;
+						Headers request; /** The request's headers that Vary names **/
+						mutable std::atomic<bool> revalidating; /** A background revalidation is running **/
+
+						std::string URI() const {return key.substr(0, key.find('\n'));}
+						time_t Age(time_t now) const {return age + ((now > response_time) ? now - response_time : 0);}
+						size_t Size() const {return key.size() + status_line.size() + head.size() + body_size;}
+				};
+				typedef std::shared_ptr<const Entry> EntryPtr;
+
+				/** How an entry may be used for a request **/
+				enum Freshness
+				{
+					FRESH, /** Send it **/
+					STALE_WHILE_REVALIDATE, /** Send it, and revalidate in the background **/
+					STALE /** Revalidate first **/
+				};
+
+				/**
+				 * @param memory_bytes Size of the memory tier
+				 * @param disk_path Directory for segment files ("" for no disk tier)
+				 * @param disk_bytes Size of the disk tier
+				 * @param max_object Largest response body stored
+				 */
+				Cache(size_t memory_bytes = 64 << 20, const std::string & disk_path = "",
+					size_t disk_bytes = 1 << 30, size_t max_object = 8 << 20);
+				virtual ~Cache();
+
+				/** True if a request may be answered from the cache (GET or HEAD, no Authorization, Range or no-store) **/
+				static bool Cacheable(Request & req);
+				/** True if a response to a cacheable GET may be stored **/
+				bool Storable(Response & response) const;
+
+				/** Find the entry for a request (the variant matching its headers) @returns NULL if none **/
+				EntryPtr Find(const std::string & uri, const Headers & request);
+				/** How entry may be used for a request with the given headers **/
+				static Freshness Check(const Entry & entry, const Headers & request, time_t now);
+
+				/**
+				 * Store a complete response (its body is moved out)
+				 * @returns The entry, which is only kept if it is small enough
+				 */
+				EntryPtr Store(const std::string & uri, const Headers & request, Response & response);
+				/** Update an entry with the 304 response to revalidating it @returns The replacement **/
+				EntryPtr Refresh(const EntryPtr & entry, Response & response);
+				/** Remove every variant of a URI (eg: after a POST to it) **/
+				void Remove(const std::string & uri);
+
+				/**
+				 * Send an entry in response to req; 304 if req's validators match, no body for HEAD
+				 * @param state Value of the X-Cache header (HIT, MISS, STALE, ...)
+				 */
+				bool Send(Socket & socket, Request & req, const Entry & entry, const char * state);
+
+				/** Run a task (a revalidation) in the background **/
+				void Background(const WorkPool::Task & task) {m_background.Submit(task);}
+
+				size_t MemoryUsed() const {return m_memory_used;}
+				size_t Size();
+
+			private:
+				Cache(const Cache & cpy) = delete;
+				Cache & operator=(const Cache & cpy) = delete;
+
+				struct Segment;
+				/**
+				 * Segment file format: records one after another, each 8 byte aligned
+				 * 	RecordHeader, key, status line, head, body
+				 **/
+				struct RecordHeader
+				{
+					uint32_t magic;
+					uint32_t key_size;
+					uint32_t status_line_size;
+					uint32_t head_size;
+					uint64_t body_size;
+					int64_t response_time;
+				};
+				/** An entry in the index **/
+				struct Slot
+				{
+					std::shared_ptr<Entry> entry;
+					std::list<std::string>::iterator lru; /** Position in m_lru (memory tier only) **/
+					bool in_memory;
+				};
+				/** What a URI varies on, and the keys of its variants **/
+				struct Variants
+				{
+					std::string vary;
+					std::vector<std::string> keys;
+				};
+
+				static std::string Key(const std::string & uri, const StringRef & vary, const Headers & request);
+				/** Set an entry's freshness from its response headers **/
+				static void Freshen(Entry & entry, Headers & headers, time_t now);
+				/** Add or replace an entry (m_mutex held) **/
+				void Insert(const std::shared_ptr<Entry> & entry);
+				/** Remove an entry (m_mutex held) **/
+				void Erase(const std::string & key);
+				/** Move the least recently used entries to disk (or drop them) until memory fits (m_mutex held) **/
+				void Evict();
+				/** Copy an entry into a disk segment (m_mutex held) @returns The copy, or NULL **/
+				std::shared_ptr<Entry> Demote(const Entry & entry);
+
+				size_t m_memory_bytes;
+				std::string m_disk_path;
+				size_t m_segment_bytes;
+				size_t m_max_object;
+				std::mutex m_mutex;
+				std::unordered_map<std::string, Slot> m_index;
+				std::unordered_map<std::string, Variants> m_uris;
+				std::list<std::string> m_lru; /** Keys of entries in memory, most recently used first **/
+				std::atomic<size_t> m_memory_used;
+				std::deque<std::shared_ptr<Segment> > m_segments; /** Oldest first **/
+				WorkPool m_background;
+		};
+	}
+}
+
+#endif //_CACHE_H
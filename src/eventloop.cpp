@@ -0,0 +1,202 @@
+/**
+ * @file eventloop.cpp
+ * @brief epoll(7) based event loop - Definitions
+ * @see eventloop.h - Declarations
+ */
+
+#include "eventloop.h"
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+
+using namespace std;
+
+namespace Foxbox
+{
+
+/** Maximum events handled per epoll_wait(2) **/
+#define EVENTLOOP_BATCH 64
+/** Resolution of timers, in seconds **/
+#define EVENTLOOP_TICK 0.01
+
+EventLoop::EventLoop() : m_epoll(-1), m_wakeup(-1), m_mutex(), m_posted(), m_removed(),
+	m_running(true), m_thread(), m_timers(EVENTLOOP_TICK), m_timerfd(-1), m_timer_watch(NULL), m_armed(-1)
+{
+	m_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epoll < 0)
+		Fatal("Error in epoll_create1(2) - %s", StrError(errno));
+	m_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_wakeup < 0)
+		Fatal("Error in eventfd(2) - %s", StrError(errno));
+
+	// The wakeup fd is the only one with a NULL Watch
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeup, &ev) != 0)
+		Fatal("Error in epoll_ctl(2) - %s", StrError(errno));
+
+	m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (m_timerfd < 0)
+		Fatal("Error in timerfd_create(2) - %s", StrError(errno));
+	m_timer_watch = Add(m_timerfd, EPOLLIN, [this](uint32_t) {Expire();});
+	if (m_timer_watch == NULL)
+		Fatal("Couldn't watch timerfd");
+}
+
+EventLoop::~EventLoop()
+{
+	for (auto watch : m_removed)
+		delete watch;
+	delete m_timer_watch;
+	close(m_timerfd);
+	close(m_wakeup);
+	close(m_epoll);
+}
+
+EventLoop::Watch * EventLoop::Add(int fd, uint32_t events, const Callback & callback)
+{
+	Watch * watch = new Watch(fd, callback);
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = watch;
+	if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) != 0)
+	{
+		Error("Error adding fd %d to epoll - %s", fd, StrError(errno));
+		delete watch;
+		return NULL;
+	}
+	return watch;
+}
+
+bool EventLoop::Modify(Watch * watch, uint32_t events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = watch;
+	if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, watch->fd, &ev) != 0)
+	{
+		Error("Error modifying fd %d in epoll - %s", watch->fd, StrError(errno));
+		return false;
+	}
+	return true;
+}
+
+void EventLoop::Remove(Watch * watch, bool closed)
+{
+	if (watch == NULL || watch->removed)
+		return;
+	watch->removed = true;
+	if (!closed)
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, watch->fd, NULL);
+	m_removed.push_back(watch);
+}
+
+void EventLoop::Post(const function<void()> & task)
+{
+	m_mutex.lock();
+	m_posted.push_back(task);
+	m_mutex.unlock();
+	Wake();
+}
+
+void EventLoop::Wake()
+{
+	uint64_t one = 1;
+	if (write(m_wakeup, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		Error("Error writing to eventfd - %s", StrError(errno));
+}
+
+void EventLoop::RunPosted()
+{
+	uint64_t count = 0;
+	if (read(m_wakeup, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		Error("Error reading eventfd - %s", StrError(errno));
+	vector<function<void()> > posted;
+	m_mutex.lock();
+	posted.swap(m_posted);
+	m_mutex.unlock();
+	for (auto & task : posted)
+		task();
+}
+
+void EventLoop::Schedule(Timer & timer, double seconds, const TimerWheel::Callback & callback)
+{
+	m_timers.Schedule(timer, seconds, callback);
+	Arm();
+}
+
+void EventLoop::Arm()
+{
+	int64_t next = m_timers.Next();
+	// Already due by then (a cancelled timer just costs a spurious wakeup)
+	if (next == m_armed || (next >= 0 && m_armed >= 0 && next > m_armed))
+		return;
+	struct itimerspec when;
+	memset(&when, 0, sizeof(when));
+	if (next >= 0)
+	{
+		when.it_value.tv_sec = next / 1000000000;
+		when.it_value.tv_nsec = next % 1000000000;
+		// An all zero it_value would disarm it
+		if (next == 0)
+			when.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(m_timerfd, TFD_TIMER_ABSTIME, &when, NULL) != 0)
+		Error("Error in timerfd_settime(2) - %s", StrError(errno));
+	m_armed = next;
+}
+
+void EventLoop::Expire()
+{
+	uint64_t count = 0;
+	if (read(m_timerfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		Error("Error reading timerfd - %s", StrError(errno));
+	m_armed = -1;
+	m_timers.Advance();
+	Arm();
+}
+
+void EventLoop::Run()
+{
+	m_thread = this_thread::get_id();
+	struct epoll_event events[EVENTLOOP_BATCH];
+	while (m_running)
+	{
+		int n = epoll_wait(m_epoll, events, EVENTLOOP_BATCH, -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			Error("Error in epoll_wait(2) - %s", StrError(errno));
+			break;
+		}
+		for (int i = 0; i < n; ++i)
+		{
+			Watch * watch = (Watch*)(events[i].data.ptr);
+			if (watch == NULL)
+				RunPosted();
+			else if (!watch->removed)
+				watch->callback(events[i].events);
+		}
+		// Nothing in this batch can refer to these any more
+		for (auto watch : m_removed)
+			delete watch;
+		m_removed.clear();
+	}
+	m_thread = thread::id();
+}
+
+void EventLoop::Stop()
+{
+	m_running = false;
+	Wake();
+}
+
+}
@@ -0,0 +1,93 @@
+/**
+ * @file eventloop.h
+ * @brief epoll(7) based event loop - Declarations
+ * @see eventloop.cpp - Definitions
+ */
+
+#ifndef _EVENTLOOP_H
+#define _EVENTLOOP_H
+
+#include <sys/epoll.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+#include "timerwheel.h"
+
+namespace Foxbox
+{
+	/**
+	 * Calls back when file descriptors are ready, on the thread calling Run()
+	 * Add, Modify and Post are thread safe; Remove must be called on the loop
+	 * 	thread (use Post) because a callback for the Watch may be pending.
+	 * @see httpserver.h - HTTP::Server runs one EventLoop per IO thread
+	 */
+	class EventLoop
+	{
+		public:
+			typedef std::function<void(uint32_t events)> Callback;
+			typedef TimerWheel::Timer Timer;
+
+			/** A file descriptor being watched **/
+			struct Watch
+			{
+				Watch(int f, const Callback & c) : fd(f), callback(c), removed(false) {}
+				int fd;
+				Callback callback;
+				bool removed;
+			};
+
+			EventLoop();
+			virtual ~EventLoop();
+
+			/** Watch fd for events (EPOLLIN, EPOLLOUT, EPOLLONESHOT ...) @returns NULL on error **/
+			Watch * Add(int fd, uint32_t events, const Callback & callback);
+			/** Change (or re-arm) the events a Watch waits for **/
+			bool Modify(Watch * watch, uint32_t events);
+			/** Stop watching; if the fd was already closed it has left epoll by itself **/
+			void Remove(Watch * watch, bool closed = false);
+
+			/** Run task on the loop thread **/
+			void Post(const std::function<void()> & task);
+
+			/** Call callback on the loop thread in seconds; rescheduling a pending timer moves it **/
+			void Schedule(Timer & timer, double seconds, const TimerWheel::Callback & callback);
+			void Cancel(Timer & timer) {m_timers.Cancel(timer);}
+
+			/** Dispatch events until Stop() is called (returns at once if it already was) **/
+			void Run();
+			/** Make Run() return (thread safe) **/
+			void Stop();
+			bool InLoop() const {return std::this_thread::get_id() == m_thread;}
+
+		private:
+			EventLoop(const EventLoop & cpy) = delete;
+			EventLoop & operator=(const EventLoop & cpy) = delete;
+
+			void Wake();
+			void RunPosted();
+			/** Run expired timers **/
+			void Expire();
+			/** Set the timerfd for the next time the wheel has work **/
+			void Arm();
+
+			int m_epoll;
+			int m_wakeup; /** eventfd(2) written by Post and Stop **/
+			std::mutex m_mutex;
+			std::vector<std::function<void()> > m_posted;
+			std::vector<Watch*> m_removed; /** Freed after the current batch of events **/
+			std::atomic<bool> m_running;
+			std::thread::id m_thread;
+			TimerWheel m_timers;
+			int m_timerfd;
+			Watch * m_timer_watch;
+			int64_t m_armed; /** When the timerfd expires (-1 if disarmed) **/
+	};
+}
+
+#endif //_EVENTLOOP_H
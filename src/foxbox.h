@@ -5,7 +5,22 @@
  * @see socket.h POSIX general socket wrappers (Foxbox::Socket)
  * @see tcp.h POSIX TCP socket wrappers (TCP::Socket)
  * @see http.h HTTP using Foxbox::Socket (HTTP::Request et al)
+ * @see router.h HTTP request routing (HTTP::Router)
+ * @see json.h JSON output (JSON::Writer)
+ * @see httpserver.h Multithreaded HTTP server (HTTP::Server)
+ * @see accesslog.h Asynchronous access log (HTTP::AccessLog)
+ * @see httpclient.h HTTP client with keep-alive (HTTP::Client)
+ * @see reverseproxy.h HTTP reverse proxy (HTTP::ReverseProxy)
+ * @see cache.h HTTP cache for the reverse proxy (HTTP::Cache)
+ * @see upstream.h Load balancing across servers (UpstreamGroup)
+ * @see eventloop.h epoll event loop (EventLoop)
+ * @see timerwheel.h Hierarchical timer wheel (TimerWheel)
+ * @see pool.h Work stealing thread pool (WorkPool)
  * @see websocket.h WebSocket protocol over TCP::Socket (WS::Socket)
+ * @see wsframe.h WebSocket masking and framing (WS::Mask)
+ * @see wsdeflate.h WebSocket permessage-deflate (WS::Deflate)
+ * @see wsserver.h Event driven WebSocket server (WS::EventServer)
+ * @see wshub.h WebSocket publish/subscribe (WS::Hub)
  */
 #ifndef _FOXBOX_H
 #define _FOXBOX_H
@@ -14,7 +29,22 @@
 #include "tcp.h"
 #include "log.h"
 #include "http.h"
+#include "router.h"
+#include "json.h"
+#include "timerwheel.h"
+#include "eventloop.h"
+#include "pool.h"
+#include "accesslog.h"
+#include "httpserver.h"
+#include "httpclient.h"
+#include "upstream.h"
+#include "cache.h"
+#include "reverseproxy.h"
+#include "wsframe.h"
+#include "wsdeflate.h"
 #include "websocket.h"
+#include "wsserver.h"
+#include "wshub.h"
 #include "process.h"
 #include "debugutils.h"
 #include "des.h"
@@ -12,6 +12,12 @@
 #include "process.h"
 #include "debugutils.h"
 #include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+#include <typeinfo>
 
 #include <sstream>
 
@@ -22,14 +28,254 @@ using namespace std;
  
 namespace Foxbox {namespace HTTP
 {
+
+/** Names of well known headers, indexed by HeaderID **/
+static const char * g_header_names[HEADER_COUNT] = {
+	"", "Accept", "Accept-Encoding", "Accept-Ranges", "Age", "Authorization", "Cache-Control",
+	"Connection", "Content-Encoding", "Content-Length", "Content-Range", "Content-Type",
+	"Cookie", "Date", "ETag", "Expires", "Host", "If-Modified-Since", "If-None-Match",
+	"If-Range", "Keep-Alive", "Last-Modified", "Location", "Origin", "Pragma",
+	"Proxy-Authenticate", "Proxy-Authorization", "Proxy-Connection", "Range",
+	"Sec-WebSocket-Accept", "Sec-WebSocket-Extensions", "Sec-WebSocket-Key",
+	"Sec-WebSocket-Protocol", "Sec-WebSocket-Version", "Server", "Set-Cookie", "Status", "TE",
+	"Trailer", "Transfer-Encoding", "Upgrade", "User-Agent", "Vary", "X-Forwarded-For"
+};
+
+/** 
+ * Perfect hash of the well known header names to their HeaderID
+ * The hash (see InternHeader) was found by searching small multipliers until
+ * 	every name in g_header_names landed in its own slot; if you add a name
+ * 	you will need to search again.
+ */
+static const HeaderID g_header_table[128] = {
+	HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_COOKIE,
+	HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_ACCEPT_ENCODING,
+	HEADER_OTHER, HEADER_OTHER, HEADER_ORIGIN, HEADER_OTHER,
+	HEADER_OTHER, HEADER_IF_RANGE, HEADER_SEC_WEBSOCKET_PROTOCOL, HEADER_CONTENT_TYPE,
+	HEADER_LAST_MODIFIED, HEADER_CONTENT_RANGE, HEADER_OTHER, HEADER_OTHER,
+	HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_KEEP_ALIVE,
+	HEADER_OTHER, HEADER_PRAGMA, HEADER_HOST, HEADER_OTHER,
+	HEADER_OTHER, HEADER_EXPIRES, HEADER_SEC_WEBSOCKET_VERSION, HEADER_IF_MODIFIED_SINCE,
+	HEADER_OTHER, HEADER_RANGE, HEADER_PROXY_CONNECTION, HEADER_ETAG,
+	HEADER_SERVER, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+	HEADER_PROXY_AUTHORIZATION, HEADER_CONTENT_ENCODING, HEADER_OTHER, HEADER_TE,
+	HEADER_OTHER, HEADER_OTHER, HEADER_CONTENT_LENGTH, HEADER_OTHER,
+	HEADER_OTHER, HEADER_OTHER, HEADER_IF_NONE_MATCH, HEADER_OTHER,
+	HEADER_CACHE_CONTROL, HEADER_OTHER, HEADER_OTHER, HEADER_SET_COOKIE,
+	HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+	HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+	HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+	HEADER_TRAILER, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+	HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_STATUS,
+	HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_UPGRADE,
+	HEADER_OTHER, HEADER_SEC_WEBSOCKET_EXTENSIONS, HEADER_SEC_WEBSOCKET_ACCEPT, HEADER_OTHER,
+	HEADER_OTHER, HEADER_PROXY_AUTHENTICATE, HEADER_OTHER, HEADER_OTHER,
+	HEADER_OTHER, HEADER_OTHER, HEADER_X_FORWARDED_FOR, HEADER_OTHER,
+	HEADER_CONNECTION, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+	HEADER_OTHER, HEADER_OTHER, HEADER_USER_AGENT, HEADER_VARY,
+	HEADER_OTHER, HEADER_AGE, HEADER_AUTHORIZATION, HEADER_DATE,
+	HEADER_OTHER, HEADER_OTHER, HEADER_ACCEPT, HEADER_OTHER,
+	HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_ACCEPT_RANGES,
+	HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+	HEADER_OTHER, HEADER_TRANSFER_ENCODING, HEADER_OTHER, HEADER_OTHER,
+	HEADER_OTHER, HEADER_SEC_WEBSOCKET_KEY, HEADER_OTHER, HEADER_OTHER,
+	HEADER_LOCATION, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+};
+
+HeaderID InternHeader(const StringRef & name)
+{
+	size_t n = name.size();
+	if (n < 2)
+		return HEADER_OTHER;
+	// | 0x20 lower cases letters and leaves '-' and digits alone
+	unsigned hash = 2*n + 4*((uint8_t)name[0] | 0x20) + 9*((uint8_t)name[n-1] | 0x20) 
+		+ 2*((uint8_t)name[1] | 0x20);
+	HeaderID id = g_header_table[hash % 128];
+	if (id != HEADER_OTHER && name.EqualsIgnoreCase(g_header_names[id]))
+		return id;
+	return HEADER_OTHER;
+}
+
+const char * HeaderName(HeaderID id)
+{
+	return (id > HEADER_OTHER && id < HEADER_COUNT) ? g_header_names[id] : "";
+}
+
+size_t Fields::Find(const StringRef & name, size_t start) const
+{
+	if (m_ignore_case)
+	{
+		HeaderID id = InternHeader(name);
+		if (id != HEADER_OTHER)
+			return Find(id, start);
+		for (size_t i = start; i < m_size; ++i)
+		{
+			if (At(i).id == HEADER_OTHER && Name(i).EqualsIgnoreCase(name))
+				return i;
+		}
+		return npos;
+	}
+	for (size_t i = start; i < m_size; ++i)
+	{
+		if (Name(i) == name)
+			return i;
+	}
+	return npos;
+}
+
+size_t Fields::Find(HeaderID id, size_t start) const
+{
+	if (id == HEADER_OTHER)
+		return npos;
+	for (size_t i = start; i < m_size; ++i)
+	{
+		if (At(i).id == id)
+			return i;
+	}
+	return npos;
+}
+
+void Fields::AddRef(size_t name, size_t name_size, size_t value, size_t value_size)
+{
+	Field f;
+	f.name = name;
+	f.name_size = name_size;
+	f.value = value;
+	f.value_size = value_size;
+	f.id = (m_ignore_case) ? InternHeader(StringRef(m_buffer.data() + name, name_size)) : HEADER_OTHER;
+	if (m_size < FIELDS_INLINE)
+		m_inline[m_size] = f;
+	else
+		m_more.push_back(f);
+	++m_size;
+}
+
+void Fields::Add(const StringRef & name, const StringRef & value)
+{
+	// Anything already in the buffer is referred to rather than copied
+	// (offsets are taken before appending, which may reallocate)
+	size_t n = Offset(name);
+	size_t v = Offset(value);
+	if (n == npos)
+	{
+		n = m_buffer.size();
+		m_buffer.append(name.data(), name.size());
+	}
+	if (v == npos)
+	{
+		v = m_buffer.size();
+		m_buffer.append(value.data(), value.size());
+	}
+	AddRef(n, name.size(), v, value.size());
+}
+
+void Fields::Set(const StringRef & name, const StringRef & value)
+{
+	size_t i = Find(name);
+	if (i == npos)
+	{
+		Add(name, value);
+		return;
+	}
+	// Overwrite the first in place, drop the rest
+	size_t v = Offset(value);
+	if (v == npos)
+	{
+		v = m_buffer.size();
+		m_buffer.append(value.data(), value.size());
+	}
+	At(i).value = v;
+	At(i).value_size = value.size();
+	size_t j = Find(Name(i), i+1);
+	while (j != npos)
+	{
+		for (size_t k = j; k+1 < m_size; ++k)
+			At(k) = At(k+1);
+		if (m_size > FIELDS_INLINE)
+			m_more.pop_back();
+		--m_size;
+		j = Find(Name(i), j);
+	}
+}
+
+size_t Fields::Remove(const StringRef & name)
+{
+	size_t removed = 0;
+	size_t i = Find(name);
+	while (i != npos)
+	{
+		for (size_t k = i; k+1 < m_size; ++k)
+			At(k) = At(k+1);
+		if (m_size > FIELDS_INLINE)
+			m_more.pop_back();
+		--m_size;
+		++removed;
+		i = Find(name, i);
+	}
+	return removed;
+}
+
+/**
+ * Parse "Name: value" lines from fields.Buffer() (starting at offset pos) into fields
+ * Lines without a ':' are ignored
+ */
+static void ParseHeaderLines(Fields & fields, size_t pos)
+{
+	const string & buffer = fields.Buffer();
+	const char * ws = " \t\r\n";
+	while (pos < buffer.size())
+	{
+		size_t eol = buffer.find('\n', pos);
+		if (eol == string::npos)
+			eol = buffer.size();
+		size_t colon = buffer.find(':', pos);
+		if (colon != string::npos && colon < eol)
+		{
+			size_t name = pos;
+			size_t name_end = colon;
+			size_t value = colon + 1;
+			size_t value_end = eol;
+			while (name < name_end && strchr(ws, buffer[name])) ++name;
+			while (name_end > name && strchr(ws, buffer[name_end-1])) --name_end;
+			while (value < value_end && strchr(ws, buffer[value])) ++value;
+			while (value_end > value && strchr(ws, buffer[value_end-1])) --value_end;
+			if (name_end > name)
+				fields.AddRef(name, name_end - name, value, value_end - value);
+		}
+		pos = eol + 1;
+	}
+}
+
+/**
+ * Receive lines up to and including a blank line, appending them to buffer
+ * @param skip_blank Skip blank lines before the first line (RFC 2616 4.1)
+ * @returns false if the socket closed or timed out first
+ */
+static bool ReceiveHead(Socket & socket, string & buffer, double timeout, bool skip_blank)
+{
+	size_t first = buffer.size();
+	while (socket.Valid() && socket.CanReceive(timeout))
+	{
+		size_t start = buffer.size();
+		if (!socket.GetToken(buffer, "\n", timeout, true))
+			return false;
+		if (buffer.size() - start > 2 || (buffer.size() - start == 2 && buffer[start] != '\r'))
+			continue;
+		if (!skip_blank || start != first)
+			return true;
+		buffer.resize(first);
+	}
+	return false;
+}
 	
 Request::Request(const string & hostname, const string & request_type, 
 				 const string & query) 
 	: m_hostname(hostname), m_request_type(request_type), m_query(query),
-		m_path(query), m_params(), m_cookies(), m_headers(),
+		m_path(query), m_body(), m_params(), m_cookies(), m_headers(),
+		m_params_parsed(false), m_cookies_parsed(false),
 		m_split_path(NULL), m_valid(false)
 {
-	m_path = ParseQuery(m_params, m_path, '?', '&', '=', " \r\n:;");
+	m_path = m_query.substr(0, m_query.find('?'));
 }
 
 Request::~Request()
@@ -37,18 +283,40 @@ Request::~Request()
 	delete m_split_path;
 }
 
+Fields & Request::Params()
+{
+	if (!m_params_parsed)
+	{
+		ParseQuery(m_params, m_query, '?', '&', '=', " \r\n:;");
+		m_params_parsed = true;
+	}
+	return m_params;
+}
+
+Fields & Request::Cookies()
+{
+	if (!m_cookies_parsed)
+	{
+		for (size_t i = m_headers.Find(HEADER_COOKIE); i != Fields::npos; i = m_headers.Find(HEADER_COOKIE, i+1))
+			ParseQuery(m_cookies, m_headers.Value(i), '\0', ';', '=', " \r\n:\t", false);
+		m_cookies_parsed = true;
+	}
+	return m_cookies;
+}
+
 vector<string> & Request::SplitPath(char delim)
 {
 	if (m_split_path != NULL) return *(m_split_path);
 	m_split_path = new vector<string>();
-	stringstream s(m_path);
-	string token("");
-	while (s.good())
+	size_t start = 0;
+	while (start < m_path.size())
 	{
-		token.clear();
-		getline(s, token, delim);
-		if (token.size() > 0)
-			m_split_path->push_back(token);
+		size_t end = m_path.find(delim, start);
+		if (end == string::npos)
+			end = m_path.size();
+		if (end > start)
+			m_split_path->push_back(m_path.substr(start, end - start));
+		start = end + 1;
 	}
 	if (m_split_path->size() == 0)
 		m_split_path->push_back("");
@@ -56,127 +324,137 @@ vector<string> & Request::SplitPath(char delim)
 		
 }
 	
-bool Request::Receive(Socket & socket, double timeout)
+void Request::Reset()
 {
 	m_valid = false;
 	m_request_type.clear();
+	m_query.clear();
 	m_path.clear();
-	m_params.clear();
-	m_cookies.clear();
+	m_body.clear();
+	m_params.Clear();
+	m_cookies.Clear();
+	m_headers.Clear();
+	m_params_parsed = false;
+	m_cookies_parsed = false;
+	delete m_split_path;
+	m_split_path = NULL;
+}
 	
+bool Request::Receive(Socket & socket, double timeout)
+{
+	Reset();
 	if (!socket.Valid()) return false;
 	
-	
-	socket.GetToken(m_request_type, " ");
-	//Debug("Request type... %s", m_request_type.c_str());
-	socket.GetToken(m_query, " ");
-	//Debug("Path+Query... %s", m_query.c_str());
-	
-	string protocol("");
-	socket.GetToken(protocol, "\n");
-	strip(protocol);
-	//Debug("Protocol... %s", protocol.c_str());
-	if (protocol != "HTTP/1.1")
+	// The request line and headers are received straight into the header table's buffer
+	if (!ReceiveHead(socket, m_headers.Buffer(), timeout, true))
 		return false;
-	strip(m_request_type);
-	strip(m_query);
+	return ParseHead();
+}
 
-	m_path = ParseQuery(m_params, m_query, '?', '&', '=', " \r\n:;");
-	strip(m_path, "/");
-	string garbage("");
-	socket.GetToken(garbage, "\n");
-	strip(garbage);
-	while (socket.Valid() && socket.CanReceive(timeout))
+size_t Request::Parse(const char * data, size_t size)
+{
+	Reset();
+	// Skip blank lines before the request line (RFC 2616 4.1)
+	size_t start = 0;
+	while (start < size && (data[start] == '\r' || data[start] == '\n'))
+		++start;
+	const char * eol = (const char*)memchr(data + start, '\n', size - start);
+	while (eol != NULL)
 	{
-		garbage.clear();
-		socket.GetToken(garbage, "\n");
-		strip(garbage);
-		//Debug("Line is \"%s\"", garbage.c_str());
-		string header("");
-		string value("");
-		stringstream s(garbage);
-		getline(s, header, ':');
-		if (s.good())
-			getline(s, value);
-		strip(header);
-		strip(value);
-		if (header == "Cookie")
-		{
-			ParseQuery(m_cookies, value, '\0', ';','=', " \r\n:\t");
-		}
-		else if (header.size() > 0)
+		size_t next = eol - data + 1;
+		if (next < size && data[next] == '\r')
+			++next;
+		if (next >= size)
+			break;
+		if (data[next] == '\n')
 		{
-			m_headers[header] = value;
+			m_headers.Buffer().assign(data + start, next + 1 - start);
+			ParseHead();
+			return next + 1;
 		}
-		else
-			break;
+		eol = (const char*)memchr(data + next, '\n', size - next);
 	}
+	return 0;
+}
+
+bool Request::ParseHead()
+{
+	const string & head = m_headers.Buffer();
+	size_t eol = head.find('\n');
+	if (eol == string::npos)
+		return false;
+	
+	// Method SP Request-URI SP HTTP-Version CRLF
+	size_t method_end = head.find(' ');
+	size_t query_end = (method_end < eol) ? head.find(' ', method_end+1) : string::npos;
+	if (query_end >= eol)
+		return false;
+	size_t protocol_end = (head[eol-1] == '\r') ? eol-1 : eol;
+	if (head.compare(query_end+1, protocol_end - query_end - 1, "HTTP/1.1") != 0)
+		return false;
+	m_request_type.assign(head, 0, method_end);
+	m_query.assign(head, method_end+1, query_end - method_end - 1);
+	m_path = m_query.substr(0, m_query.find('?'));
+	strip(m_path, "/");
+	
+	ParseHeaderLines(m_headers, eol+1);
 	m_valid = true;
 	return true;
 }
 
-unsigned ParseResponseHeaders(Socket & socket, map<string, string> * headers, string * reason, bool include_status_line, double timeout)
+/**
+ * Parse the status line and headers already in headers.Buffer()
+ * @returns The status code, 0 if the status line is invalid
+ */
+static unsigned ParseStatusHead(Headers & headers, string * reason, bool include_status_line)
 {
-	if (!socket.Valid() || !socket.CanReceive(-1))
-	{
-		Error("Socket not valid");
-		return 0;
-	}
-	
-	string line("");
+	const string & buffer = headers.Buffer();
 	unsigned code = 0; 
+	size_t pos = 0;
 	if (include_status_line)
 	{
-		while (line == "" && socket.Valid())
+		// HTTP-Version SP Status-Code SP Reason-Phrase CRLF
+		size_t eol = buffer.find('\n');
+		if (eol == string::npos || (buffer.compare(0, 9, "HTTP/1.1 ") != 0 && buffer.compare(0, 9, "HTTP/1.0 ") != 0))
 		{
-			socket.GetToken(line, " ");
-			strip(line);
-		}
-		
-		if (line != "HTTP/1.1")
-		{
-			Error("Got \"%s\", expected \"HTTP/1.1\" socket.Valid() = %d", line.c_str(), socket.Valid());
+			Error("Got \"%s\", expected \"HTTP/1.1\" or \"HTTP/1.0\"", buffer.substr(0, buffer.find(' ')).c_str());
 			return 0;
 		}
-		line.clear();
-	
-		socket.GetToken(line, " ");
-		strip(line);
-		stringstream s(line);  s >> code;
-	
-		line.clear();
-		socket.GetToken(line, "\n");
-		strip(line);
+		code = strtoul(buffer.c_str() + 9, NULL, 10);
 		if (reason != NULL)
-			*reason = line;
-	}
-		
-	while (socket.Valid() && socket.CanReceive(timeout))
-	{
-		line.clear();
-		socket.GetToken(line, "\n");
-		strip(line);
-		string header("");
-		string value("");
-		
-		stringstream s(line);
-		getline(s, header, ':');
-		if (s.good())
-			getline(s, value);
-		
-		strip(header);
-		strip(value);
-		//Debug("Header %s, Value %s", header.c_str(), value.c_str());
-		if (header.size() == 0 && value.size() == 0)
-			break;
-		if (headers != NULL && header.size() != 0)
 		{
-			headers->operator[](header) = value;
+			size_t start = buffer.find(' ', 9);
+			*reason = (start < eol) ? buffer.substr(start+1, eol - start - 1) : string("");
+			strip(*reason);
 		}
+		pos = eol + 1;
 	}
-
+	ParseHeaderLines(headers, pos);
 	return code;
+}
+
+unsigned ParseResponseHeaders(Socket & socket, Headers * headers, string * reason, bool include_status_line, double timeout)
+{
+	if (!socket.Valid() || !socket.CanReceive(-1))
+	{
+		Error("Socket not valid");
+		return 0;
+	}
 	
+	Headers discard;
+	if (headers == NULL)
+		headers = &discard;
+	headers->Clear();
+	if (!ReceiveHead(socket, headers->Buffer(), timeout, include_status_line) && headers->Buffer().empty())
+		return 0;
+	return ParseStatusHead(*headers, reason, include_status_line);
+}
+
+unsigned ParseResponseHead(const StringRef & head, Headers & headers, string * reason)
+{
+	headers.Clear();
+	headers.Buffer().assign(head.data(), head.size());
+	return ParseStatusHead(headers, reason, true);
 }
 
 bool Request::Send(Socket & socket)
@@ -186,18 +464,26 @@ bool Request::Send(Socket & socket)
 	
 	strip(m_query, "/");
 	
-	socket.Send("GET /%s HTTP/1.1\r\n", m_query.c_str());
-	m_headers["Host"] = m_hostname;
-	m_headers["User-Agent"] += " Foxbox/1.0";
-	m_headers["Accept"] += " */*";
-	m_headers["Connection"] += " Keep-Alive";
+	m_headers.Set("Host", m_hostname);
+	if (!m_headers.Has(HEADER_USER_AGENT))
+		m_headers.Set("User-Agent", "Foxbox/1.0");
+	if (!m_headers.Has(HEADER_ACCEPT))
+		m_headers.Set("Accept", "*/*");
+	if (!m_headers.Has(HEADER_CONNECTION))
+		m_headers.Set("Connection", "Keep-Alive");
 	
-	for (auto & it : m_headers)
+	string head("GET /" + m_query + " HTTP/1.1\r\n");
+	for (size_t i = 0; i < m_headers.Size(); ++i)
 	{
-		strip(it.second);
-		socket.Send("%s: %s\r\n", it.first.c_str(), it.second.c_str());
+		StringRef name(m_headers.Name(i));
+		StringRef value(m_headers.Value(i));
+		head.append(name.data(), name.size());
+		head += ": ";
+		head.append(value.data(), value.size());
+		head += "\r\n";
 	}
-	socket.Send("\r\n");
+	head += "\r\n";
+	socket.Send(head);
 	
 	m_valid = socket.Valid();
 	return m_valid;
@@ -207,12 +493,34 @@ const char * StatusMessage(unsigned code)
 {
 	switch (code)
 	{
+		case 101:
+			return "Switching Protocols";
 		case 200:
 			return "OK";
+		case 206:
+			return "Partial Content";
+		case 304:
+			return "Not Modified";
 		case 404:
 			return "Not found";
 		case 400:
 			return "Bad Request";
+		case 405:
+			return "Method Not Allowed";
+		case 408:
+			return "Request Timeout";
+		case 411:
+			return "Length Required";
+		case 413:
+			return "Payload Too Large";
+		case 416:
+			return "Range Not Satisfiable";
+		case 500:
+			return "Internal Server Error";
+		case 502:
+			return "Bad Gateway";
+		case 503:
+			return "Service Unavailable";
 		default:
 			return "?";
 	}
@@ -221,97 +529,349 @@ const char * StatusMessage(unsigned code)
 
 bool SendPlain(Socket & socket, unsigned status, const char * message)
 {
+	// The message is sent as it is (not as a format), so it is as long as Content-Length says
+	size_t size = strlen(message);
 	return (socket.Send("HTTP/1.1 %u %s\r\n", status, StatusMessage(status))
-		&& socket.Send("Content-Type: text/plain; charset=utf-8\r\n\r\n")
-		&& socket.Send(message));
+		&& socket.Send("Content-Type: text/plain; charset=utf-8\r\nContent-Length: %zu\r\n\r\n", size)
+		&& socket.SendRaw(message, size) == (int)size);
+}
+
+/** Append a formatted string to s **/
+static void AppendF(string & s, const char * fmt, ...)
+{
+	char buffer[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int size = vsnprintf(buffer, sizeof(buffer), fmt, ap);
+	va_end(ap);
+	if (size > 0)
+		s.append(buffer, min((size_t)size, sizeof(buffer)-1));
+}
+
+bool SendJSON(Socket & socket, const JSON::Writer & json, unsigned status)
+{
+	const string & body = json.Str();
+	if (status == 0)
+		return socket.SendRaw(body.data(), body.size()) == (int)body.size();
+	// Head and body go out in one write; the buffer is kept for the next response
+	static thread_local string response;
+	response.clear();
+	AppendF(response, "HTTP/1.1 %u %s\r\nContent-Type: application/json; charset=utf-8\r\n"
+		"Content-Length: %zu\r\n\r\n", status, StatusMessage(status), body.size());
+	response += body;
+	return socket.SendRaw(response.data(), response.size()) == (int)response.size();
 }
 
 bool SendJSON(Socket & socket, const map<string, string> & m, unsigned status)
 {
-	bool result = true;
+	static thread_local JSON::Writer json;
+	json.Clear();
+	json.BeginObject();
+	for (auto & it : m)
+		json.Field(it.first, it.second);
+	json.EndObject();
+	return SendJSON(socket, json, status);
+}
+
+bool SendJSON(Socket & socket, const Fields & m, unsigned status)
+{
+	static thread_local JSON::Writer json;
+	json.Clear();
+	json.BeginObject();
+	for (size_t i = 0; i < m.Size(); ++i)
+		json.Field(m.Name(i), m.Value(i));
+	json.EndObject();
+	return SendJSON(socket, json, status);
+}
+
+const char * ContentType(const char * filename)
+{
+	// guess the content type from the file extension (if present)
+	const char * extension = strrchr(filename, '.');
+	extension = (extension == NULL) ? "" : extension;
+	if (strcmp(extension, ".html") == 0)
+		return "text/html; charset=utf-8";
+	else if (strcmp(extension, ".svg") == 0)
+		return "image/svg+xml; charset=utf-8";
+	else if (strcmp(extension, ".png") == 0)
+		return "image/png";
+	else if (strcmp(extension, ".gif") == 0)
+		return "image/gif";
+	else if (strcmp(extension, ".jpg") == 0 || strcmp(extension, ".jpeg") == 0)
+		return "image/jpeg";
+	else if (strcmp(extension, ".mp4") == 0)
+		return "video/mp4";
+	else if (strcmp(extension, ".webm") == 0)
+		return "video/webm";
+	else if (strcmp(extension, ".mp3") == 0)
+		return "audio/mpeg";
+	else if (strcmp(extension, ".ogg") == 0)
+		return "audio/ogg";
+	//TODO: Support other file types
+	return "text/plain; charset=utf-8";
+}
+
+/** Format a time as an RFC 1123 date (as used by Last-Modified) **/
+static string HTTPDate(time_t t)
+{
+	char buffer[64];
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return string(buffer);
+}
+
+static bool SendNotFound(Socket & socket, const char * filename, unsigned status)
+{
 	if (status != 0)
 	{
-		result &= (socket.Send("HTTP/1.1 %u %s\r\n",status,StatusMessage(status))
-			&& socket.Send("Content-Type: application/json; charset=utf-8\r\n\r\n{\n"));
+		string body = string("File \"") + filename + "\" not found.\n";
+		socket.Send("HTTP/1.1 404 Not found\r\n");
+		socket.Send("Content-Type: text/plain; charset=utf-8\r\nContent-Length: %zu\r\n\r\n", body.size());
+		socket.SendRaw(body.data(), body.size());
 	}
-	else
+	return false;
+}
+
+/**
+ * Send count bytes of a file starting at offset
+ * Plain and TCP sockets get the bytes with sendfile(2) (no copy through userspace)
+ * Sockets which transform what they send (WS, DES, Pipe...) get pread(2) + SendRaw
+ * @returns true if all count bytes were sent
+ */
+static bool SendRange(Socket & socket, int fd, off_t offset, off_t count)
+{
+	if (!socket.Valid())
+		return false;
+	bool direct = (typeid(socket) == typeid(Socket) 
+		|| dynamic_cast<TCP::Socket*>(&socket) != NULL);
+	while (direct && count > 0)
 	{
-		result &= socket.Send("{\n");
+		ssize_t sent = sendfile(socket.GetFD(), fd, &offset, count);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && socket.CanSend(-1))
+				continue;
+			if (errno == EINVAL || errno == ENOSYS)
+			{
+				direct = false; // eg: socket is not something sendfile can write to
+				break;
+			}
+			Error("Error in sendfile(2) - %s", StrError(errno));
+			return false;
+		}
+		if (sent == 0)
+			break; // file was truncated under us
+		socket.Sent(NULL, sent);
+		count -= sent;
 	}
-	for (auto i = m.begin(); i != m.end(); ++i)
+	char buffer[BUFSIZ];
+	while (!direct && count > 0)
 	{
-		if (i != m.begin())
-			result &= socket.Send(",\n");
-		result &= socket.Send("\t\"%s\" : \"%s\"", i->first.c_str(), i->second.c_str());
+		ssize_t got = pread(fd, buffer, min((off_t)sizeof(buffer), count), offset);
+		if (got <= 0 || socket.SendRaw(buffer, got) != got)
+			break;
+		offset += got;
+		count -= got;
 	}
-	return (socket.Send("\n}\n") && result);
+	return (count == 0);
 }
 
 bool SendFile(Socket & socket, const char * filename, unsigned status)
 {
-	FILE * file = fopen(filename, "r");
-	if (file == NULL)
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return SendNotFound(socket, filename, status);
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
 	{
-		if (status != 0)
-		{
-			socket.Send("HTTP/1.1 404 Not found\r\n");
-			socket.Send("Content-Type: text/plain; charset=utf-8\r\n\r\n");
-			socket.Send("File \"%s\" not found.\n", filename);
-		}
-		return false;
+		close(fd);
+		return SendNotFound(socket, filename, status);
 	}
-	bool result = socket.Send("HTTP/1.1 %u %s\r\n", status, StatusMessage(status));
+	bool result = true;
 	if (status != 0)
 	{	
-		// guess the content type from the file extension (if present)
-		char * extension = strrchr((char*)filename, (int)'.');
-		extension = (extension == NULL) ? (char*)"" : extension;
-		result &= socket.Send("HTTP/1.1 %u %s\r\n", status, StatusMessage(status));
-		const char * type = "Content-Type: text/plain";
-		if (strcmp(extension, ".html") == 0)
-		{
-			type = "Content-Type: text/html";
-			result &= socket.Send("%s; charset=utf-8\r\n\r\n", type);
-		}
-		else if (strcmp(extension, ".svg") == 0)
+		result = socket.Send("HTTP/1.1 %u %s\r\nContent-Type: %s\r\nContent-Length: %lld\r\n\r\n",
+			status, StatusMessage(status), ContentType(filename), (long long)st.st_size);
+	}
+	if (result)
+		result = SendRange(socket, fd, 0, st.st_size);
+	close(fd);
+	return result;
+}
+
+/** A byte range [first, last] of a file **/
+typedef pair<off_t, off_t> ByteRange;
+
+/** Upper limit on the number of parts sent in one multipart/byteranges response **/
+#define MAX_BYTE_RANGES 64
+
+/**
+ * Parse the value of a Range header, eg: "bytes=0-499,1000-,-500" (RFC 7233)
+ * @param value Value of the header
+ * @param size Size of the file
+ * @param ranges Satisfiable ranges, sorted with overlapping/adjacent ranges coalesced
+ * @returns false if the header is malformed (and should be ignored)
+ */
+static bool ParseRange(const string & value, off_t size, vector<ByteRange> & ranges)
+{
+	const char * s = value.c_str();
+	while (*s == ' ') ++s;
+	if (strncmp(s, "bytes=", 6) != 0)
+		return false;
+	s += 6;
+	while (*s != '\0')
+	{
+		while (*s == ' ' || *s == ',') ++s;
+		if (*s == '\0') break;
+		
+		char * end = NULL;
+		off_t first = -1;
+		off_t last = -1;
+		if (isdigit(*s)) 
 		{
-			type = "Content-Type: image/svg+xml";
-			result &= socket.Send("%s; charset=utf-8\r\n\r\n", type);
+			first = strtoll(s, &end, 10); 
+			s = end;
 		}
-		else if (strcmp(extension, ".png") == 0)
+		if (*(s++) != '-')
+			return false;
+		if (isdigit(*s)) 
 		{
-			type = "Content-Type: image/png";
-			result &= socket.Send("%s\r\n\r\n", type);
+			last = strtoll(s, &end, 10); 
+			s = end;
 		}
-		else if (strcmp(extension, ".gif") == 0)
-		{
-			type = "Content-Type: image/gif";
-			result &= socket.Send("%s\r\n\r\n", type);
+		while (*s == ' ') ++s;
+		if (*s != ',' && *s != '\0')
+			return false;
 			
+		if (first < 0) // suffix range; the last N bytes
+		{
+			if (last < 0) 
+				return false;
+			if (last == 0 || size == 0) 
+				continue; // unsatisfiable
+			first = (last > size) ? 0 : size - last;
+			last = size - 1;
 		}
 		else
 		{
-			result &= socket.Send("%s; charset=utf-8\r\n\r\n", type);
+			if (last >= 0 && last < first)
+				return false;
+			if (first >= size) 
+				continue; // unsatisfiable
+			if (last < 0 || last >= size) 
+				last = size - 1;
 		}
-		//TODO: Support other file types
-
-		
+		ranges.push_back(ByteRange(first, last));
 	}
+	
+	sort(ranges.begin(), ranges.end());
+	size_t n = 0;
+	for (size_t i = 1; i < ranges.size(); ++i)
+	{
+		if (ranges[i].first <= ranges[n].second + 1)
+			ranges[n].second = max(ranges[n].second, ranges[i].second);
+		else
+			ranges[++n] = ranges[i];
+	}
+	if (!ranges.empty())
+		ranges.resize(n+1);
+	return (ranges.size() <= MAX_BYTE_RANGES);
+}
 
-	if (result)
+bool SendFile(Socket & socket, Request & req, const char * filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return SendNotFound(socket, filename, 404);
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return SendNotFound(socket, filename, 404);
+	}
+	
+	off_t size = st.st_size;
+	const char * type = ContentType(filename);
+	string modified(HTTPDate(st.st_mtime));
+	char etag[64];
+	snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long)size, 
+		(unsigned long long)st.st_mtime);
+	
+	// Only honour Range if If-Range (when given) still matches the file
+	vector<ByteRange> ranges;
+	bool partial = false;
+	Headers & headers = req.Headers();
+	if (headers.Has(HEADER_RANGE) && (req.Method() == "GET" || req.Method() == "HEAD"))
+	{
+		StringRef if_range = headers.Get(HEADER_IF_RANGE);
+		partial = (!headers.Has(HEADER_IF_RANGE) || if_range == etag || if_range == modified);
+		partial = partial && ParseRange(headers.Get(HEADER_RANGE), size, ranges);
+	}
+	
+	// The whole header is formed first so that it goes out in one write
+	string response("");
+	if (partial && ranges.empty())
+	{
+		AppendF(response, "HTTP/1.1 416 %s\r\n", StatusMessage(416));
+		AppendF(response, "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n", (long long)size);
+		close(fd);
+		return socket.Send(response);
+	}
+	
+	AppendF(response, "HTTP/1.1 %u %s\r\n", partial ? 206 : 200, StatusMessage(partial ? 206 : 200));
+	AppendF(response, "Accept-Ranges: bytes\r\nETag: %s\r\n", etag);
+	AppendF(response, "Last-Modified: %s\r\n", modified.c_str());
+	
+	vector<string> parts; // multipart/byteranges part headers
+	char boundary[64];
+	snprintf(boundary, sizeof(boundary), "foxbox-%llx-%llx", (unsigned long long)size,
+		(unsigned long long)st.st_mtime);
+	if (!partial)
 	{
-		Socket input(file);
-		string line("");
-		input.Dump(socket);
+		AppendF(response, "Content-Type: %s\r\nContent-Length: %lld\r\n\r\n", type, (long long)size);
+		ranges.push_back(ByteRange(0, size-1));
 	}
-	/*
-	while (input.Valid())
+	else if (ranges.size() == 1)
 	{
-		line.clear();
-		input.GetToken(line, "\n", -1, true);
-		result &= socket.Send(line);
+		AppendF(response, "Content-Type: %s\r\n", type);
+		AppendF(response, "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)ranges[0].first,
+			(long long)ranges[0].second, (long long)size);
+		AppendF(response, "Content-Length: %lld\r\n\r\n", 
+			(long long)(ranges[0].second - ranges[0].first + 1));
 	}
-	*/
+	else
+	{
+		long long length = 0;
+		for (auto & r : ranges)
+		{
+			string part("");
+			AppendF(part, "\r\n--%s\r\nContent-Type: %s\r\n", boundary, type);
+			AppendF(part, "Content-Range: bytes %lld-%lld/%lld\r\n\r\n", (long long)r.first,
+				(long long)r.second, (long long)size);
+			length += part.size() + (r.second - r.first + 1);
+			parts.push_back(part);
+		}
+		string end("");
+		AppendF(end, "\r\n--%s--\r\n", boundary);
+		length += end.size();
+		parts.push_back(end);
+		AppendF(response, "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+		AppendF(response, "Content-Length: %lld\r\n\r\n", length);
+	}
+	
+	bool result = socket.Send(response);
+	for (size_t i = 0; result && req.Method() != "HEAD" && i < ranges.size(); ++i)
+	{
+		if (!parts.empty())
+			result &= socket.Send(parts[i]);
+		result = result && SendRange(socket, fd, ranges[i].first, ranges[i].second - ranges[i].first + 1);
+	}
+	if (result && req.Method() != "HEAD" && !parts.empty())
+		result &= socket.Send(parts.back());
+	close(fd);
 	return result;
 }
 
@@ -334,7 +894,7 @@ void Request::CGI(TCP::Socket & socket, const char * program, const map<string,
 		cgi_env["REQUEST_METHOD"] = m_request_type;
 		cgi_env["SERVER_PROTOCOL"] = "HTTP/1.1";
 		cgi_env["QUERY_STRING"] = m_query;
-		cgi_env["HTTP_USER_AGENT"] = m_headers["User-Agent"];
+		cgi_env["HTTP_USER_AGENT"] = m_headers.Get(HEADER_USER_AGENT).str();
 		cgi_env["SERVER_NAME"] = "";
 		cgi_env["REMOTE_ADDR"] = socket.RemoteAddress();
 		stringstream s; s << socket.Port();
@@ -363,15 +923,13 @@ void Request::CGI(TCP::Socket & socket, const char * program, const map<string,
 			
 		//Debug("Dumped output to process");
 		// read response headers
-		map<string, string> headers;
+		HTTP::Headers headers;
 		ParseHeaders(proc, headers);
 		//Debug("Got headers, valid = %d", proc.Valid());
-		map<string, string>::iterator it = headers.find("Status");
 		unsigned status = 200;
-		if (it != headers.end()) // if the script provided a status, read it; otherwise assume 200 OK
+		if (headers.Has(HEADER_STATUS)) // if the script provided a status, read it; otherwise assume 200 OK
 		{
-			stringstream s(it->second);
-			s >> status;
+			status = strtoul(headers.Get(HEADER_STATUS).str().c_str(), NULL, 10);
 			//Debug("Status header is %d", status);
 		}
 		//Debug("Sending status...");
@@ -382,9 +940,9 @@ void Request::CGI(TCP::Socket & socket, const char * program, const map<string,
 			
 		//Debug("Sent status");
 		//send the headers
-		for (it = headers.begin(); it != headers.end(); ++it)
+		for (size_t i = 0; i < headers.Size(); ++i)
 		{
-			socket.Send("%s: %s\r\n", it->first.c_str(), it->second.c_str());
+			socket.Send("%s: %s\r\n", headers.Name(i).str().c_str(), headers.Value(i).str().c_str());
 		}
 		socket.Send("\r\n");
 		//Debug("Sent headers, valid is %d", proc.Valid());
@@ -405,49 +963,196 @@ void Request::CGI(TCP::Socket & socket, const char * program, const map<string,
 	}
 }
 
+/** Characters left alone by URLEncode (RFC 3986 unreserved) **/
+static const bool g_url_unreserved[256] = {
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,0, 1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,
+	0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,0,0,0,0,1,
+	0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,0
+};
+
+/** Value of a hex digit, or -1 **/
+static inline int HexValue(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+/** Percent-encode s onto the end of a buffer with room for 3 * s.size() characters **/
+static char * URLEncodeTo(char * out, const StringRef & s)
+{
+	static const char * hex = "0123456789ABCDEF";
+	for (unsigned char c : s)
+	{
+		if (g_url_unreserved[c])
+			*out++ = c;
+		else if (c == ' ')
+			*out++ = '+';
+		else
+		{
+			*out++ = '%';
+			*out++ = hex[c >> 4];
+			*out++ = hex[c & 0xf];
+		}
+	}
+	return out;
+}
+
+void URLEncode(string & out, const StringRef & s)
+{
+	size_t size = out.size();
+	out.resize(size + 3*s.size());
+	out.resize(URLEncodeTo(&out[size], s) - out.data());
+}
+
+void URLDecode(string & out, const StringRef & s)
+{
+	const char * p = s.begin();
+	const char * end = s.end();
+	while (p < end)
+	{
+		// Copy up to the next character needing decoding in one go
+		const char * q = p;
+		while (q < end && *q != '%' && *q != '+') ++q;
+		out.append(p, q - p);
+		if (q >= end)
+			break;
+		int hi, lo;
+		if (*q == '+')
+		{
+			out += ' ';
+			p = q + 1;
+		}
+		else if (q + 2 < end && (hi = HexValue(q[1])) >= 0 && (lo = HexValue(q[2])) >= 0)
+		{
+			out += (char)((hi << 4) | lo);
+			p = q + 3;
+		}
+		else
+		{
+			// Not a valid escape; keep the '%'
+			out += '%';
+			p = q + 1;
+		}
+	}
+}
+
+/** Total size of the names and values of m **/
+static size_t QuerySize(const map<string, string> & m)
+{
+	size_t size = 0;
+	for (auto & it : m)
+		size += it.first.size() + it.second.size() + 2;
+	return size;
+}
+
+static size_t QuerySize(const Fields & m)
+{
+	size_t size = 0;
+	for (size_t i = 0; i < m.Size(); ++i)
+		size += m.Name(i).size() + m.Value(i).size() + 2;
+	return size;
+}
+
 void FormQuery(string & s, const map<string, string> & m, char seperator, char equals)
 {
+	// Encoding at most triples each character, so one resize is enough
+	size_t size = s.size();
+	s.resize(size + 3*QuerySize(m));
+	char * out = &s[size];
 	for (auto i = m.begin(); i != m.end(); ++i)
 	{
 		if (i != m.begin())
-			s += seperator;
-		s += i->first;
-		s += equals;
-		s += i->second;
+			*out++ = seperator;
+		out = URLEncodeTo(out, i->first);
+		*out++ = equals;
+		out = URLEncodeTo(out, i->second);
 	}
+	s.resize(out - s.data());
 }
 
-string ParseQuery(map<string, string> & m, const string & s, char start, 
-				char seperator, char equals, const char * strip)
+void FormQuery(string & s, const Fields & m, char seperator, char equals)
+{
+	size_t size = s.size();
+	s.resize(size + 3*QuerySize(m));
+	char * out = &s[size];
+	for (size_t i = 0; i < m.Size(); ++i)
+	{
+		if (i != 0)
+			*out++ = seperator;
+		out = URLEncodeTo(out, m.Name(i));
+		*out++ = equals;
+		out = URLEncodeTo(out, m.Value(i));
+	}
+	s.resize(out - s.data());
+}
+
+/**
+ * Add name and value to m, percent-decoding them straight into its buffer
+ * Strings with nothing to decode are appended as they are
+ */
+static void AddDecoded(Fields & m, const StringRef & name, const StringRef & value, bool decode)
 {
-	//Debug("Called");
-	stringstream ss(s);
+	if (!decode)
+	{
+		m.Add(name, value);
+		return;
+	}
+	string & buffer = m.Buffer();
+	size_t n = buffer.size();
+	URLDecode(buffer, name);
+	size_t v = buffer.size();
+	URLDecode(buffer, value);
+	m.AddRef(n, v - n, v, buffer.size() - v);
+}
+
+string ParseQuery(Fields & m, const StringRef & s, char start, 
+				char seperator, char equals, const char * strip, bool decode)
+{
+	const char * p = s.begin();
+	const char * end = s.end();
 	string ignored("");
-	while (start != '\0' && ss.good())
+	if (start != '\0')
 	{
-		int c = ss.get();
-		if (c == EOF || (char)c == start) break;
-		ignored += (char)c;
+		const char * q = (const char*)memchr(p, start, end - p);
+		if (q == NULL)
+			return s.str();
+		ignored.assign(p, q - p);
+		p = q + 1;
 	}
-	while (ss.good())
+	while (p < end)
 	{
-		string kv("");
-		getline(ss, kv, seperator);
-		while (kv.size() > 0 && strchr(strip, kv.front()) != NULL) kv.erase(kv.begin());
-		while (kv.size() > 0 && strchr(strip, kv.back()) != NULL) kv.pop_back();
-		
-		stringstream kvs(kv);
-		if (!kvs.good()) continue;
-	
-		string key("");
-		string value("");
-		getline(kvs, key, equals);
-		if (kvs.good())
-			getline(kvs, value, seperator);
-		//Debug("%s = %s", key.c_str(), value.c_str());
-		m[key] = value;	
+		const char * next = (const char*)memchr(p, seperator, end - p);
+		if (next == NULL)
+			next = end;
+		const char * kv = p;
+		const char * kv_end = next;
+		while (kv < kv_end && strchr(strip, *kv) != NULL) ++kv;
+		while (kv_end > kv && strchr(strip, *(kv_end-1)) != NULL) --kv_end;
+		if (kv < kv_end)
+		{
+			const char * eq = (const char*)memchr(kv, equals, kv_end - kv);
+			if (eq == NULL)
+				AddDecoded(m, StringRef(kv, kv_end - kv), StringRef(), decode);
+			else
+				AddDecoded(m, StringRef(kv, eq - kv), StringRef(eq + 1, kv_end - eq - 1), decode);
+		}
+		p = next + 1;
 	}
 	return ignored;
 }
+
+string ParseQuery(map<string, string> & m, const string & s, char start, 
+				char seperator, char equals, const char * strip, bool decode)
+{
+	static thread_local Fields fields;
+	fields.Clear();
+	string ignored(ParseQuery(fields, s, start, seperator, equals, strip, decode));
+	for (size_t i = 0; i < fields.Size(); ++i)
+		m[fields.Name(i)] = fields.Value(i);
+	return ignored;
+}
 	
 }} // end namespaces
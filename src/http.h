@@ -10,16 +10,136 @@
 #ifndef _HTTP_H
 #define _HTTP_H
 
-// All sets of key,value pairs are represented by map<string,string>
 #include <map> 
 #include <string>
+#include <vector>
+#include <stdint.h>
 
 #include "tcp.h"
+#include "stringref.h"
+#include "json.h"
 
 namespace Foxbox
 {
 	namespace HTTP
 	{		
+			/** 
+			 * Well known header names
+			 * Headers tables intern these names when fields are added, so looking
+			 * 	one up is an integer compare rather than a string compare
+			 * @see InternHeader
+			 */
+			enum HeaderID
+			{
+				HEADER_OTHER = 0,
+				HEADER_ACCEPT, HEADER_ACCEPT_ENCODING, HEADER_ACCEPT_RANGES, HEADER_AGE,
+				HEADER_AUTHORIZATION, HEADER_CACHE_CONTROL, HEADER_CONNECTION, HEADER_CONTENT_ENCODING,
+				HEADER_CONTENT_LENGTH, HEADER_CONTENT_RANGE, HEADER_CONTENT_TYPE, HEADER_COOKIE,
+				HEADER_DATE, HEADER_ETAG, HEADER_EXPIRES, HEADER_HOST, HEADER_IF_MODIFIED_SINCE,
+				HEADER_IF_NONE_MATCH, HEADER_IF_RANGE, HEADER_KEEP_ALIVE, HEADER_LAST_MODIFIED,
+				HEADER_LOCATION, HEADER_ORIGIN, HEADER_PRAGMA, HEADER_PROXY_AUTHENTICATE,
+				HEADER_PROXY_AUTHORIZATION, HEADER_PROXY_CONNECTION, HEADER_RANGE,
+				HEADER_SEC_WEBSOCKET_ACCEPT, HEADER_SEC_WEBSOCKET_EXTENSIONS, HEADER_SEC_WEBSOCKET_KEY,
+				HEADER_SEC_WEBSOCKET_PROTOCOL, HEADER_SEC_WEBSOCKET_VERSION, HEADER_SERVER,
+				HEADER_SET_COOKIE, HEADER_STATUS, HEADER_TE, HEADER_TRAILER, HEADER_TRANSFER_ENCODING,
+				HEADER_UPGRADE, HEADER_USER_AGENT, HEADER_VARY, HEADER_X_FORWARDED_FOR, HEADER_COUNT
+			};
+			
+			/** HeaderID of a header name (ignoring case), or HEADER_OTHER **/
+			extern HeaderID InternHeader(const StringRef & name);
+			/** Name of a well known header **/
+			extern const char * HeaderName(HeaderID id);
+			
+			/** Number of fields a Fields table holds before it allocates **/
+			#define FIELDS_INLINE 16
+			
+			/**
+			 * A flat table of {name, value} pairs (query parameters, cookies, ...)
+			 * All names and values refer to one character buffer owned by the table
+			 * 	and the first FIELDS_INLINE fields are stored inline, so a typical
+			 * 	request costs one buffer (reused across requests) rather than a
+			 * 	tree node and two strings per field.
+			 * Duplicate names are allowed; Get returns the first.
+			 */
+			class Fields
+			{
+				public:
+					Fields(bool ignore_case = false) : m_ignore_case(ignore_case), 
+						m_buffer(""), m_more(), m_size(0) {}
+					virtual ~Fields() {}
+					
+					static const size_t npos = (size_t)(-1);
+					
+					size_t Size() const {return m_size;}
+					bool Empty() const {return m_size == 0;}
+					StringRef Name(size_t i) const {return StringRef(m_buffer.data() + At(i).name, At(i).name_size);}
+					StringRef Value(size_t i) const {return StringRef(m_buffer.data() + At(i).value, At(i).value_size);}
+					HeaderID ID(size_t i) const {return At(i).id;}
+					
+					/** Index of the first field called name at or after start, or npos **/
+					size_t Find(const StringRef & name, size_t start = 0) const;
+					size_t Find(HeaderID id, size_t start = 0) const;
+					bool Has(const StringRef & name) const {return Find(name) != npos;}
+					bool Has(HeaderID id) const {return Find(id) != npos;}
+					/** Value of the first field called name, or fallback **/
+					StringRef Get(const StringRef & name, const StringRef & fallback = StringRef()) const
+					{
+						size_t i = Find(name);
+						return (i == npos) ? fallback : Value(i);
+					}
+					StringRef Get(HeaderID id, const StringRef & fallback = StringRef()) const
+					{
+						size_t i = Find(id);
+						return (i == npos) ? fallback : Value(i);
+					}
+					
+					/** Add a field (keeping any others with the same name) **/
+					void Add(const StringRef & name, const StringRef & value);
+					/** Replace all fields called name with one field **/
+					void Set(const StringRef & name, const StringRef & value);
+					/** Remove all fields called name @returns number removed **/
+					size_t Remove(const StringRef & name);
+					void Clear() {m_buffer.clear(); m_more.clear(); m_size = 0;}
+					
+					/** Characters the fields refer to; parsers receive directly into this **/
+					std::string & Buffer() {return m_buffer;}
+					const std::string & Buffer() const {return m_buffer;}
+					/** Add a field whose name and value are already in Buffer() (offsets) **/
+					void AddRef(size_t name, size_t name_size, size_t value, size_t value_size);
+					
+				protected:
+					struct Field
+					{
+						uint32_t name;
+						uint32_t name_size;
+						uint32_t value;
+						uint32_t value_size;
+						HeaderID id;
+					};
+					const Field & At(size_t i) const {return (i < FIELDS_INLINE) ? m_inline[i] : m_more[i - FIELDS_INLINE];}
+					Field & At(size_t i) {return (i < FIELDS_INLINE) ? m_inline[i] : m_more[i - FIELDS_INLINE];}
+					/** Offset of s if it refers into m_buffer, otherwise npos **/
+					size_t Offset(const StringRef & s) const
+					{
+						return (s.data() >= m_buffer.data() && s.data() + s.size() <= m_buffer.data() + m_buffer.size())
+							? (size_t)(s.data() - m_buffer.data()) : npos;
+					}
+					
+					bool m_ignore_case;
+					std::string m_buffer;
+					Field m_inline[FIELDS_INLINE];
+					std::vector<Field> m_more;
+					size_t m_size;
+			};
+			
+			/** HTTP headers; names ignore case and well known names are interned **/
+			class Headers : public Fields
+			{
+				public:
+					Headers() : Fields(true) {}
+					virtual ~Headers() {}
+			};
+			
 			/**
 			 * Helper class used for _both_ forming and receiving HTTP requests
 			 * Note: This does not inherit from Foxbox::Socket
@@ -37,17 +157,29 @@ namespace Foxbox
 							const std::string & query = "");
 					virtual ~Request();
 					
-					/** Access query parameters @returns mutable reference **/
-					std::map<std::string, std::string> & Params() {return m_params;}
-					/** Access cookie parameters @returns mutable reference **/
-					std::map<std::string, std::string> & Cookies() {return m_cookies;}
+					/** Access query parameters (parsed on first use) @returns mutable reference **/
+					Fields & Params();
+					/** Access cookie parameters (parsed on first use) @returns mutable reference **/
+					Fields & Cookies();
 					/** Access headers @returns mutable reference **/
-					std::map<std::string, std::string> & Headers() {return m_headers;}
+					HTTP::Headers & Headers() {return m_headers;}
 					/** Access path string @returns mutable reference **/
 					std::string & Path() {return m_path;}
+					/** Access request target as received (path and query) @returns mutable reference **/
+					std::string & URI() {return m_query;}
+					/** Access request method (GET, HEAD, ...) @returns mutable reference **/
+					std::string & Method() {return m_request_type;}
+					/** Access request body (read by HTTP::Server; Receive does not read it) @returns mutable reference **/
+					std::string & Body() {return m_body;}
 					
 					/** Receive a HTTP request over a Foxbox::Socket **/
 					bool Receive(Socket & socket, double timeout=-1);
+					/**
+					 * Parse a request line and headers from received data
+					 * @returns Size of the head (including the blank line), 0 if incomplete
+					 * 	Check Valid() if the head was complete
+					 */
+					size_t Parse(const char * data, size_t size);
 					/** Send a HTTP request over a Foxbox::Socket **/
 					bool Send(Socket & socket);
 					
@@ -60,30 +192,62 @@ namespace Foxbox
 					void CGI(TCP::Socket & socket, const char * program, const std::map<std::string, std::string> & env = {});
 					
 				private:
+					/** Forget the previous request **/
+					void Reset();
+					/** Parse the request line and headers in m_headers.Buffer() **/
+					bool ParseHead();
+					
 					std::string m_hostname;
 					std::string m_request_type;
 					std::string m_query;
 					std::string m_path;
-					std::map<std::string, std::string> m_params;
-					std::map<std::string, std::string> m_cookies;
-					std::map<std::string, std::string> m_headers;
+					std::string m_body;
+					Fields m_params;
+					Fields m_cookies;
+					HTTP::Headers m_headers;
+					bool m_params_parsed;
+					bool m_cookies_parsed;
 					std::vector<std::string> * m_split_path;
 					bool m_valid;
 			};
 			
-			/** Form a query string fom a map<string,string> of {key,value} pairs **/
+			/** Form a query string fom a map<string,string> of {key,value} pairs (percent-encoded) **/
 			extern void FormQuery(std::string & s, const std::map<std::string, std::string> & m, char seperator='&', char equals = '=');
-			/** Parse a query/cookie string to form a map<string,string> of {key,value} pairs **/
-			extern std::string ParseQuery(std::map<std::string, std::string> & m, const std::string & s, char start = '?', char seperator='&', char equals = '=',const char * strip = " \r\n;:");
+			extern void FormQuery(std::string & s, const Fields & m, char seperator='&', char equals = '=');
+			/** 
+			 * Parse a query/cookie string to form a table of {key,value} pairs
+			 * @param decode Decode %XX and '+' (decoded characters go straight into m's buffer)
+			 * @returns The part of s before start
+			 */
+			extern std::string ParseQuery(Fields & m, const StringRef & s, char start = '?', char seperator='&', char equals = '=',const char * strip = " \r\n;:", bool decode = true);
+			extern std::string ParseQuery(std::map<std::string, std::string> & m, const std::string & s, char start = '?', char seperator='&', char equals = '=',const char * strip = " \r\n;:", bool decode = true);
+			/** Append s to out with %XX and '+' decoded **/
+			extern void URLDecode(std::string & out, const StringRef & s);
+			/** Append s to out with everything but RFC 3986 unreserved characters percent-encoded (' ' as '+') **/
+			extern void URLEncode(std::string & out, const StringRef & s);
 			
-			/** Send JSON over a socket **/
+			/** 
+			 * Send JSON over a socket, as one write
+			 * @param status If non zero, send a response head (with Content-Length) first
+			 */
+			extern bool SendJSON(Socket & socket, const JSON::Writer & json, unsigned status=0);
+			/** Send a flat JSON object **/
 			extern bool SendJSON(Socket & socket, const std::map<std::string, std::string> & m, unsigned status=0);
+			extern bool SendJSON(Socket & socket, const Fields & m, unsigned status=0);
 			/** Send file **/
 			extern bool SendFile(Socket & socket, const char * filename, unsigned status=200);
 			inline bool SendFile(Socket & socket, const std::string & filename, unsigned status=200)
 			{
 				return SendFile(socket, filename.c_str(), status);
 			}
+			/** Send file in response to a request; honours Range and If-Range (206, 416) **/
+			extern bool SendFile(Socket & socket, Request & req, const char * filename);
+			inline bool SendFile(Socket & socket, Request & req, const std::string & filename)
+			{
+				return SendFile(socket, req, filename.c_str());
+			}
+			/** Guess the Content-Type of a file from its extension **/
+			extern const char * ContentType(const char * filename);
 			/** Send plain text **/
 			extern bool SendPlain(Socket & socket, unsigned status, const char * message="");
 			inline bool SendPlain(Socket & socket, const char * message="") {return SendPlain(socket, 200, message);}
@@ -92,10 +256,13 @@ namespace Foxbox
 			
 			/** Expects a HTTP response, returns the status code **/
 			extern unsigned ParseResponseHeaders(Socket & socket,
-				std::map<std::string, std::string> * m=NULL, std::string * reason=NULL, bool include_status_line=true, double timeout=-1);
+				Headers * m=NULL, std::string * reason=NULL, bool include_status_line=true, double timeout=-1);
+				
+			/** Parse a complete response head (status line and headers) that has already been received **/
+			extern unsigned ParseResponseHead(const StringRef & head, Headers & headers, std::string * reason=NULL);
 				
 			/** Just gets headers; no status line. **/
-			inline unsigned ParseHeaders(Socket & socket, std::map<std::string, std::string> & m) {return ParseResponseHeaders(socket, &m, NULL, false);}
+			inline unsigned ParseHeaders(Socket & socket, Headers & m) {return ParseResponseHeaders(socket, &m, NULL, false);}
 
 			/** Helper to split unwanted characters from HTTP headers and lines **/
 			inline void strip(std::string & s, const char * delims = "\t \r\n:")
@@ -122,6 +289,12 @@ namespace Foxbox
 					dest[it.first] = it.second;
 				return dest;
 			}
+			inline Fields & Update(Fields & dest, const std::map<std::string, std::string> & src)
+			{
+				for (auto & it : src)
+					dest.Set(it.first, it.second);
+				return dest;
+			}
 	}
 }
 
@@ -0,0 +1,453 @@
+/**
+ * @file httpclient.cpp
+ * @brief HTTP client with keep-alive connections - Definitions
+ * @see httpclient.h - Declarations
+ */
+
+#include "httpclient.h"
+
+#include <strings.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+using namespace std;
+
+namespace Foxbox {namespace HTTP
+{
+
+/** Largest response head accepted **/
+#define CLIENT_MAX_HEAD 65536
+/** Bytes read from a connection at a time **/
+#define CLIENT_READ_SIZE 16384
+/** Bodies up to this size are sent in the same write as the head **/
+#define CLIENT_COALESCE_BODY 65536
+/** Most bytes moved per splice(2) **/
+#define CLIENT_SPLICE_SIZE 65536
+/** Most of a body reserved before it arrives, whatever Content-Length says **/
+#define CLIENT_RESERVE_BODY (1 << 20)
+
+/** A connection and whatever has been received on it but not yet parsed **/
+struct Client::Connection
+{
+	Connection(const string & host, int port) : socket(host.c_str(), port), buffer(), pos(0), requests(0)
+	{
+		// Large bodies go out in a second write, which Nagle would delay
+		int tmp = 1;
+		setsockopt(socket.GetFD(), IPPROTO_TCP, TCP_NODELAY, &tmp, sizeof(tmp));
+	}
+	TCP::Client socket;
+	string buffer;
+	size_t pos; /** Start of unparsed data in buffer **/
+	unsigned requests; /** Number of requests sent so far **/
+
+	const char * Data() const {return buffer.data() + pos;}
+	size_t Available() const {return buffer.size() - pos;}
+	/** Drop parsed data from the front of the buffer **/
+	void Compact()
+	{
+		buffer.erase(0, pos);
+		pos = 0;
+	}
+};
+
+Client::Client(const string & host, int port, unsigned max_idle) : m_host(host), m_port(port),
+	m_max_idle(max_idle), m_timeout(30), m_max_body(CLIENT_MAX_BODY), m_mutex(), m_idle()
+{
+
+}
+
+Client::~Client()
+{
+	Clear();
+}
+
+void Client::Clear()
+{
+	vector<Connection*> idle;
+	m_mutex.lock();
+	idle.swap(m_idle);
+	m_mutex.unlock();
+	for (auto c : idle)
+		delete c;
+}
+
+/**
+ * Take an idle connection, or open a new one
+ * An idle connection with something to read has been closed by the server
+ */
+Client::Connection * Client::Take(bool fresh)
+{
+	while (!fresh)
+	{
+		Connection * c = NULL;
+		m_mutex.lock();
+		if (!m_idle.empty())
+		{
+			c = m_idle.back();
+			m_idle.pop_back();
+		}
+		m_mutex.unlock();
+		if (c == NULL)
+			break;
+		if (c->socket.Valid() && !c->socket.CanReceive(0))
+			return c;
+		delete c;
+	}
+	return new Connection(m_host, m_port);
+}
+
+void Client::Give(Connection * c)
+{
+	c->buffer.clear();
+	c->pos = 0;
+	m_mutex.lock();
+	if (m_idle.size() < m_max_idle)
+	{
+		m_idle.push_back(c);
+		c = NULL;
+	}
+	m_mutex.unlock();
+	delete c;
+}
+
+bool Client::Fill(Connection * c)
+{
+	c->Compact();
+	if (!c->socket.CanReceive(m_timeout))
+		return false;
+	size_t size = c->buffer.size();
+	c->buffer.resize(size + CLIENT_READ_SIZE);
+	int n = c->socket.GetRaw(&c->buffer[size], CLIENT_READ_SIZE);
+	c->buffer.resize(size + max(n, 0));
+	return n > 0;
+}
+
+/** Pass body data to the callback or relay socket, or append it to the response **/
+static inline bool Deliver(Response & response, Foxbox::Socket * relay, const Client::BodyCallback & on_body, 
+	const char * data, size_t size)
+{
+	if (on_body)
+		return on_body(data, size);
+	if (relay != NULL)
+		return relay->SendRaw(data, size) == (int)size;
+	response.Body().append(data, size);
+	return true;
+}
+
+/** Pass chunk framing on to the relay socket (if relaying raw) **/
+static inline bool Frame(Foxbox::Socket * relay, const Client::BodyCallback & on_body, const char * data, size_t size)
+{
+	return on_body || relay == NULL || relay->SendRaw(data, size) == (int)size;
+}
+
+/**
+ * Move up to length bytes (or until EOF) from socket "from" to fd "to" through a pipe,
+ * 	without copying them into user space
+ * @returns bytes moved, or -1 on error (errno EINVAL if splice(2) can't be used
+ * 	with these file descriptors and nothing was moved)
+ */
+static ssize_t Splice(Foxbox::Socket & from, int to, size_t length, double timeout)
+{
+	static thread_local int pipefd[2] = {-1, -1};
+	if (pipefd[0] < 0 && pipe2(pipefd, O_CLOEXEC) != 0)
+		return -1;
+	size_t moved = 0;
+	while (moved < length)
+	{
+		if (!from.CanReceive(timeout))
+			break;
+		ssize_t n = splice(from.GetFD(), NULL, pipefd[1], NULL, min(length - moved, (size_t)CLIENT_SPLICE_SIZE),
+			SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n == 0)
+			break;
+		if (n < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return (moved == 0) ? -1 : (ssize_t)moved;
+		}
+		while (n > 0)
+		{
+			ssize_t m = splice(pipefd[0], NULL, to, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m <= 0)
+			{
+				// Whatever is left in the pipe would corrupt the next body
+				close(pipefd[0]);
+				close(pipefd[1]);
+				pipefd[0] = pipefd[1] = -1;
+				errno = EPIPE;
+				return -1;
+			}
+			n -= m;
+			moved += m;
+		}
+	}
+	return moved;
+}
+
+bool Client::ReadBody(Connection * c, size_t length, bool to_eof, Response & response, const BodyCallback & on_body)
+{
+	Foxbox::Socket * relay = response.m_relay;
+	bool keep = !on_body && relay == NULL; // Into response.Body(), which is limited
+	if (keep && !to_eof)
+	{
+		if (length > m_max_body - min(m_max_body, response.Body().size()))
+		{
+			Error("Body from %s:%d is bigger than %zu bytes", m_host.c_str(), m_port, m_max_body);
+			return false;
+		}
+		// The length is only the server's word; the rest is allocated as it arrives
+		response.Body().reserve(response.Body().size() + min(length, (size_t)CLIENT_RESERVE_BODY));
+	}
+	while (to_eof || length > 0)
+	{
+		size_t take = to_eof ? c->Available() : min(c->Available(), length);
+		if (keep && to_eof && take > m_max_body - min(m_max_body, response.Body().size()))
+		{
+			Error("Body from %s:%d is bigger than %zu bytes", m_host.c_str(), m_port, m_max_body);
+			return false;
+		}
+		if (take > 0 && !Deliver(response, relay, on_body, c->Data(), take))
+			return false;
+		c->pos += take;
+		length -= to_eof ? 0 : take;
+		if (!to_eof && length == 0)
+			break;
+		if (!on_body && relay != NULL && relay->GetFD() >= 0)
+		{
+			// Nothing left in the buffer; move the rest of the body in the kernel
+			ssize_t moved = Splice(c->socket, relay->GetFD(), to_eof ? (size_t)(-1) : length, m_timeout);
+			if (moved > 0)
+				relay->Sent(NULL, moved);
+			if (moved >= 0)
+				return to_eof || (size_t)moved == length;
+			if (errno != EINVAL)
+				return false;
+		}
+		if (!Fill(c))
+			return to_eof;
+	}
+	return true;
+}
+
+bool Client::ReadChunked(Connection * c, Response & response, const BodyCallback & on_body)
+{
+	Foxbox::Socket * relay = response.m_relay;
+	while (true)
+	{
+		// chunk-size [; chunk-ext] CRLF
+		size_t eol;
+		while ((eol = c->buffer.find('\n', c->pos)) == string::npos)
+		{
+			if (c->Available() > CLIENT_MAX_HEAD || !Fill(c))
+				return false;
+		}
+		char * end = NULL;
+		size_t size = strtoul(c->buffer.c_str() + c->pos, &end, 16);
+		if (end == c->buffer.c_str() + c->pos || !Frame(relay, on_body, c->Data(), eol + 1 - c->pos))
+			return false;
+		c->pos = eol + 1;
+		if (size == 0)
+			break;
+		if (!ReadBody(c, size, false, response, on_body))
+			return false;
+		// CRLF after the data
+		while (c->Available() < 2 && (c->Available() == 0 || c->Data()[0] != '\n'))
+		{
+			if (!Fill(c))
+				return false;
+		}
+		size_t crlf = (c->Data()[0] == '\r') ? 2 : 1;
+		if (!Frame(relay, on_body, c->Data(), crlf))
+			return false;
+		c->pos += crlf;
+	}
+	// Trailers (ignored) up to a blank line
+	while (true)
+	{
+		size_t eol;
+		while ((eol = c->buffer.find('\n', c->pos)) == string::npos)
+		{
+			if (c->Available() > CLIENT_MAX_HEAD || !Fill(c))
+				return false;
+		}
+		bool blank = (eol == c->pos) || (eol == c->pos + 1 && c->buffer[c->pos] == '\r');
+		if (!Frame(relay, on_body, c->Data(), eol + 1 - c->pos))
+			return false;
+		c->pos = eol + 1;
+		if (blank)
+			return true;
+	}
+}
+
+int Client::Exchange(Connection * c, const string & head, const StringRef & body, bool head_only,
+	Response & response, const BodyCallback & on_body, const HeadCallback & on_head, bool & keep_alive)
+{
+	response.Clear();
+	c->buffer.clear();
+	c->pos = 0;
+	++c->requests;
+
+	if (body.size() <= CLIENT_COALESCE_BODY)
+	{
+		string & out = c->buffer;
+		out.assign(head);
+		out.append(body.data(), body.size());
+		bool sent = (c->socket.SendRaw(out.data(), out.size()) == (int)out.size());
+		out.clear();
+		if (!sent)
+			return -1;
+	}
+	else if (c->socket.SendRaw(head.data(), head.size()) != (int)head.size()
+		|| c->socket.SendRaw(body.data(), body.size()) != (int)body.size())
+	{
+		return -1;
+	}
+
+	// Status line and headers; interim (1xx) responses are skipped
+	size_t search = 0;
+	while (true)
+	{
+		size_t end = string::npos;
+		for (size_t eol = c->buffer.find('\n', search); eol != string::npos; eol = c->buffer.find('\n', eol + 1))
+		{
+			size_t next = eol + 1;
+			if (next < c->buffer.size() && c->buffer[next] == '\r')
+				++next;
+			if (next < c->buffer.size() && c->buffer[next] == '\n')
+			{
+				end = next + 1;
+				break;
+			}
+			search = eol;
+		}
+		if (end == string::npos)
+		{
+			if (c->buffer.size() > CLIENT_MAX_HEAD)
+				return 0;
+			if (!Fill(c))
+				return c->buffer.empty() ? -1 : 0;
+			continue;
+		}
+		response.m_status = ParseResponseHead(StringRef(c->buffer.data(), end), response.m_headers, &response.m_reason);
+		c->pos = end;
+		if (response.m_status == 0)
+			return 0;
+		if (response.m_status / 100 != 1 || response.m_status == 101)
+			break;
+		c->Compact();
+		search = 0;
+	}
+
+	// An HTTP/1.0 server closes after each response unless it says otherwise
+	StringRef connection(response.m_headers.Get(HEADER_CONNECTION));
+	if (c->buffer.compare(0, 9, "HTTP/1.0 ") == 0)
+		keep_alive = connection.EqualsIgnoreCase("keep-alive");
+	else
+		keep_alive = !connection.EqualsIgnoreCase("close");
+	if (on_head && !on_head(response))
+	{
+		keep_alive = false;
+		return 0;
+	}
+	unsigned status = response.m_status;
+	if (head_only || status / 100 == 1 || status == 204 || status == 304)
+		return 1;
+
+	StringRef encoding(response.m_headers.Get(HEADER_TRANSFER_ENCODING));
+	bool ok;
+	if (!encoding.empty() && !encoding.EqualsIgnoreCase("identity"))
+	{
+		// RFC 7230 3.3.3: chunked must be the last encoding
+		ok = encoding.size() >= 7 && strncasecmp(encoding.end() - 7, "chunked", 7) == 0
+			&& ReadChunked(c, response, on_body);
+	}
+	else if (response.m_headers.Has(HEADER_CONTENT_LENGTH))
+	{
+		size_t length = strtoull(response.m_headers.Get(HEADER_CONTENT_LENGTH).str().c_str(), NULL, 10);
+		ok = ReadBody(c, length, false, response, on_body);
+	}
+	else
+	{
+		// Framed by the server closing the connection
+		keep_alive = false;
+		ok = ReadBody(c, 0, true, response, on_body);
+	}
+	if (!ok)
+		keep_alive = false;
+	return ok ? 1 : 0;
+}
+
+bool Client::Send(const string & method, const string & path, Response & response,
+	const StringRef & body, const Fields * headers, const BodyCallback & on_body, const HeadCallback & on_head)
+{
+	string head;
+	head.reserve(256);
+	head += method;
+	head += (path.empty() || path[0] != '/') ? " /" : " ";
+	head += path;
+	head += " HTTP/1.1\r\nHost: ";
+	head += m_host;
+	if (m_port != 80)
+	{
+		char port[16];
+		head.append(port, snprintf(port, sizeof(port), ":%d", m_port));
+	}
+	head += "\r\n";
+	bool user_agent = false;
+	if (headers != NULL)
+	{
+		for (size_t i = 0; i < headers->Size(); ++i)
+		{
+			StringRef name(headers->Name(i));
+			StringRef value(headers->Value(i));
+			user_agent |= name.EqualsIgnoreCase("User-Agent");
+			head.append(name.data(), name.size());
+			head += ": ";
+			head.append(value.data(), value.size());
+			head += "\r\n";
+		}
+	}
+	if (!user_agent)
+		head += "User-Agent: Foxbox/1.0\r\n";
+	if (!body.empty() || method == "POST" || method == "PUT")
+	{
+		char length[48];
+		head.append(length, snprintf(length, sizeof(length), "Content-Length: %zu\r\n", body.size()));
+	}
+	head += "\r\n";
+
+	// A kept-alive connection may have been closed by the server just as we
+	// 	reused it; if so, try once more on a new connection
+	for (int attempt = 0; attempt < 2; ++attempt)
+	{
+		Connection * c = NULL;
+		try
+		{
+			c = Take(attempt > 0);
+		}
+		catch (Exception & e)
+		{
+			Error("Couldn't connect to %s:%d - %s", m_host.c_str(), m_port, e.what());
+			return false;
+		}
+		bool keep_alive = false;
+		bool reused = (c->requests > 0);
+		int result = Exchange(c, head, body, method == "HEAD", response, on_body, on_head, keep_alive);
+		if (result == 1 && keep_alive)
+			Give(c);
+		else
+			delete c;
+		if (result == 1)
+			return true;
+		if (result == 0 || !reused)
+			return false;
+	}
+	return false;
+}
+
+}}
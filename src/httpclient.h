@@ -0,0 +1,142 @@
+/**
+ * @file httpclient.h
+ * @brief HTTP client with keep-alive connections - Declarations
+ * @see httpclient.cpp - Definitions
+ * @see http.h - HTTP::Request et al
+ */
+
+#ifndef _HTTPCLIENT_H
+#define _HTTPCLIENT_H
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "http.h"
+
+namespace Foxbox
+{
+	namespace HTTP
+	{
+		/** Largest body HTTP::Client receives into Response::Body by default **/
+		#define CLIENT_MAX_BODY (64 << 20)
+
+		/** A response received by HTTP::Client **/
+		class Response
+		{
+			public:
+				Response() : m_status(0), m_reason(), m_headers(), m_body(), m_relay(NULL) {}
+				virtual ~Response() {}
+
+				/** Status code, 0 if no response was received **/
+				unsigned Status() const {return m_status;}
+				/** Access reason phrase @returns mutable reference **/
+				std::string & Reason() {return m_reason;}
+				/** Access headers @returns mutable reference **/
+				HTTP::Headers & Headers() {return m_headers;}
+				/** Access body (decoded if it was chunked) @returns mutable reference **/
+				std::string & Body() {return m_body;}
+
+				/**
+				 * Write the body to socket exactly as received (chunk framing included)
+				 * 	instead of to Body(); spliced between the file descriptors if possible
+				 * @param socket Socket to relay to (NULL to stop relaying)
+				 */
+				void Relay(Foxbox::Socket * socket) {m_relay = socket;}
+
+				/** Forget the last response (the relay socket is kept) **/
+				void Clear() {m_status = 0; m_reason.clear(); m_headers.Clear(); m_body.clear();}
+
+			private:
+				friend class Client;
+				unsigned m_status;
+				std::string m_reason;
+				HTTP::Headers m_headers;
+				std::string m_body;
+				Foxbox::Socket * m_relay;
+		};
+
+		/**
+		 * Issues requests to one host:port over a pool of keep-alive connections
+		 * Responses are framed by Content-Length or chunked Transfer-Encoding so
+		 * 	the connection can be reused; only a response framed by closing the
+		 * 	connection costs a new one. Thread safe; each thread uses its own
+		 * 	connection for the duration of a request.
+		 * @see examples/wget.cpp
+		 */
+		class Client
+		{
+			public:
+				/** Receives the body as it arrives (instead of Response::Body); return false to abort **/
+				typedef std::function<bool(const char * data, size_t size)> BodyCallback;
+				/** Called when the status line and headers have arrived, before the body; return false to abort **/
+				typedef std::function<bool(Response & response)> HeadCallback;
+
+				/**
+				 * @param host Host name or IPv4 address
+				 * @param port Port
+				 * @param max_idle Most idle connections to keep open
+				 */
+				Client(const std::string & host, int port = 80, unsigned max_idle = 4);
+				virtual ~Client();
+
+				/**
+				 * Send a request and receive the response
+				 * @param method GET, POST, ...
+				 * @param path Path and query (with or without the leading '/')
+				 * @param body Request body (Content-Length is sent if non empty, or the method is POST or PUT)
+				 * @param headers Extra request headers (may be NULL)
+				 * @param on_body If set, receives the body instead of response.Body()
+				 * @param on_head If set, called before the body is received
+				 * @returns false if no complete response was received
+				 */
+				bool Send(const std::string & method, const std::string & path, Response & response,
+					const StringRef & body = StringRef(), const Fields * headers = NULL,
+					const BodyCallback & on_body = BodyCallback(), const HeadCallback & on_head = HeadCallback());
+				bool Get(const std::string & path, Response & response, const Fields * headers = NULL)
+				{
+					return Send("GET", path, response, StringRef(), headers);
+				}
+				bool Post(const std::string & path, const StringRef & body, Response & response, const Fields * headers = NULL)
+				{
+					return Send("POST", path, response, body, headers);
+				}
+
+				/** Seconds to wait for the server each time it is read from (<0 to wait forever) **/
+				void Timeout(double timeout) {m_timeout = timeout;}
+				/** Largest body received into Response::Body; a bigger one fails the request (on_body and relays aren't limited) **/
+				void MaxBody(size_t max_body) {m_max_body = max_body;}
+				/** Close idle connections **/
+				void Clear();
+
+				const std::string & Host() const {return m_host;}
+				int Port() const {return m_port;}
+
+			private:
+				Client(const Client & cpy) = delete;
+				Client & operator=(const Client & cpy) = delete;
+
+				struct Connection;
+				Connection * Take(bool fresh);
+				void Give(Connection * c);
+				/** @returns 1 on success, 0 on failure, -1 if the connection closed before responding **/
+				int Exchange(Connection * c, const std::string & head, const StringRef & body, bool head_only,
+					Response & response, const BodyCallback & on_body, const HeadCallback & on_head, bool & keep_alive);
+				bool ReadChunked(Connection * c, Response & response, const BodyCallback & on_body);
+				bool ReadBody(Connection * c, size_t length, bool to_eof, Response & response, const BodyCallback & on_body);
+				/** Read more into c's buffer @returns false on timeout, error or EOF **/
+				bool Fill(Connection * c);
+
+				std::string m_host;
+				int m_port;
+				unsigned m_max_idle;
+				double m_timeout;
+				size_t m_max_body;
+				std::mutex m_mutex;
+				std::vector<Connection*> m_idle;
+		};
+	}
+}
+
+#endif //_HTTPCLIENT_H
@@ -0,0 +1,370 @@
+/**
+ * @file httpserver.cpp
+ * @brief Multithreaded HTTP server - Definitions
+ * @see httpserver.h - Declarations
+ */
+
+#include "httpserver.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+using namespace std;
+
+namespace Foxbox {namespace HTTP
+{
+
+/** Bytes read from a connection at a time **/
+#define SERVER_READ_SIZE 16384
+/** Events a connection waits for between requests **/
+#define SERVER_READ_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+
+/** A connection and the request being read from it; only one thread uses it at a time **/
+struct Server::Connection
+{
+	Connection(int fd, int port, IOThread * i) : socket(fd, port), io(i), watch(NULL),
+		buffer(), head(0), eof(false), receiving(false), start(0), timer(), request() {peer[0] = '\0';}
+	TCP::Connection socket;
+	IOThread * io;
+	EventLoop::Watch * watch;
+	string buffer; /** Received but not yet handled **/
+	size_t head; /** Size of the parsed request head at the start of buffer (0 if not parsed) **/
+	bool eof;
+	bool receiving; /** Part of a request has arrived; its deadline is set **/
+	int64_t start; /** When the request started arriving (TimerWheel::Now) **/
+	char peer[INET_ADDRSTRLEN]; /** Client address **/
+	EventLoop::Timer timer; /** Idle timeout or request deadline **/
+	Request request;
+};
+
+static void SetBlocking(int fd, bool blocking)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return;
+	flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+	fcntl(fd, F_SETFL, flags);
+}
+
+Server::Server(int port, unsigned io_threads, unsigned workers) : m_port(port),
+	m_io_count(io_threads), m_worker_count(workers), m_handler(), m_upgrade_protocol(),
+	m_upgrade_handler(), m_keep_alive(false),
+	m_max_body(1 << 20), m_idle_timeout(15), m_request_timeout(30), m_access_log(NULL), m_listen_fd(-1), m_io(), m_pool(NULL), m_running(false),
+	m_mutex(), m_stopped()
+{
+	if (m_io_count == 0)
+		m_io_count = max(1u, thread::hardware_concurrency());
+}
+
+Server::~Server()
+{
+	Stop();
+	Shutdown();
+}
+
+void Server::Start()
+{
+	if (m_listen_fd >= 0)
+		return;
+	m_listen_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m_listen_fd < 0)
+		Fatal("Error creating TCP socket - %s", StrError(errno));
+	int tmp = 1;
+	if (setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &tmp, sizeof(tmp)) != 0)
+		Fatal("Error in setsockopt(2) - %s", StrError(errno));
+
+	struct sockaddr_in name;
+	memset(&name, 0, sizeof(name));
+	name.sin_family = AF_INET;
+	name.sin_addr.s_addr = htonl(INADDR_ANY);
+	name.sin_port = htons(m_port);
+	if (bind(m_listen_fd, (struct sockaddr*)&name, sizeof(name)) < 0)
+		Fatal("Error binding socket - %s", StrError(errno));
+	if (listen(m_listen_fd, SOMAXCONN) < 0)
+		Fatal("Error listening - %s", StrError(errno));
+
+	m_running = true;
+	m_pool = new WorkPool(m_worker_count);
+	for (unsigned i = 0; i < m_io_count; ++i)
+	{
+		IOThread * io = new IOThread();
+		m_io.push_back(io);
+		// EPOLLEXCLUSIVE wakes one IO thread per connection rather than all of them
+		if (io->loop.Add(m_listen_fd, EPOLLIN | EPOLLEXCLUSIVE, [this, io](uint32_t) {Accept(io);}) == NULL)
+			Fatal("Couldn't watch listening socket");
+		io->thread = thread(&EventLoop::Run, &io->loop);
+	}
+}
+
+void Server::Run()
+{
+	Start();
+	unique_lock<mutex> lock(m_mutex);
+	while (m_running)
+		m_stopped.wait(lock);
+	lock.unlock();
+	Shutdown();
+}
+
+void Server::Stop()
+{
+	m_mutex.lock();
+	m_running = false;
+	m_mutex.unlock();
+	m_stopped.notify_all();
+}
+
+/**
+ * Stop the IO threads, then the handlers, then close what is left
+ * Handlers still running finish first; the IO threads never see their results
+ */
+void Server::Shutdown()
+{
+	for (auto io : m_io)
+		io->loop.Stop();
+	for (auto io : m_io)
+	{
+		if (io->thread.joinable())
+			io->thread.join();
+	}
+	delete m_pool;
+	m_pool = NULL;
+	for (auto io : m_io)
+	{
+		for (auto c : io->connections)
+			delete c;
+		delete io;
+	}
+	m_io.clear();
+	if (m_listen_fd >= 0)
+		close(m_listen_fd);
+	m_listen_fd = -1;
+}
+
+void Server::Accept(IOThread * io)
+{
+	while (true)
+	{
+		struct sockaddr_in address;
+		socklen_t size = sizeof(address);
+		int fd = accept4(m_listen_fd, (struct sockaddr*)&address, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+				Error("Error accepting connection - %s", StrError(errno));
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+		int tmp = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &tmp, sizeof(tmp));
+		Connection * c = new Connection(fd, m_port, io);
+		if (m_access_log != NULL)
+			inet_ntop(AF_INET, &address.sin_addr, c->peer, sizeof(c->peer));
+		c->watch = io->loop.Add(fd, SERVER_READ_EVENTS, [this, c](uint32_t events) {Readable(c, events);});
+		if (c->watch == NULL)
+		{
+			delete c;
+			continue;
+		}
+		io->connections.insert(c);
+		if (m_idle_timeout > 0)
+			io->loop.Schedule(c->timer, m_idle_timeout, [this, c]() {Close(c);});
+	}
+}
+
+void Server::Readable(Connection * c, uint32_t events)
+{
+	// Read no more than Process could accept, so a client that keeps sending can't hold the thread
+	size_t limit = (c->head == 0) ? SERVER_MAX_HEAD : c->head + m_max_body;
+	while (!c->eof && c->buffer.size() <= limit)
+	{
+		size_t size = c->buffer.size();
+		c->buffer.resize(size + SERVER_READ_SIZE);
+		ssize_t n = recv(c->socket.GetFD(), &c->buffer[size], SERVER_READ_SIZE, 0);
+		c->buffer.resize(size + max(n, (ssize_t)0));
+		if (n > 0)
+			continue;
+		if (n == 0)
+			c->eof = true;
+		else if (errno == EINTR)
+			continue;
+		else if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			Close(c);
+			return;
+		}
+		break;
+	}
+	if (events & (EPOLLERR | EPOLLHUP))
+		c->eof = true;
+	Process(c);
+}
+
+void Server::Process(Connection * c)
+{
+	if (c->head == 0)
+	{
+		c->head = c->request.Parse(c->buffer.data(), c->buffer.size());
+		if (c->head == 0)
+		{
+			if (c->buffer.size() > SERVER_MAX_HEAD)
+				Reject(c, 400);
+			else if (c->eof)
+				Close(c);
+			else
+				Wait(c);
+			return;
+		}
+		if (!c->request.Valid() || c->head > SERVER_MAX_HEAD)
+		{
+			Reject(c, 400);
+			return;
+		}
+		if (m_upgrade_handler && c->request.Headers().Get(HEADER_UPGRADE).EqualsIgnoreCase(m_upgrade_protocol))
+		{
+			Upgrade(c);
+			return;
+		}
+		if (c->request.Headers().Has(HEADER_TRANSFER_ENCODING))
+		{
+			Reject(c, 411);
+			return;
+		}
+	}
+
+	size_t length = strtoull(c->request.Headers().Get(HEADER_CONTENT_LENGTH, "0").str().c_str(), NULL, 10);
+	if (length > m_max_body)
+	{
+		Reject(c, 413);
+		return;
+	}
+	if (c->buffer.size() < c->head + length)
+	{
+		if (c->eof)
+			Close(c);
+		else
+			Wait(c);
+		return;
+	}
+	c->request.Body().assign(c->buffer, c->head, length);
+	c->buffer.erase(0, c->head + length);
+	c->head = 0;
+	// The handler takes as long as it takes
+	c->io->loop.Cancel(c->timer);
+	if (!c->receiving)
+		c->start = TimerWheel::Now();
+	c->receiving = false;
+	// No events are delivered for c until Process re-arms it
+	m_pool->Submit([this, c]() {Handle(c);});
+}
+
+void Server::Wait(Connection * c)
+{
+	if (c->buffer.empty() && c->head == 0)
+	{
+		if (m_idle_timeout > 0)
+			c->io->loop.Schedule(c->timer, m_idle_timeout, [this, c]() {Close(c);});
+	}
+	else if (!c->receiving)
+	{
+		// The deadline is for the whole request, not each read
+		c->receiving = true;
+		c->start = TimerWheel::Now();
+		if (m_request_timeout > 0)
+			c->io->loop.Schedule(c->timer, m_request_timeout, [this, c]() {Reject(c, 408);});
+		else
+			c->io->loop.Cancel(c->timer);
+	}
+	c->io->loop.Modify(c->watch, SERVER_READ_EVENTS);
+}
+
+void Server::Handle(Connection * c)
+{
+	bool keep_alive = m_keep_alive && !c->request.Headers().Get(HEADER_CONNECTION).EqualsIgnoreCase("close");
+	SetBlocking(c->socket.GetFD(), true);
+	c->socket.ResetSent();
+	try
+	{
+		if (m_handler)
+			m_handler(c->request, c->socket);
+		else
+			SendPlain(c->socket, 404, "Not found");
+	}
+	catch (Exception & e)
+	{
+		Error("Exception %s caught handling %s", e.what(), c->request.Path().c_str());
+		SendPlain(c->socket, 500, "Internal Server Error");
+		keep_alive = false;
+	}
+	LogAccess(c);
+	// Without a length the client reads the body until the connection closes
+	if (!c->socket.FramedSent() && c->request.Method() != "HEAD")
+		keep_alive = false;
+	if (!c->socket.Valid())
+		keep_alive = false;
+	else
+		SetBlocking(c->socket.GetFD(), false);
+	c->io->loop.Post([this, c, keep_alive]()
+	{
+		if (keep_alive)
+			Process(c);
+		else
+			Close(c);
+	});
+}
+
+void Server::Upgrade(Connection * c)
+{
+	c->io->loop.Remove(c->watch);
+	c->io->connections.erase(c);
+	int fd = c->socket.Release();
+	c->buffer.erase(0, c->head);
+	try
+	{
+		if (fd >= 0)
+			m_upgrade_handler(c->request, fd, c->buffer);
+	}
+	catch (Exception & e)
+	{
+		Error("Exception %s caught upgrading %s", e.what(), c->request.Path().c_str());
+	}
+	delete c;
+}
+
+void Server::Reject(Connection * c, unsigned status)
+{
+	c->socket.ResetSent();
+	SendPlain(c->socket, status, StatusMessage(status));
+	if (!c->receiving)
+		c->start = TimerWheel::Now();
+	LogAccess(c);
+	Close(c);
+}
+
+void Server::LogAccess(Connection * c)
+{
+	if (m_access_log == NULL)
+		return;
+	double seconds = (TimerWheel::Now() - c->start) / 1e9;
+	m_access_log->Add(c->request, c->socket.StatusSent(), c->socket.BytesSent(), seconds, c->peer);
+}
+
+void Server::Close(Connection * c)
+{
+	c->io->loop.Remove(c->watch, c->socket.GetFD() < 0);
+	c->io->connections.erase(c);
+	delete c;
+}
+
+}}
@@ -0,0 +1,145 @@
+/**
+ * @file httpserver.h
+ * @brief Multithreaded HTTP server - Declarations
+ * @see httpserver.cpp - Definitions
+ * @see eventloop.h - IO threads
+ * @see pool.h - Handler threads
+ */
+
+#ifndef _HTTPSERVER_H
+#define _HTTPSERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "http.h"
+#include "accesslog.h"
+#include "eventloop.h"
+#include "pool.h"
+
+namespace Foxbox
+{
+	namespace HTTP
+	{
+		/** Largest request line and headers accepted (400 if exceeded) **/
+		#define SERVER_MAX_HEAD 65536
+
+		/**
+		 * A HTTP server with separate IO and handler threads
+		 * IO threads each run an EventLoop; they accept connections (the listening
+		 * 	socket is shared, one thread is woken per connection) and read requests
+		 * 	without blocking. A complete request (head and Content-Length body) is
+		 * 	passed to a WorkPool, where the Handler runs with the socket in blocking
+		 * 	mode, so a slow handler (eg: CGI) only holds up its own connection.
+		 * Each IO thread's timer wheel closes connections idle between requests, and
+		 * 	answers 408 to a request not received in time (so a client trickling
+		 * 	headers can't hold a connection open).
+		 * A request to switch protocols (Upgrade: websocket, say) on any path can
+		 * 	be handed, with its connection, to an UpgradeHandler on the IO thread
+		 * 	instead (eg: WS::EventServer::Adopt), so both share a port.
+		 * @see examples/httpserver.cpp
+		 */
+		class Server
+		{
+			public:
+				/** Called on a handler thread for each request; send the response through socket **/
+				typedef std::function<void(Request & req, TCP::Socket & socket)> Handler;
+				/**
+				 * Called on an IO thread for a request to switch protocols; must not block
+				 * @param fd The connection (non-blocking), which the handler now owns
+				 * @param rest Bytes received after the request, which the handler may take
+				 */
+				typedef std::function<void(Request & req, int fd, std::string & rest)> UpgradeHandler;
+
+				/**
+				 * @param port Port to listen on
+				 * @param io_threads Number of IO threads (0 for one per core)
+				 * @param workers Number of handler threads (0 for one per core)
+				 */
+				Server(int port, unsigned io_threads = 0, unsigned workers = 0);
+				virtual ~Server();
+
+				void SetHandler(const Handler & handler) {m_handler = handler;}
+				/** Hand requests with "Upgrade: protocol" (case ignored) to handler; set before Start **/
+				void SetUpgradeHandler(const std::string & protocol, const UpgradeHandler & handler)
+				{
+					m_upgrade_protocol = protocol;
+					m_upgrade_handler = handler;
+				}
+				/** Keep connections open between responses that give their length (Content-Length or chunked) **/
+				void KeepAlive(bool keep_alive) {m_keep_alive = keep_alive;}
+				/** Largest request body accepted (413 if exceeded) **/
+				void MaxBody(size_t max_body) {m_max_body = max_body;}
+				/** Seconds a connection may wait for a request before it is closed (0 for no limit) **/
+				void IdleTimeout(double seconds) {m_idle_timeout = seconds;}
+				/** Seconds from the first byte of a request to the last (408 if exceeded, 0 for no limit) **/
+				void RequestTimeout(double seconds) {m_request_timeout = seconds;}
+				/** Log every response to log (NULL for none); set before Start **/
+				void SetAccessLog(AccessLog * log) {m_access_log = log;}
+
+				/** Start listening and the IO and handler threads **/
+				void Start();
+				/** Start (if needed) and block until Stop() is called, then shut down **/
+				void Run();
+				/** Make Run() return; thread safe, and may be called from a Handler **/
+				void Stop();
+
+				int Port() const {return m_port;}
+
+			private:
+				Server(const Server & cpy) = delete;
+				Server & operator=(const Server & cpy) = delete;
+
+				struct Connection;
+				/** An IO thread and the connections it owns **/
+				struct IOThread
+				{
+					EventLoop loop;
+					std::thread thread;
+					std::unordered_set<Connection*> connections;
+				};
+
+				void Accept(IOThread * io);
+				void Readable(Connection * c, uint32_t events);
+				/** Dispatch complete requests in c's buffer, or wait for more input **/
+				void Process(Connection * c);
+				/** Wait for more of a request, within its deadline **/
+				void Wait(Connection * c);
+				/** Run the Handler (on a pool thread) **/
+				void Handle(Connection * c);
+				/** Give c's connection to the UpgradeHandler (on the IO thread) **/
+				void Upgrade(Connection * c);
+				/** Respond with an error and close (on the IO thread) **/
+				void Reject(Connection * c, unsigned status);
+				void Close(Connection * c);
+				/** Add the response just sent on c to the access log **/
+				void LogAccess(Connection * c);
+				void Shutdown();
+
+				int m_port;
+				unsigned m_io_count;
+				unsigned m_worker_count;
+				Handler m_handler;
+				std::string m_upgrade_protocol;
+				UpgradeHandler m_upgrade_handler;
+				bool m_keep_alive;
+				size_t m_max_body;
+				double m_idle_timeout;
+				double m_request_timeout;
+				AccessLog * m_access_log;
+				int m_listen_fd;
+				std::vector<IOThread*> m_io;
+				WorkPool * m_pool;
+				std::atomic<bool> m_running;
+				std::mutex m_mutex;
+				std::condition_variable m_stopped;
+		};
+	}
+}
+
+#endif //_HTTPSERVER_H
@@ -0,0 +1,199 @@
+/**
+ * @file json.cpp
+ * @brief Streaming JSON writer - Definitions
+ * @see json.h - Declarations
+ */
+
+#include "json.h"
+
+#include <cmath>
+#include <cstdio>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace Foxbox {namespace JSON
+{
+
+/** Escape sequences for the characters that need them (0 if none) **/
+static const char g_escapes[128] = {
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static void EscapeChar(string & out, unsigned char c)
+{
+	static const char * hex = "0123456789abcdef";
+	char e = g_escapes[c];
+	out += '\\';
+	out += e;
+	if (e == 'u')
+	{
+		out += "00";
+		out += hex[c >> 4];
+		out += hex[c & 0xf];
+	}
+}
+
+/**
+ * Characters other than control characters, '"' and '\\' are copied as they are
+ * 	(UTF-8 included), so most strings are copied in runs between the few
+ * 	characters that need escaping. With SSE2 the runs are found 16 bytes at a time.
+ */
+void Escape(string & out, const char * s, size_t size)
+{
+	size_t i = 0;
+	size_t run = 0; // Start of characters not yet copied
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(0x1f);
+	while (i + 16 <= size)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+		// max(v, 0x1f) == 0x1f exactly when v <= 0x1f (unsigned)
+		__m128i special = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, control), control),
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+		unsigned mask = _mm_movemask_epi8(special);
+		if (mask == 0)
+		{
+			i += 16;
+			continue;
+		}
+		size_t j = i + __builtin_ctz(mask);
+		out.append(s + run, j - run);
+		EscapeChar(out, s[j]);
+		run = i = j + 1;
+	}
+#endif
+	for (; i < size; ++i)
+	{
+		unsigned char c = s[i];
+		if (c >= 128 || g_escapes[c] == 0)
+			continue;
+		out.append(s + run, i - run);
+		EscapeChar(out, c);
+		run = i + 1;
+	}
+	out.append(s + run, size - run);
+}
+
+void Writer::Indent()
+{
+	m_buffer += '\n';
+	m_buffer.append(m_stack.size(), '\t');
+}
+
+void Writer::Element()
+{
+	if (m_after_key)
+	{
+		m_after_key = false;
+		return;
+	}
+	if (!m_first)
+		m_buffer += ',';
+	if (m_pretty && !m_stack.empty())
+		Indent();
+	m_first = false;
+}
+
+Writer & Writer::Open(char bracket)
+{
+	Element();
+	m_buffer += bracket;
+	m_stack.push_back(bracket);
+	m_first = true;
+	return *this;
+}
+
+Writer & Writer::Close(char bracket)
+{
+	if (m_stack.empty())
+		return *this;
+	m_stack.pop_back();
+	if (m_pretty && !m_first)
+		Indent();
+	m_buffer += bracket;
+	m_first = false;
+	if (m_pretty && m_stack.empty())
+		m_buffer += '\n';
+	return *this;
+}
+
+Writer & Writer::Key(const StringRef & key)
+{
+	Element();
+	m_buffer += '"';
+	Escape(m_buffer, key);
+	m_buffer += m_pretty ? "\" : " : "\":";
+	m_after_key = true;
+	return *this;
+}
+
+Writer & Writer::String(const StringRef & s)
+{
+	Element();
+	m_buffer += '"';
+	Escape(m_buffer, s);
+	m_buffer += '"';
+	return *this;
+}
+
+Writer & Writer::Number(long long n)
+{
+	Element();
+	char buf[32];
+	m_buffer.append(buf, snprintf(buf, sizeof(buf), "%lld", n));
+	return *this;
+}
+
+Writer & Writer::Number(unsigned long long n)
+{
+	Element();
+	char buf[32];
+	m_buffer.append(buf, snprintf(buf, sizeof(buf), "%llu", n));
+	return *this;
+}
+
+Writer & Writer::Number(double n)
+{
+	if (!std::isfinite(n))
+		return Null();
+	Element();
+	char buf[32];
+	m_buffer.append(buf, snprintf(buf, sizeof(buf), "%.17g", n));
+	return *this;
+}
+
+Writer & Writer::Bool(bool b)
+{
+	Element();
+	m_buffer += b ? "true" : "false";
+	return *this;
+}
+
+Writer & Writer::Null()
+{
+	Element();
+	m_buffer += "null";
+	return *this;
+}
+
+Writer & Writer::Raw(const StringRef & json)
+{
+	Element();
+	m_buffer.append(json.data(), json.size());
+	return *this;
+}
+
+}}
@@ -0,0 +1,99 @@
+/**
+ * @file json.h
+ * @brief Streaming JSON writer - Declarations
+ * @see json.cpp - Definitions
+ * @see RFC 8259 https://tools.ietf.org/html/rfc8259
+ */
+
+#ifndef _JSON_H
+#define _JSON_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "stringref.h"
+
+namespace Foxbox
+{
+	/** Forming JSON documents **/
+	namespace JSON
+	{
+		/**
+		 * Serialises values straight into a string buffer
+		 * Call Clear() to reuse the Writer (and its allocated buffer) for
+		 * 	another document. Objects and arrays nest; keys and strings are escaped.
+		 * Example:
+		 * 	w.BeginObject().Field("name", "fox").Key("ids").BeginArray()
+		 * 		.Number(1).Number(2).EndArray().EndObject();
+		 * @see HTTP::SendJSON
+		 */
+		class Writer
+		{
+			public:
+				/** @param pretty One field per line, indented with tabs **/
+				Writer(bool pretty = true) : m_buffer(), m_stack(), m_first(true), m_after_key(false), m_pretty(pretty) {}
+				virtual ~Writer() {}
+
+				Writer & BeginObject() {return Open('{');}
+				Writer & EndObject() {return Close('}');}
+				Writer & BeginArray() {return Open('[');}
+				Writer & EndArray() {return Close(']');}
+
+				/** Key of the next value in an object **/
+				Writer & Key(const StringRef & key);
+
+				Writer & String(const StringRef & s);
+				Writer & Number(long long n);
+				Writer & Number(unsigned long long n);
+				Writer & Number(int n) {return Number((long long)n);}
+				Writer & Number(unsigned n) {return Number((unsigned long long)n);}
+				Writer & Number(long n) {return Number((long long)n);}
+				Writer & Number(unsigned long n) {return Number((unsigned long long)n);}
+				/** Non finite numbers are written as null **/
+				Writer & Number(double n);
+				Writer & Bool(bool b);
+				Writer & Null();
+				/** Insert already serialised JSON **/
+				Writer & Raw(const StringRef & json);
+
+				/** Key and value in one call **/
+				template <class T>
+				Writer & Field(const StringRef & key, const T & value) {return Key(key).Value(value);}
+
+				/** Document so far **/
+				const std::string & Str() const {return m_buffer;}
+				std::string & Buffer() {return m_buffer;}
+				/** True when every object and array has been closed **/
+				bool Complete() const {return m_stack.empty() && !m_buffer.empty();}
+				/** Start a new document (keeps the allocated buffer) **/
+				void Clear() {m_buffer.clear(); m_stack.clear(); m_first = true; m_after_key = false;}
+
+			private:
+				Writer & Open(char bracket);
+				Writer & Close(char bracket);
+				/** Separator and indentation before a value (none straight after a key) **/
+				void Element();
+				void Indent();
+
+				Writer & Value(const StringRef & s) {return String(s);}
+				Writer & Value(const std::string & s) {return String(s);}
+				Writer & Value(const char * s) {return String(s);}
+				Writer & Value(bool b) {return Bool(b);}
+				template <class T>
+				Writer & Value(const T & n) {return Number(n);}
+
+				std::string m_buffer;
+				std::vector<char> m_stack; /** Open brackets **/
+				bool m_first; /** No value yet in the innermost object or array **/
+				bool m_after_key; /** Key() was just written; the value follows it directly **/
+				bool m_pretty;
+		};
+
+		/** Append s to out as the contents of a JSON string (without the quotes) **/
+		extern void Escape(std::string & out, const char * s, size_t size);
+		inline void Escape(std::string & out, const StringRef & s) {Escape(out, s.data(), s.size());}
+	}
+}
+
+#endif //_JSON_H
@@ -0,0 +1,123 @@
+/**
+ * @file pool.cpp
+ * @brief Work stealing thread pool - Definitions
+ * @see pool.h - Declarations
+ */
+
+#include "pool.h"
+#include "log.h"
+
+using namespace std;
+
+namespace Foxbox
+{
+
+/** The pool (and queue) of the current thread, if it is a pool thread **/
+static thread_local WorkPool * t_pool = NULL;
+static thread_local unsigned t_queue = 0;
+
+WorkPool::WorkPool(unsigned threads) : m_queues(), m_threads(), m_sleep_mutex(), m_sleep(),
+	m_pending(0), m_next(0), m_running(true)
+{
+	if (threads == 0)
+		threads = max(1u, thread::hardware_concurrency());
+	for (unsigned i = 0; i < threads; ++i)
+		m_queues.push_back(new Queue());
+	for (unsigned i = 0; i < threads; ++i)
+		m_threads.push_back(thread(&WorkPool::Work, this, i));
+}
+
+WorkPool::~WorkPool()
+{
+	Stop();
+	for (auto queue : m_queues)
+		delete queue;
+}
+
+void WorkPool::Submit(const Task & task)
+{
+	unsigned id = (t_pool == this) ? t_queue : (m_next++ % m_queues.size());
+	Queue * queue = m_queues[id];
+	queue->mutex.lock();
+	queue->tasks.push_back(task);
+	queue->mutex.unlock();
+	++m_pending;
+	// Taking the lock means a thread between checking m_pending and waiting can't miss this
+	m_sleep_mutex.lock();
+	m_sleep_mutex.unlock();
+	m_sleep.notify_one();
+}
+
+/** Take a task from our own queue (newest first) or steal from another (oldest first) **/
+bool WorkPool::Take(unsigned id, Task & task)
+{
+	for (size_t i = 0; i < m_queues.size(); ++i)
+	{
+		Queue * queue = m_queues[(id + i) % m_queues.size()];
+		lock_guard<mutex> lock(queue->mutex);
+		if (queue->tasks.empty())
+			continue;
+		if (i == 0)
+		{
+			task = queue->tasks.back();
+			queue->tasks.pop_back();
+		}
+		else
+		{
+			task = queue->tasks.front();
+			queue->tasks.pop_front();
+		}
+		--m_pending;
+		return true;
+	}
+	return false;
+}
+
+void WorkPool::Work(unsigned id)
+{
+	t_pool = this;
+	t_queue = id;
+	Task task;
+	while (m_running)
+	{
+		if (Take(id, task))
+		{
+			try
+			{
+				task();
+			}
+			catch (Exception & e)
+			{
+				Error("Exception %s caught in pool thread %u", e.what(), id);
+			}
+			task = nullptr;
+			continue;
+		}
+		unique_lock<mutex> lock(m_sleep_mutex);
+		while (m_running && m_pending == 0)
+			m_sleep.wait(lock);
+	}
+}
+
+void WorkPool::Stop()
+{
+	m_sleep_mutex.lock();
+	m_running = false;
+	m_sleep_mutex.unlock();
+	m_sleep.notify_all();
+	for (auto & t : m_threads)
+	{
+		if (t.joinable() && t.get_id() != this_thread::get_id())
+			t.join();
+		else if (t.joinable())
+			t.detach();
+	}
+	for (auto queue : m_queues)
+	{
+		lock_guard<mutex> lock(queue->mutex);
+		queue->tasks.clear();
+	}
+	m_pending = 0;
+}
+
+}
@@ -0,0 +1,64 @@
+/**
+ * @file pool.h
+ * @brief Work stealing thread pool - Declarations
+ * @see pool.cpp - Definitions
+ */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Foxbox
+{
+	/**
+	 * A fixed number of threads running submitted tasks
+	 * Each thread has its own queue. Tasks submitted from a pool thread go on
+	 * 	its own queue (and run most recent first, while their data is still in
+	 * 	cache); others are dealt out round robin. A thread with nothing to do
+	 * 	steals the oldest task from another thread's queue before sleeping.
+	 */
+	class WorkPool
+	{
+		public:
+			typedef std::function<void()> Task;
+
+			/** @param threads Number of threads (0 for one per core) **/
+			WorkPool(unsigned threads = 0);
+			virtual ~WorkPool();
+
+			void Submit(const Task & task);
+			/** Finish running tasks, drop queued ones, and join the threads **/
+			void Stop();
+			unsigned Size() const {return m_threads.size();}
+
+		private:
+			WorkPool(const WorkPool & cpy) = delete;
+			WorkPool & operator=(const WorkPool & cpy) = delete;
+
+			struct Queue
+			{
+				std::mutex mutex;
+				std::deque<Task> tasks;
+			};
+
+			void Work(unsigned id);
+			bool Take(unsigned id, Task & task);
+
+			std::vector<Queue*> m_queues;
+			std::vector<std::thread> m_threads;
+			std::mutex m_sleep_mutex;
+			std::condition_variable m_sleep;
+			std::atomic<size_t> m_pending; /** Tasks queued but not yet taken **/
+			std::atomic<unsigned> m_next; /** Round robin queue for outside submissions **/
+			std::atomic<bool> m_running;
+	};
+}
+
+#endif //_POOL_H
@@ -0,0 +1,277 @@
+/**
+ * @file reverseproxy.cpp
+ * @brief HTTP reverse proxy - Definitions
+ * @see reverseproxy.h - Declarations
+ */
+
+#include "reverseproxy.h"
+
+#include <chrono>
+
+using namespace std;
+
+namespace Foxbox {namespace HTTP
+{
+
+bool HopByHop(HeaderID id, const StringRef & name, const StringRef & connection)
+{
+	switch (id)
+	{
+		case HEADER_CONNECTION:
+		case HEADER_KEEP_ALIVE:
+		case HEADER_PROXY_AUTHENTICATE:
+		case HEADER_PROXY_AUTHORIZATION:
+		case HEADER_PROXY_CONNECTION:
+		case HEADER_TE:
+		case HEADER_TRAILER:
+		case HEADER_TRANSFER_ENCODING:
+		case HEADER_UPGRADE:
+			return true;
+		default:
+			break;
+	}
+	// Connection: token, token ...
+	const char * p = connection.begin();
+	const char * end = connection.end();
+	while (p < end)
+	{
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+		const char * token = p;
+		while (p < end && *p != ',' && *p != ' ' && *p != '\t') ++p;
+		if (p > token && name.EqualsIgnoreCase(StringRef(token, p - token)))
+			return true;
+	}
+	return false;
+}
+
+ReverseProxy::ReverseProxy(const string & host, int port, unsigned max_idle) : m_group(new UpstreamGroup()), m_own_group(true),
+	m_cache(NULL)
+{
+	m_group->MaxIdle(max_idle);
+	m_group->Add(host, port);
+}
+
+ReverseProxy::ReverseProxy(UpstreamGroup & group) : m_group(&group), m_own_group(false), m_cache(NULL)
+{
+
+}
+
+ReverseProxy::~ReverseProxy()
+{
+	if (m_own_group)
+		delete m_group;
+}
+
+/** Append "name: value\r\n" to s **/
+static inline void AppendHeader(string & s, const StringRef & name, const StringRef & value)
+{
+	s.append(name.data(), name.size());
+	s += ": ";
+	s.append(value.data(), value.size());
+	s += "\r\n";
+}
+
+bool ReverseProxy::Forward(Request & req, TCP::Socket & socket)
+{
+	// Request headers; the Client adds Host and Content-Length itself
+	static thread_local Fields headers;
+	headers.Clear();
+	HTTP::Headers & in = req.Headers();
+	StringRef connection(in.Get(HEADER_CONNECTION));
+	string forwarded_for;
+	for (size_t i = 0; i < in.Size(); ++i)
+	{
+		HeaderID id = in.ID(i);
+		if (id == HEADER_HOST || id == HEADER_CONTENT_LENGTH || HopByHop(id, in.Name(i), connection))
+			continue;
+		if (id == HEADER_X_FORWARDED_FOR)
+		{
+			forwarded_for.append(in.Value(i).data(), in.Value(i).size());
+			forwarded_for += ", ";
+			continue;
+		}
+		headers.Add(in.Name(i), in.Value(i));
+	}
+	forwarded_for += socket.RemoteAddress();
+	headers.Add("X-Forwarded-For", forwarded_for);
+	headers.Add("Via", "1.1 foxbox");
+
+	bool idempotent = (req.Method() == "GET" || req.Method() == "HEAD" || req.Method() == "OPTIONS");
+	Cache::EntryPtr stale;
+	bool store = false;
+	if (m_cache != NULL && !idempotent)
+	{
+		// Unsafe methods invalidate what was cached for the URI (RFC 7234 4.4)
+		m_cache->Remove(req.URI());
+	}
+	else if (m_cache != NULL && Cache::Cacheable(req))
+	{
+		store = (req.Method() == "GET");
+		Cache::EntryPtr entry(m_cache->Find(req.URI(), in));
+		if (entry != NULL)
+		{
+			switch (Cache::Check(*entry, in, time(NULL)))
+			{
+				case Cache::FRESH:
+					return m_cache->Send(socket, req, *entry, "HIT");
+				case Cache::STALE_WHILE_REVALIDATE:
+					if (!entry->revalidating.exchange(true))
+						m_cache->Background([this, entry]() {Revalidate(entry);});
+					return m_cache->Send(socket, req, *entry, "STALE");
+				case Cache::STALE:
+					// The client's own validators are about its copy, not ours; its 304 is relayed
+					if (!in.Has(HEADER_IF_NONE_MATCH) && !in.Has(HEADER_IF_MODIFIED_SINCE)
+						&& (!entry->etag.empty() || !entry->last_modified.empty()))
+					{
+						if (!entry->etag.empty())
+							headers.Add("If-None-Match", entry->etag);
+						if (!entry->last_modified.empty())
+							headers.Add("If-Modified-Since", entry->last_modified);
+						stale = entry;
+					}
+					break;
+			}
+		}
+	}
+
+	Upstream * tried = NULL;
+	for (int attempt = 0; attempt < 2; ++attempt)
+	{
+		Upstream * upstream = m_group->Pick(tried);
+		if (upstream == NULL)
+			break;
+		bool ok = false;
+		if (Forward(upstream, req, socket, headers, stale, store, ok))
+		{
+			// Part of a response can't be recovered from; the client sees the connection close
+			if (!ok)
+				socket.Close();
+			return ok;
+		}
+		Error("No response from upstream %s:%d for %s", upstream->Host().c_str(), upstream->Port(), req.URI().c_str());
+		tried = upstream;
+		if (!idempotent)
+		{
+			SendPlain(socket, 502, "Bad Gateway");
+			return false;
+		}
+	}
+	if (tried == NULL)
+		SendPlain(socket, 503, "Service Unavailable");
+	else
+		SendPlain(socket, 502, "Bad Gateway");
+	return false;
+}
+
+bool ReverseProxy::Forward(Upstream * upstream, Request & req, TCP::Socket & socket, const Fields & headers,
+	const Cache::EntryPtr & stale, bool store, bool & ok)
+{
+	typedef chrono::steady_clock clock;
+	clock::time_point start = clock::now();
+	clock::time_point responded = start;
+	bool got_head = false;
+	bool sent_head = false;
+	bool close = false;
+	// A response for the cache is received whole, then sent from the cache's copy
+	enum {RELAY, REFRESH, STORE} mode = RELAY;
+	Response response;
+	response.Relay(&socket);
+	ok = upstream->Client().Send(req.Method(), req.URI(), response, req.Body(), &headers, Client::BodyCallback(),
+		[&](Response & r) -> bool
+	{
+		responded = clock::now();
+		got_head = true;
+		if (stale != NULL && r.Status() == 304)
+			mode = REFRESH;
+		else if (store && m_cache->Storable(r))
+			mode = STORE;
+		if (mode != RELAY)
+		{
+			r.Relay(NULL);
+			return true;
+		}
+		// Status line and end-to-end headers in one write; the body follows as it arrives
+		static thread_local string head;
+		head.clear();
+		char status[64];
+		head.append(status, snprintf(status, sizeof(status), "HTTP/1.1 %u ", r.Status()));
+		head += r.Reason();
+		head += "\r\n";
+		HTTP::Headers & out = r.Headers();
+		StringRef upstream_connection(out.Get(HEADER_CONNECTION));
+		for (size_t i = 0; i < out.Size(); ++i)
+		{
+			HeaderID id = out.ID(i);
+			// The body is relayed with its framing, so Transfer-Encoding is kept
+			if (id != HEADER_TRANSFER_ENCODING && HopByHop(id, out.Name(i), upstream_connection))
+				continue;
+			AppendHeader(head, out.Name(i), out.Value(i));
+		}
+		// A body framed by the upstream closing is framed by us closing too
+		unsigned code = r.Status();
+		close = !out.Has(HEADER_CONTENT_LENGTH) && !out.Has(HEADER_TRANSFER_ENCODING)
+			&& req.Method() != "HEAD" && code / 100 != 1 && code != 204 && code != 304;
+		if (close)
+			head += "Connection: close\r\n";
+		head += "\r\n";
+		sent_head = true;
+		return socket.SendRaw(head.data(), head.size()) == (int)head.size();
+	});
+	// Latency is time to the response head; the body's size is not the server's fault
+	m_group->Report(upstream, got_head, chrono::duration<double>((got_head ? responded : clock::now()) - start).count());
+	if (mode != RELAY && ok)
+	{
+		Cache::EntryPtr entry = (mode == REFRESH) ? m_cache->Refresh(stale, response)
+			: m_cache->Store(req.URI(), req.Headers(), response);
+		ok = m_cache->Send(socket, req, *entry, (mode == REFRESH) ? "REVALIDATED" : "MISS");
+		return true;
+	}
+	// The stale response was replaced by one that can't be cached
+	if (stale != NULL && mode == RELAY && got_head && response.Status() < 500)
+		m_cache->Remove(req.URI());
+	if (ok && close)
+		socket.Close();
+	return sent_head;
+}
+
+void ReverseProxy::Revalidate(const Cache::EntryPtr & entry)
+{
+	Fields headers;
+	for (size_t i = 0; i < entry->request.Size(); ++i)
+		headers.Add(entry->request.Name(i), entry->request.Value(i));
+	if (!entry->etag.empty())
+		headers.Add("If-None-Match", entry->etag);
+	if (!entry->last_modified.empty())
+		headers.Add("If-Modified-Since", entry->last_modified);
+	headers.Add("Via", "1.1 foxbox");
+
+	string uri(entry->URI());
+	Upstream * upstream = m_group->Pick();
+	if (upstream != NULL)
+	{
+		typedef chrono::steady_clock clock;
+		clock::time_point start = clock::now();
+		Response response;
+		bool storable = false;
+		bool ok = upstream->Client().Send("GET", uri, response, StringRef(), &headers, Client::BodyCallback(),
+			[&](Response & r) -> bool
+		{
+			storable = m_cache->Storable(r);
+			// Don't receive a body that won't be kept
+			return r.Status() == 304 || storable;
+		});
+		m_group->Report(upstream, response.Status() != 0, chrono::duration<double>(clock::now() - start).count());
+		if (ok && response.Status() == 304)
+			m_cache->Refresh(entry, response);
+		else if (ok && storable)
+			m_cache->Store(uri, entry->request, response);
+		else if (response.Status() != 0 && response.Status() < 500)
+			m_cache->Remove(uri); // No longer cacheable
+		else
+			Error("Couldn't revalidate %s", uri.c_str());
+	}
+	// Replaced if it was revalidated; otherwise the next request may try again
+	entry->revalidating = false;
+}
+
+}}
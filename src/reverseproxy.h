@@ -0,0 +1,82 @@
+/**
+ * @file reverseproxy.h
+ * @brief HTTP reverse proxy - Declarations
+ * @see reverseproxy.cpp - Definitions
+ * @see httpclient.h - Upstream connections
+ * @see httpserver.h - Downstream connections
+ */
+
+#ifndef _REVERSEPROXY_H
+#define _REVERSEPROXY_H
+
+#include "cache.h"
+#include "httpclient.h"
+#include "httpserver.h"
+#include "upstream.h"
+
+namespace Foxbox
+{
+	namespace HTTP
+	{
+		/**
+		 * Forwards requests to upstream servers and relays the responses
+		 * Each request goes to the server UpstreamGroup::Pick chooses; if it fails
+		 * 	before responding, an idempotent request is retried once on another.
+		 * Upstream connections are kept alive and shared by all handler threads;
+		 * 	hop-by-hop headers (RFC 7230 6.1) are not forwarded in either direction.
+		 * 	Response bodies are relayed with their framing intact, spliced from
+		 * 	socket to socket where possible.
+		 * With a Cache, GET and HEAD requests are answered from it when they can be;
+		 * 	stale responses are revalidated with a conditional request (or, within
+		 * 	stale-while-revalidate, sent and revalidated in the background).
+		 * Usage: server.SetHandler(proxy.Handler());
+		 * @see examples/httpproxy.cpp
+		 */
+		class ReverseProxy
+		{
+			public:
+				/**
+				 * @param host Upstream host name or IPv4 address
+				 * @param port Upstream port
+				 * @param max_idle Most idle upstream connections to keep open
+				 */
+				ReverseProxy(const std::string & host, int port = 80, unsigned max_idle = 16);
+				/** Forward to a group of servers (which must outlive the proxy) **/
+				ReverseProxy(UpstreamGroup & group);
+				virtual ~ReverseProxy();
+
+				/** Forward req and relay the response through socket (502 if upstream fails, 503 if none are up) **/
+				bool Forward(Request & req, TCP::Socket & socket);
+				/** A Server::Handler that calls Forward **/
+				Server::Handler Handler() {return [this](Request & req, TCP::Socket & socket) {Forward(req, socket);};}
+
+				UpstreamGroup & Upstreams() {return *m_group;}
+				/** Answer requests from a cache (NULL for none); destroy the cache before the proxy **/
+				void SetCache(HTTP::Cache * cache) {m_cache = cache;}
+
+			private:
+				ReverseProxy(const ReverseProxy & cpy) = delete;
+				ReverseProxy & operator=(const ReverseProxy & cpy) = delete;
+
+				/**
+				 * Forward to one server
+				 * @param stale Cached response being revalidated (validators are in headers), or NULL
+				 * @param store Store the response in the cache if it may be
+				 * @returns true once anything was sent downstream
+				 */
+				bool Forward(Upstream * upstream, Request & req, TCP::Socket & socket, const Fields & headers,
+					const Cache::EntryPtr & stale, bool store, bool & ok);
+				/** Revalidate a cached response in the background **/
+				void Revalidate(const Cache::EntryPtr & entry);
+
+				UpstreamGroup * m_group;
+				bool m_own_group;
+				HTTP::Cache * m_cache;
+		};
+
+		/** True if a header is hop-by-hop: one of the RFC 7230 6.1 names, or named by connection **/
+		extern bool HopByHop(HeaderID id, const StringRef & name, const StringRef & connection);
+	}
+}
+
+#endif //_REVERSEPROXY_H
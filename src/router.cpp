@@ -0,0 +1,242 @@
+/**
+ * @file router.cpp
+ * @brief HTTP request routing - Definitions
+ * @see router.h - Declarations
+ */
+
+#include "router.h"
+
+using namespace std;
+
+namespace Foxbox {namespace HTTP
+{
+
+string Router::Match::Param(const char * name) const
+{
+	for (size_t i = 0; i < m_count; ++i)
+	{
+		if (strcmp(m_names[i], name) == 0)
+			return string(m_values[i], m_sizes[i]);
+	}
+	return string("");
+}
+
+Router::Router() : m_root(new Node()), m_default()
+{
+
+}
+
+Router::~Router()
+{
+	delete m_root;
+}
+
+Router::Node::~Node()
+{
+	for (auto child : children)
+		delete child;
+	delete param;
+	delete wildcard;
+}
+
+/**
+ * Add a route
+ * @param method HTTP method (GET, POST, ...) or "*" for any method
+ * @param pattern Path pattern, eg: "users/:id"
+ * @param handler Called with the request, socket and captured parameters
+ */
+void Router::Add(const char * method, const char * pattern, const Handler & handler)
+{
+	Node * node = m_root;
+	const char * p = pattern;
+	while (*p != '\0')
+	{
+		while (*p == '/') ++p;
+		if (*p == '\0') break;
+		const char * q = strchr(p, '/');
+		if (q == NULL)
+			q = p + strlen(p);
+		string segment(p, q - p);
+
+		if (segment[0] == '*')
+		{
+			if (strspn(q, "/") != strlen(q))
+				Fatal("Wildcard is not the last segment of route \"%s\"", pattern);
+			if (node->wildcard == NULL)
+				node->wildcard = new Node();
+			node = node->wildcard;
+			break;
+		}
+		else if (segment[0] == ':')
+		{
+			if (node->param == NULL)
+			{
+				node->param = new Node();
+				node->param_name = segment.substr(1);
+			}
+			else if (node->param_name != segment.substr(1))
+			{
+				Warn("Route \"%s\" renames parameter \"%s\" to \"%s\"; using \"%s\"", pattern,
+					node->param_name.c_str(), segment.c_str()+1, node->param_name.c_str());
+			}
+			node = node->param;
+		}
+		else
+		{
+			Node * next = NULL;
+			for (auto child : node->children)
+			{
+				if (child->segment == segment)
+					next = child;
+			}
+			if (next == NULL)
+			{
+				next = new Node();
+				next->segment = segment;
+				node->children.push_back(next);
+			}
+			node = next;
+		}
+		p = q;
+	}
+
+	for (auto & it : node->handlers)
+	{
+		if (it.first == method)
+		{
+			it.second = handler;
+			return;
+		}
+	}
+	node->handlers.push_back(pair<string, Handler>(method, handler));
+}
+
+/**
+ * Walk the trie from node matching the path [begin, end) and method
+ * Backtracks from literal segments to parameters to wildcards, past routes
+ * 	without a handler for the method
+ * @param allow If not NULL, methods of routes matching the path are added to it
+ * @returns Handler, or NULL if there is none
+ */
+const Router::Handler * Router::Find(const Node * node, const string & method, const char * begin, const char * end,
+	Match & match, string * allow)
+{
+	while (begin < end && *begin == '/') ++begin;
+	if (begin == end)
+	{
+		const Handler * handler = Method(node, method, allow);
+		if (handler == NULL && node->wildcard != NULL && (handler = Method(node->wildcard, method, allow)) != NULL)
+		{
+			match.m_wildcard = begin;
+			match.m_wildcard_size = 0;
+		}
+		return handler;
+	}
+
+	const char * next = (const char*)memchr(begin, '/', end - begin);
+	if (next == NULL)
+		next = end;
+	size_t size = next - begin;
+
+	for (auto child : node->children)
+	{
+		if (child->segment.size() == size && memcmp(child->segment.data(), begin, size) == 0)
+		{
+			const Handler * found = Find(child, method, next, end, match, allow);
+			if (found != NULL)
+				return found;
+			break;
+		}
+	}
+
+	if (node->param != NULL && match.m_count < ROUTER_MAX_PARAMS)
+	{
+		size_t i = match.m_count++;
+		match.m_names[i] = node->param_name.c_str();
+		match.m_values[i] = begin;
+		match.m_sizes[i] = size;
+		const Handler * found = Find(node->param, method, next, end, match, allow);
+		if (found != NULL)
+			return found;
+		match.m_count = i;
+	}
+
+	const Handler * handler = NULL;
+	if (node->wildcard != NULL && (handler = Method(node->wildcard, method, allow)) != NULL)
+	{
+		match.m_wildcard = begin;
+		match.m_wildcard_size = end - begin;
+	}
+	return handler;
+}
+
+/** Append method to a comma separated list, unless it is there already **/
+static void Allow(string & allow, const string & method)
+{
+	if ((", " + allow + ", ").find(", " + method + ", ") != string::npos)
+		return;
+	if (!allow.empty())
+		allow += ", ";
+	allow += method;
+}
+
+/**
+ * Handler of node for method; HEAD falls back to GET, anything to "*"
+ * If there is none, node's methods are added to allow (when not NULL)
+ */
+const Router::Handler * Router::Method(const Node * node, const string & method, string * allow)
+{
+	const Handler * any = NULL;
+	const Handler * get = NULL;
+	for (auto & it : node->handlers)
+	{
+		if (it.first == method)
+			return &(it.second);
+		if (it.first == "*")
+			any = &(it.second);
+		else if (it.first == "GET")
+			get = &(it.second);
+	}
+	if (get != NULL && method == "HEAD")
+		return get;
+	if (any != NULL || allow == NULL)
+		return any;
+	for (auto & it : node->handlers)
+	{
+		Allow(*allow, it.first);
+		if (it.first == "GET")
+			Allow(*allow, "HEAD");
+	}
+	return NULL;
+}
+
+const Router::Handler * Router::Find(const string & method, const string & path, Match & match) const
+{
+	return Find(m_root, method, path.data(), path.data() + path.size(), match, NULL);
+}
+
+bool Router::Dispatch(Request & req, TCP::Socket & socket) const
+{
+	Match match;
+	string allow;
+	const string & path = req.Path();
+	const Handler * handler = Find(m_root, req.Method(), path.data(), path.data() + path.size(), match, &allow);
+	if (handler != NULL)
+	{
+		(*handler)(req, socket, match);
+		return true;
+	}
+	if (!allow.empty())
+	{
+		const char * message = StatusMessage(405);
+		socket.Send("HTTP/1.1 405 %s\r\nAllow: %s\r\nContent-Type: text/plain; charset=utf-8\r\n"
+			"Content-Length: %zu\r\n\r\n%s", message, allow.c_str(), strlen(message), message);
+	}
+	else if (m_default)
+		m_default(req, socket, match);
+	else
+		SendPlain(socket, 404, "Not found.\n");
+	return false;
+}
+
+}} // end namespaces
@@ -0,0 +1,151 @@
+/**
+ * @file router.h
+ * @brief HTTP request routing - Declarations
+ * @see router.cpp - Definitions
+ * @see http.h - HTTP::Request
+ */
+
+#ifndef _ROUTER_H
+#define _ROUTER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "http.h"
+
+namespace Foxbox
+{
+	namespace HTTP
+	{
+		/** Maximum number of :parameters one route can capture **/
+		#define ROUTER_MAX_PARAMS 8
+
+		/**
+		 * Routes requests to handlers by method and path
+		 * Patterns are split into segments on '/' and stored in a prefix trie
+		 * 	"users/:id" matches "users/42" with the parameter id = "42"
+		 * 	A final "*" segment matches the rest of the path (which may be empty)
+		 * Literal segments are preferred over :parameters over wildcards, among
+		 * 	routes with a handler for the method
+		 * Matching does not allocate; captures point into Request::Path()
+		 * @see examples/httpserver.cpp
+		 */
+		class Router
+		{
+			public:
+				/** Parameters captured when a path matches a route **/
+				class Match
+				{
+					public:
+						Match() : m_count(0), m_wildcard(NULL), m_wildcard_size(0) {}
+
+						size_t Count() const {return m_count;}
+						const char * Name(size_t i) const {return m_names[i];}
+						const char * Data(size_t i) const {return m_values[i];}
+						size_t Size(size_t i) const {return m_sizes[i];}
+						/** Value of a parameter by index or name ("" if absent) **/
+						std::string Param(size_t i) const
+						{
+							return (i < m_count) ? std::string(m_values[i], m_sizes[i]) : std::string("");
+						}
+						std::string Param(const char * name) const;
+						/** Remainder of the path matched by a trailing '*' **/
+						std::string Wildcard() const
+						{
+							return (m_wildcard == NULL) ? std::string("") : std::string(m_wildcard, m_wildcard_size);
+						}
+
+					private:
+						friend class Router;
+						size_t m_count;
+						const char * m_names[ROUTER_MAX_PARAMS];
+						const char * m_values[ROUTER_MAX_PARAMS];
+						size_t m_sizes[ROUTER_MAX_PARAMS];
+						const char * m_wildcard;
+						size_t m_wildcard_size;
+				};
+
+				typedef std::function<void(Request & req, TCP::Socket & socket, const Match & match)> Handler;
+
+				Router();
+				virtual ~Router();
+
+				/** Add a route; method "*" matches any method **/
+				void Add(const char * method, const char * pattern, const Handler & handler);
+				inline void Get(const char * pattern, const Handler & handler) {Add("GET", pattern, handler);}
+				inline void Post(const char * pattern, const Handler & handler) {Add("POST", pattern, handler);}
+				/** Handler used when nothing matches (default sends 404) **/
+				inline void Default(const Handler & handler) {m_default = handler;}
+
+				/** Find the handler for a method and path @returns NULL if there is none **/
+				const Handler * Find(const std::string & method, const std::string & path, Match & match) const;
+				/**
+				 * Find the handler for a request and call it
+				 * A path with routes, but none for the method, is answered 405 (with Allow)
+				 * @returns false if the default handler (or 405) was used
+				 */
+				bool Dispatch(Request & req, TCP::Socket & socket) const;
+
+			private:
+				Router(const Router & cpy) = delete;
+				Router & operator=(const Router & cpy) = delete;
+
+				/** A segment of a route **/
+				struct Node
+				{
+					Node() : segment(""), children(), param(NULL), param_name(""),
+						wildcard(NULL), handlers() {}
+					~Node();
+					std::string segment;
+					std::vector<Node*> children; /** Literal segments **/
+					Node * param; /** Matches any one segment **/
+					std::string param_name;
+					Node * wildcard; /** Matches the rest of the path **/
+					std::vector<std::pair<std::string, Handler> > handlers; /** By method **/
+				};
+
+				static const Handler * Find(const Node * node, const std::string & method, const char * begin,
+					const char * end, Match & match, std::string * allow);
+				static const Handler * Method(const Node * node, const std::string & method, std::string * allow);
+
+				Node * m_root;
+				Handler m_default;
+		};
+
+		/**
+		 * FNV-1a hash of a path segment
+		 * This is constexpr, so a fixed set of routes can be a switch statement
+		 * 	(a jump, no string comparisons). eg:
+		 * 	switch (HTTP::RouteHash(req.Path()))
+		 * 	{
+		 * 		case HTTP::RouteHash("cookies"): ...
+		 * 		case HTTP::RouteHash("headers"): ...
+		 * 	}
+		 * NOTE: The hash is not checked against the string, so an unknown segment
+		 * 	which collides with a route will be sent to it. Use Router if that matters.
+		 */
+		constexpr uint64_t RouteHashStep(const char * s, uint64_t hash)
+		{
+			return (*s == '\0') ? hash : RouteHashStep(s+1, (hash ^ (uint8_t)(*s)) * 1099511628211ULL);
+		}
+		constexpr uint64_t RouteHash(const char * s) {return RouteHashStep(s, 14695981039346656037ULL);}
+		/** FNV-1a hash of the first size characters of s (same value as the constexpr version) **/
+		inline uint64_t RouteHash(const char * s, size_t size)
+		{
+			uint64_t hash = 14695981039346656037ULL;
+			for (size_t i = 0; i < size; ++i)
+				hash = (hash ^ (uint8_t)(s[i])) * 1099511628211ULL;
+			return hash;
+		}
+		/** Hash of the first segment of a path (eg: "api" for "api/users/42") **/
+		inline uint64_t RouteHash(const std::string & path, char delim = '/')
+		{
+			size_t end = path.find(delim);
+			return RouteHash(path.c_str(), (end == std::string::npos) ? path.size() : end);
+		}
+	}
+}
+
+#endif //_ROUTER_H
@@ -60,6 +60,8 @@ namespace Foxbox
 			
 			virtual int GetRaw(void * buffer, size_t bytes); // read bytes into buffer
 			virtual int SendRaw(const void * buffer, size_t bytes); // send buffer of size
+			/** Called after writing to GetFD() directly (sendfile, splice...) so subclasses can count it; data may be NULL **/
+			virtual void Sent(const void * data, size_t bytes) {}
 				
 			virtual bool GetToken(std::string & buffer, const char * delims = " \t\r\n", double timeout=-1, bool inclusive=false); /** Read until delimeter or timeout **/
 			virtual bool Get(std::string & buffer, size_t bytes, double timeout = -1); /** Read number of characters or timeout **/
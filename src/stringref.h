@@ -0,0 +1,57 @@
+/**
+ * @file stringref.h
+ * @brief Reference to characters owned by something else
+ */
+
+#ifndef _STRINGREF_H
+#define _STRINGREF_H
+
+#include <string>
+#include <cstring>
+#include <strings.h>
+
+namespace Foxbox
+{
+	/**
+	 * A (pointer, size) pair referring to characters in another buffer
+	 * 	(think C++17 std::string_view, but we are C++11)
+	 * It does not own the characters, and is NOT null terminated;
+	 * 	keep the owning buffer alive (and unmodified) while it is used.
+	 */
+	class StringRef
+	{
+		public:
+			StringRef() : m_data(""), m_size(0) {}
+			StringRef(const char * data, size_t size) : m_data(data), m_size(size) {}
+			StringRef(const char * s) : m_data(s), m_size(strlen(s)) {}
+			StringRef(const std::string & s) : m_data(s.data()), m_size(s.size()) {}
+
+			const char * data() const {return m_data;}
+			size_t size() const {return m_size;}
+			bool empty() const {return m_size == 0;}
+			const char * begin() const {return m_data;}
+			const char * end() const {return m_data + m_size;}
+			char operator[](size_t i) const {return m_data[i];}
+
+			/** Copy into a std::string **/
+			std::string str() const {return std::string(m_data, m_size);}
+			operator std::string() const {return str();}
+
+			bool operator==(const StringRef & s) const
+			{
+				return m_size == s.m_size && memcmp(m_data, s.m_data, m_size) == 0;
+			}
+			bool operator!=(const StringRef & s) const {return !(*this == s);}
+			/** Compare ignoring ASCII case (as for HTTP header names) **/
+			bool EqualsIgnoreCase(const StringRef & s) const
+			{
+				return m_size == s.m_size && strncasecmp(m_data, s.m_data, m_size) == 0;
+			}
+
+		private:
+			const char * m_data;
+			size_t m_size;
+	};
+}
+
+#endif //_STRINGREF_H
@@ -30,6 +30,17 @@ Socket::Socket(int port) : Foxbox::Socket(), m_port(port)
 	}
 }
 
+/**
+ * Wrap a connected file descriptor
+ */
+Socket::Socket(int fd, int port) : Foxbox::Socket(), m_port(port)
+{
+	Socket::m_sfd = fd;
+	memset(&m_sockaddr, 0, sizeof(m_sockaddr));
+	socklen_t len = sizeof(m_sockaddr);
+	getsockname(m_sfd, (struct sockaddr*)&m_sockaddr, &len);
+}
+
 /**
  * Close TCP socket
  */
@@ -171,6 +182,103 @@ bool Server::Listen()
 	return true;
 }
 
+/** Longest response head looked through for its framing **/
+#define CONNECTION_MAX_HEAD 8192
+
+Connection::Connection(int fd, int port) : Socket(fd, port), m_sent(0), m_status(0), m_head(),
+	m_head_done(false), m_framed(false)
+{
+	
+}
+
+int Connection::SendRaw(const void * buffer, size_t bytes)
+{
+	int written = Socket::SendRaw(buffer, bytes);
+	if (written > 0)
+		Sent(buffer, written);
+	return written;
+}
+
+bool Connection::Send(const char * fmt, ...)
+{
+	char buffer[1024];
+	va_list ap;
+	va_start(ap, fmt);
+	int size = vsnprintf(buffer, sizeof(buffer), fmt, ap);
+	va_end(ap);
+	if (size < 0)
+		return false;
+	if ((size_t)size < sizeof(buffer))
+		return SendRaw(buffer, size) == size;
+	string s(size + 1, '\0');
+	va_start(ap, fmt);
+	vsnprintf(&s[0], s.size(), fmt, ap);
+	va_end(ap);
+	return SendRaw(s.data(), size) == size;
+}
+
+/** Does a response head say where its body ends **/
+static bool Framed(unsigned status, const string & head)
+{
+	if (status < 200 || status == 204 || status == 304)
+		return true;
+	for (size_t line = head.find("\r\n"); line != string::npos; line = head.find("\r\n", line + 2))
+	{
+		string header = head.substr(line + 2, head.find("\r\n", line + 2) - line - 2);
+		if (strncasecmp(header.c_str(), "Content-Length:", 15) == 0)
+			return true;
+		if (strncasecmp(header.c_str(), "Transfer-Encoding:", 18) == 0 && strcasestr(header.c_str(), "chunked") != NULL)
+			return true;
+	}
+	return false;
+}
+
+void Connection::Sent(const void * data, size_t bytes)
+{
+	// The status line starts the first thing sent in response
+	const char * s = (const char*)data;
+	if (m_sent == 0 && s != NULL && bytes >= 12 && memcmp(s, "HTTP/1.", 7) == 0)
+		m_status = (s[9] - '0') * 100 + (s[10] - '0') * 10 + (s[11] - '0');
+	m_sent += bytes;
+	// Collect the head (it may be sent in pieces) to see how the body is framed
+	if (m_status == 0 || m_head_done || s == NULL)
+		return;
+	size_t start = m_head.size();
+	m_head.append(s, min(bytes, CONNECTION_MAX_HEAD - start));
+	size_t end = m_head.find("\r\n\r\n", (start < 3) ? 0 : start - 3);
+	if (end == string::npos && m_head.size() < CONNECTION_MAX_HEAD)
+		return;
+	m_head_done = true;
+	m_framed = (end != string::npos) && Framed(m_status, m_head.substr(0, end + 2));
+	m_head.clear();
+}
+
+void Connection::Close()
+{
+	if (m_sfd < 0) return;
+	// fclose also closes m_sfd
+	if (m_file != NULL)
+		fclose(m_file);
+	else
+		close(m_sfd);
+	m_sfd = -1;
+	m_file = NULL;
+}
+
+int Connection::Release()
+{
+	int fd = m_sfd;
+	if (m_file != NULL)
+	{
+		// fclose would close m_sfd too; keep a copy of it
+		fd = fcntl(m_sfd, F_DUPFD_CLOEXEC, 0);
+		fclose(m_file);
+	}
+	m_sfd = -1;
+	m_file = NULL;
+	return fd;
+}
+
 /**
  * Construct a Client (ie: Connect to address:port)
  */
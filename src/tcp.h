@@ -37,6 +37,8 @@ namespace Foxbox
 			protected:
 				/** Should not construct this class directly **/
 				Socket(int port);
+				/** Wrap a connected file descriptor **/
+				Socket(int fd, int port);
 				Socket(const Socket & cpy) : Foxbox::Socket(cpy), m_port(cpy.m_port) {}
 				int m_port; /** Port being used **/
 				struct sockaddr_in m_sockaddr;
@@ -67,6 +69,42 @@ namespace Foxbox
 				static std::mutex g_portmap_mutex;
 		};
 		
+		/** 
+		 * A TCP Socket wrapping a connection accepted elsewhere
+		 * (eg: by HTTP::Server, which accepts many connections on one port)
+		 */
+		class Connection : public Socket
+		{
+			public:
+				Connection(int fd, int port);
+				virtual ~Connection() {Close();}
+				/** Close immediately (does not drain input like TCP::Socket::Close) **/
+				virtual void Close();
+				/** Give up the connection without closing it (to another server) @returns its fd **/
+				int Release();
+				
+				virtual int SendRaw(const void * buffer, size_t bytes);
+				inline bool Send(const std::string & buffer) {return SendRaw(buffer.c_str(), buffer.size());}
+				/** Formatted in memory and sent with SendRaw (not through stdio) **/
+				virtual bool Send(const char * fmt, ...);
+				virtual void Sent(const void * data, size_t bytes);
+				
+				/** Bytes sent (headers included) since ResetSent **/
+				size_t BytesSent() const {return m_sent;}
+				/** Status code of the HTTP response sent since ResetSent (0 if none) **/
+				unsigned StatusSent() const {return m_status;}
+				/** The response sent since ResetSent says where its body ends (Content-Length, chunked, or no body) **/
+				bool FramedSent() const {return m_framed;}
+				void ResetSent() {m_sent = 0; m_status = 0; m_head.clear(); m_head_done = false; m_framed = false;}
+				
+			private:
+				size_t m_sent;
+				unsigned m_status;
+				std::string m_head; /** The response head, until it has all been sent **/
+				bool m_head_done;
+				bool m_framed;
+		};
+		
 		/** A TCP Socket opened as a Client (ie: Connects to address:port)**/
 		class Client : public Socket
 		{
@@ -0,0 +1,164 @@
+/**
+ * @file timerwheel.cpp
+ * @brief Hierarchical timer wheel - Definitions
+ * @see timerwheel.h - Declarations
+ */
+
+#include "timerwheel.h"
+
+#include <algorithm>
+#include <time.h>
+
+using namespace std;
+
+namespace Foxbox
+{
+
+/** Ticks the wheel spans; timers beyond are put in the furthest slot and re-queued when it comes round **/
+#define TIMERWHEEL_SPAN (1ULL << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS))
+
+TimerWheel::TimerWheel(double tick) : m_tick(max((int64_t)1, (int64_t)(tick * 1e9))), m_current(0)
+{
+	m_current = Now() / m_tick;
+	for (unsigned level = 0; level < TIMERWHEEL_LEVELS; ++level)
+	{
+		m_occupied[level] = 0;
+		for (unsigned slot = 0; slot < TIMERWHEEL_SLOTS; ++slot)
+			m_slots[level][slot].m_prev = m_slots[level][slot].m_next = &m_slots[level][slot];
+	}
+}
+
+TimerWheel::~TimerWheel()
+{
+	// Timers still pending outlive the wheel, so they must not point into it
+	for (unsigned level = 0; level < TIMERWHEEL_LEVELS; ++level)
+	{
+		for (unsigned slot = 0; slot < TIMERWHEEL_SLOTS; ++slot)
+		{
+			Timer & head = m_slots[level][slot];
+			while (head.m_next != &head)
+				head.m_next->Unlink();
+			head.m_prev = head.m_next = NULL;
+		}
+	}
+}
+
+int64_t TimerWheel::Now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void TimerWheel::Schedule(Timer & timer, double seconds, const Callback & callback)
+{
+	timer.Unlink();
+	timer.m_callback = callback;
+	int64_t at = Now() + (int64_t)(max(seconds, 0.0) * 1e9);
+	timer.m_expires = (at + m_tick - 1) / m_tick;
+	Insert(&timer);
+}
+
+void TimerWheel::Insert(Timer * timer)
+{
+	uint64_t expires = max(timer->m_expires, m_current + 1);
+	uint64_t delta = expires - m_current;
+	unsigned level = 0;
+	while (level + 1 < TIMERWHEEL_LEVELS && delta >= (1ULL << (TIMERWHEEL_BITS * (level + 1))))
+		++level;
+	if (delta >= TIMERWHEEL_SPAN)
+		expires = m_current + TIMERWHEEL_SPAN - 1;
+	unsigned slot = (expires >> (TIMERWHEEL_BITS * level)) & (TIMERWHEEL_SLOTS - 1);
+	Timer & head = m_slots[level][slot];
+	timer->m_prev = head.m_prev;
+	timer->m_next = &head;
+	head.m_prev->m_next = timer;
+	head.m_prev = timer;
+	m_occupied[level] |= 1ULL << slot;
+}
+
+void TimerWheel::Take(unsigned level, unsigned slot, Timer & list)
+{
+	Timer & head = m_slots[level][slot];
+	m_occupied[level] &= ~(1ULL << slot);
+	if (head.m_next == &head)
+	{
+		list.m_prev = list.m_next = &list;
+		return;
+	}
+	list.m_next = head.m_next;
+	list.m_prev = head.m_prev;
+	list.m_next->m_prev = &list;
+	list.m_prev->m_next = &list;
+	head.m_prev = head.m_next = &head;
+}
+
+void TimerWheel::Cascade(unsigned level)
+{
+	unsigned slot = (m_current >> (TIMERWHEEL_BITS * level)) & (TIMERWHEEL_SLOTS - 1);
+	if (slot == 0 && level + 1 < TIMERWHEEL_LEVELS)
+		Cascade(level + 1);
+	Timer list;
+	Take(level, slot, list);
+	while (list.m_next != &list)
+	{
+		Timer * timer = list.m_next;
+		timer->Unlink();
+		Insert(timer);
+	}
+}
+
+/** The next tick after current whose level 0 slot is occupied, else the next time level 0 wraps **/
+static inline uint64_t NextTick(uint64_t current, uint64_t occupied)
+{
+	unsigned index = current & (TIMERWHEEL_SLOTS - 1);
+	uint64_t later = (index + 1 < TIMERWHEEL_SLOTS) ? occupied & (~0ULL << (index + 1)) : 0;
+	if (later != 0)
+		return (current & ~(uint64_t)(TIMERWHEEL_SLOTS - 1)) + __builtin_ctzll(later);
+	return (current | (TIMERWHEEL_SLOTS - 1)) + 1;
+}
+
+size_t TimerWheel::Advance()
+{
+	uint64_t now = Now() / m_tick;
+	size_t run = 0;
+	while (m_current < now)
+	{
+		// Straight to the next tick with work, never past a wrap (where higher levels cascade)
+		m_current = min(NextTick(m_current, m_occupied[0]), now);
+		unsigned slot = m_current & (TIMERWHEEL_SLOTS - 1);
+		if (slot == 0)
+			Cascade(1);
+		if ((m_occupied[0] & (1ULL << slot)) == 0)
+			continue;
+		Timer expired;
+		Take(0, slot, expired);
+		while (expired.m_next != &expired)
+		{
+			Timer * timer = expired.m_next;
+			timer->Unlink();
+			if (timer->m_expires > m_current)
+			{
+				Insert(timer); // Was beyond the span of the wheel
+				continue;
+			}
+			// The callback may reschedule (or destroy) its timer
+			Callback callback(move(timer->m_callback));
+			callback();
+			++run;
+		}
+	}
+	return run;
+}
+
+int64_t TimerWheel::Next() const
+{
+	bool pending = false;
+	for (unsigned level = 0; level < TIMERWHEEL_LEVELS; ++level)
+		pending = pending || (m_occupied[level] != 0);
+	if (!pending)
+		return -1;
+	return (int64_t)NextTick(m_current, m_occupied[0]) * m_tick;
+}
+
+}
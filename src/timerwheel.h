@@ -0,0 +1,104 @@
+/**
+ * @file timerwheel.h
+ * @brief Hierarchical timer wheel - Declarations
+ * @see timerwheel.cpp - Definitions
+ * @see eventloop.h - Each EventLoop drives a TimerWheel from a timerfd
+ */
+
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Foxbox
+{
+	/** Bits of the tick each level of a TimerWheel covers **/
+	#define TIMERWHEEL_BITS 6
+	#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+	/** Levels; timers further away than TIMERWHEEL_SLOTS^TIMERWHEEL_LEVELS ticks are re-queued on the way **/
+	#define TIMERWHEEL_LEVELS 4
+
+	/**
+	 * Runs callbacks after a delay, with O(1) schedule and cancel
+	 * Level 0 has a slot per tick; each higher level has a slot per
+	 * 	TIMERWHEEL_SLOTS slots of the one below, and its timers cascade down a
+	 * 	level each time the level below wraps. A bitmap of occupied slots lets
+	 * 	Advance skip empty ticks, so catching up after a long sleep is cheap.
+	 * Time is CLOCK_MONOTONIC, rounded up to whole ticks.
+	 * Not thread safe; EventLoop uses one per loop thread.
+	 */
+	class TimerWheel
+	{
+		public:
+			typedef std::function<void()> Callback;
+
+			/** A timer; embed it in whatever it times out, it cancels itself when destroyed **/
+			class Timer
+			{
+				public:
+					Timer() : m_prev(NULL), m_next(NULL), m_expires(0), m_callback() {}
+					virtual ~Timer() {Unlink();}
+
+					bool Pending() const {return m_prev != NULL;}
+
+				private:
+					friend class TimerWheel;
+					Timer(const Timer & cpy) = delete;
+					Timer & operator=(const Timer & cpy) = delete;
+
+					void Unlink()
+					{
+						if (m_prev == NULL)
+							return;
+						m_prev->m_next = m_next;
+						m_next->m_prev = m_prev;
+						m_prev = m_next = NULL;
+					}
+
+					Timer * m_prev;
+					Timer * m_next;
+					uint64_t m_expires; /** Tick **/
+					Callback m_callback;
+			};
+
+			/** @param tick Resolution in seconds **/
+			TimerWheel(double tick = 0.01);
+			virtual ~TimerWheel();
+
+			/** Run callback in (at least) seconds; rescheduling a pending timer moves it **/
+			void Schedule(Timer & timer, double seconds, const Callback & callback);
+			void Cancel(Timer & timer) {timer.Unlink();}
+
+			/** Run the callbacks of every timer that has expired @returns number run **/
+			size_t Advance();
+			/**
+			 * When Advance may next have something to do (a timer expires, or one
+			 * 	must cascade), in CLOCK_MONOTONIC nanoseconds
+			 * @returns -1 if no timers are pending
+			 */
+			int64_t Next() const;
+
+			/** Current CLOCK_MONOTONIC time in nanoseconds **/
+			static int64_t Now();
+
+		private:
+			TimerWheel(const TimerWheel & cpy) = delete;
+			TimerWheel & operator=(const TimerWheel & cpy) = delete;
+
+			/** Put timer in the slot for its expiry **/
+			void Insert(Timer * timer);
+			/** Move the timers in level's current slot down (after the level below wrapped) **/
+			void Cascade(unsigned level);
+			/** Move all timers in a slot onto list (a sentinel) **/
+			void Take(unsigned level, unsigned slot, Timer & list);
+
+			int64_t m_tick; /** Nanoseconds **/
+			uint64_t m_current; /** Ticks up to and including this one have been run **/
+			uint64_t m_occupied[TIMERWHEEL_LEVELS]; /** Bit per slot that may be non empty **/
+			Timer m_slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS]; /** List sentinels **/
+	};
+}
+
+#endif //_TIMERWHEEL_H
@@ -0,0 +1,165 @@
+/**
+ * @file upstream.cpp
+ * @brief Load balancing across upstream servers - Definitions
+ * @see upstream.h - Declarations
+ */
+
+#include "upstream.h"
+
+using namespace std;
+
+namespace Foxbox
+{
+
+/** Longest ejection, as a power of two times EjectTime **/
+#define UPSTREAM_MAX_BACKOFF 6
+
+Upstream::Upstream(const string & host, int port, unsigned max_idle) : m_host(host), m_port(port),
+	m_client(host, port, max_idle), m_latency(0), m_outstanding(0), m_ejected(false), m_mutex(),
+	m_failures(0), m_ejections(0), m_probing(false), m_ejected_until()
+{
+
+}
+
+UpstreamGroup::~UpstreamGroup()
+{
+	for (auto u : m_upstreams)
+		delete u;
+}
+
+Upstream * UpstreamGroup::Add(const string & host, int port)
+{
+	Upstream * u = new Upstream(host, port, m_max_idle);
+	m_upstreams.push_back(u);
+	return u;
+}
+
+size_t UpstreamGroup::Parse(const string & list, int default_port)
+{
+	size_t added = 0;
+	size_t start = 0;
+	while (start < list.size())
+	{
+		size_t end = list.find(',', start);
+		if (end == string::npos)
+			end = list.size();
+		string host(list, start, end - start);
+		int port = default_port;
+		size_t colon = host.find(':');
+		if (colon != string::npos)
+		{
+			port = atoi(host.c_str() + colon + 1);
+			host.resize(colon);
+		}
+		if (!host.empty())
+		{
+			Add(host, port);
+			++added;
+		}
+		start = end + 1;
+	}
+	return added;
+}
+
+/** xorshift64*; each thread has its own state **/
+static uint64_t Random()
+{
+	static thread_local uint64_t state = 0;
+	if (state == 0)
+	{
+		state = (uint64_t)(chrono::steady_clock::now().time_since_epoch().count()) ^ (uint64_t)(uintptr_t)(&state);
+		state |= 1;
+	}
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 2685821657736338717ULL;
+}
+
+bool UpstreamGroup::Claim(Upstream * u)
+{
+	if (u->m_ejected)
+	{
+		lock_guard<mutex> lock(u->m_mutex);
+		if (!u->m_ejected)
+			return true;
+		if (u->m_probing || chrono::steady_clock::now() < u->m_ejected_until)
+			return false;
+		u->m_probing = true;
+	}
+	return true;
+}
+
+/** Load on u; servers not yet measured score 0 so they are tried **/
+static inline double Score(const Upstream * u)
+{
+	return u->Latency() * (u->Outstanding() + 1);
+}
+
+Upstream * UpstreamGroup::Pick(Upstream * avoid)
+{
+	// Ejected servers due for a probe get one request first; the rest are candidates
+	static thread_local vector<Upstream*> healthy;
+	healthy.clear();
+	Upstream * choice = NULL;
+	for (auto u : m_upstreams)
+	{
+		if (!u->m_ejected)
+		{
+			if (u != avoid)
+				healthy.push_back(u);
+		}
+		else if (choice == NULL && u != avoid && Claim(u))
+			choice = u;
+	}
+	if (choice == NULL && healthy.empty() && avoid != NULL && Claim(avoid))
+		choice = avoid;
+	if (choice == NULL && healthy.size() == 1)
+		choice = healthy[0];
+	else if (choice == NULL && healthy.size() > 1)
+	{
+		size_t n = healthy.size();
+		uint64_t r = Random();
+		size_t i = r % n;
+		size_t j = (i + 1 + (r >> 32) % (n - 1)) % n; // never i
+		choice = (Score(healthy[j]) < Score(healthy[i])) ? healthy[j] : healthy[i];
+	}
+	if (choice != NULL)
+		++choice->m_outstanding;
+	return choice;
+}
+
+void UpstreamGroup::Report(Upstream * u, bool ok, double seconds)
+{
+	--u->m_outstanding;
+	lock_guard<mutex> lock(u->m_mutex);
+	if (ok)
+	{
+		double latency = u->m_latency;
+		u->m_latency = (latency == 0) ? seconds : m_decay * seconds + (1 - m_decay) * latency;
+		u->m_failures = 0;
+		if (u->m_ejected)
+		{
+			Warn("Upstream %s:%d is back", u->m_host.c_str(), u->m_port);
+			u->m_ejected = false;
+			u->m_ejections = 0;
+		}
+		u->m_probing = false;
+		return;
+	}
+	++u->m_failures;
+	if (u->m_probing || (!u->m_ejected && u->m_failures >= m_eject_after))
+	{
+		double eject = m_eject_time * (1 << min(u->m_ejections, (unsigned)UPSTREAM_MAX_BACKOFF));
+		Warn("Ejecting upstream %s:%d for %.1fs after %u failures", u->m_host.c_str(), u->m_port, eject, u->m_failures);
+		u->m_ejected_until = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+			chrono::duration<double>(eject));
+		u->m_ejected = true;
+		++u->m_ejections;
+		// The moving average starts again when it is re-admitted
+		u->m_latency = 0;
+	}
+	u->m_probing = false;
+}
+
+}
@@ -0,0 +1,118 @@
+/**
+ * @file upstream.h
+ * @brief Load balancing across upstream servers - Declarations
+ * @see upstream.cpp - Definitions
+ * @see reverseproxy.h - HTTP::ReverseProxy forwards to an UpstreamGroup
+ */
+
+#ifndef _UPSTREAM_H
+#define _UPSTREAM_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "httpclient.h"
+
+namespace Foxbox
+{
+	/** One server in an UpstreamGroup, with its connection pool and statistics **/
+	class Upstream
+	{
+		public:
+			Upstream(const std::string & host, int port, unsigned max_idle);
+			virtual ~Upstream() {}
+
+			const std::string & Host() const {return m_host;}
+			int Port() const {return m_port;}
+			/** Keep-alive connections to this server **/
+			HTTP::Client & Client() {return m_client;}
+
+			/** Moving average of response latency in seconds (0 until a response is seen) **/
+			double Latency() const {return m_latency;}
+			/** Requests picked but not yet reported **/
+			unsigned Outstanding() const {return m_outstanding;}
+			/** True while ejected for failing **/
+			bool Ejected() const {return m_ejected;}
+
+		private:
+			friend class UpstreamGroup;
+			Upstream(const Upstream & cpy) = delete;
+			Upstream & operator=(const Upstream & cpy) = delete;
+
+			std::string m_host;
+			int m_port;
+			HTTP::Client m_client;
+			std::atomic<double> m_latency;
+			std::atomic<unsigned> m_outstanding;
+			std::atomic<bool> m_ejected;
+			std::mutex m_mutex; /** Guards the members below **/
+			unsigned m_failures; /** Consecutive failures **/
+			unsigned m_ejections; /** Consecutive ejections (doubles the ejection time) **/
+			bool m_probing; /** A request is testing whether an ejected server is back **/
+			std::chrono::steady_clock::time_point m_ejected_until;
+	};
+
+	/**
+	 * Picks an upstream server for each request
+	 * Power of two choices: two servers are chosen at random and the one with
+	 * 	the lower latency * (outstanding requests + 1) is used, so a slow or
+	 * 	busy server gets less traffic without every request piling onto the
+	 * 	single "best" one.
+	 * Passive health checks: a server failing EjectAfter() times in a row is
+	 * 	ejected for EjectTime() seconds (doubling each time it fails again);
+	 * 	then a single request probes it, and re-admits it if it succeeds.
+	 * Thread safe.
+	 */
+	class UpstreamGroup
+	{
+		public:
+			UpstreamGroup() : m_upstreams(), m_max_idle(16), m_eject_after(3), m_eject_time(5), m_decay(0.3) {}
+			virtual ~UpstreamGroup();
+
+			/** Add a server (not thread safe; add all servers before use) **/
+			Upstream * Add(const std::string & host, int port);
+			/** Add servers from "host[:port],host[:port],..." @returns number added **/
+			size_t Parse(const std::string & list, int default_port = 80);
+
+			/**
+			 * Choose a server for a request; call Report when done
+			 * @param avoid A server not to choose unless it is the only one (eg: one that just failed)
+			 * @returns NULL if every server is ejected
+			 */
+			Upstream * Pick(Upstream * avoid = NULL);
+			/**
+			 * Record the outcome of a request to a picked server
+			 * @param ok The server responded (or connected)
+			 * @param seconds Time it took to respond
+			 */
+			void Report(Upstream * upstream, bool ok, double seconds);
+
+			size_t Size() const {return m_upstreams.size();}
+			Upstream & operator[](size_t i) {return *(m_upstreams[i]);}
+
+			/** Idle connections kept per server (applies to servers added later) **/
+			void MaxIdle(unsigned max_idle) {m_max_idle = max_idle;}
+			void EjectAfter(unsigned failures) {m_eject_after = failures;}
+			void EjectTime(double seconds) {m_eject_time = seconds;}
+			/** Weight of each new latency in the moving average (0 to 1) **/
+			void Decay(double decay) {m_decay = decay;}
+
+		private:
+			UpstreamGroup(const UpstreamGroup & cpy) = delete;
+			UpstreamGroup & operator=(const UpstreamGroup & cpy) = delete;
+
+			/** Claim u for a request if it is not ejected (or may be probed) **/
+			bool Claim(Upstream * u);
+
+			std::vector<Upstream*> m_upstreams;
+			unsigned m_max_idle;
+			unsigned m_eject_after;
+			double m_eject_time;
+			double m_decay;
+	};
+}
+
+#endif //_UPSTREAM_H
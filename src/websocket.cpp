@@ -7,11 +7,17 @@
  * NOTE: This is NOT fully RFC complaint
  */
 
+#include <algorithm>
 #include <climits>
 #include <map>
 #include <ctime>
+#include <sys/uio.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define WEBSOCKET_SHA_NI
+#endif
 
-#include "base64.h"
 #include "sha1.h"
 #include "websocket.h"
 
@@ -21,41 +27,45 @@ using namespace std;
 namespace Foxbox {namespace WS
 {
 	
-static string Magic(const string & key);
 
 Socket::Socket(TCP::Socket & tcp_socket, bool use_mask)
 	: Foxbox::Socket(), m_tcp_socket(tcp_socket), m_use_mask(use_mask), 
-	  m_valid(false), m_send_buffer(""), m_recv_buffer(""),
-	  m_recv_tokeniser("")
+	  m_random(), m_valid(false), m_send_buffer(""), m_parser(!use_mask),
+	  m_deflate_config(), m_deflate(), m_compressed(), m_inflated(),
+	  m_recv_tokeniser(""), m_fragment(), m_close_sent(false), m_close_code(CLOSE_ABNORMAL)
 {
+	m_deflate_config.enabled = false;
 	Foxbox::Socket::CopyFD(m_tcp_socket);
 }
 
-Client::Client(const char * server_addr, int port, const char * query, const char * proto) 
-	: WS::Socket(m_client), m_client(server_addr, port)
+Client::Client(const char * server_addr, int port, const char * query, const char * proto,
+	const DeflateConfig * deflate) : WS::Socket(m_client), m_client(server_addr, port)
 {
-	srand(time(NULL));
+	if (deflate != NULL)
+		m_deflate_config = *deflate;
 	HTTP::Request handshake(server_addr, "GET", query);
 	
-	// The RFC says nothing obvious about how this key should be chosen
-	// So I just picked the same key given in the RFC.
-	// Iceweasel appears to make different keys for each connection.
-	string key("dGhlIHNhbXBsZSBub25jZQ==");
-	string magic(Magic(key));
+	// A new nonce for each connection (RFC 6455 4.1), from the masking key generator
+	char key[WEBSOCKET_KEY_SIZE];
+	NewKey(m_random, key);
+	char magic[WEBSOCKET_ACCEPT_SIZE];
+	Magic(StringRef(key, sizeof(key)), magic);
 	
 	HTTP::Update(handshake.Headers(), {
 		{"Connection", "Upgrade"},
-		{"Sec-WebSocket-Key", key},
+		{"Sec-WebSocket-Key", string(key, sizeof(key))},
 		{"Sec-WebSocket-Protocol", proto},
 		{"Upgrade", "websocket"},
 		{"Sec-WebSocket-Version", "13"}
 	});
+	if (m_deflate_config.enabled)
+		handshake.Headers().Set("Sec-WebSocket-Extensions", Deflate::Offer(m_deflate_config));
 	handshake.Send(m_client);
 	if (!m_client.Valid())
 		return;
 
 	
-	map<string, string> headers;
+	HTTP::Headers headers;
 	//Debug("Waiting on response headers.");
 	if (HTTP::ParseResponseHeaders(m_client, &headers, NULL) != 101)
 	{
@@ -63,8 +73,7 @@ Client::Client(const char * server_addr, int port, const char * query, const cha
 		return;
 	}
 	//Debug("Got response headers.");
-	auto i = headers.find("Sec-WebSocket-Accept");
-	if (i == headers.end())
+	if (!headers.Has(HTTP::HEADER_SEC_WEBSOCKET_ACCEPT))
 	{
 		//Error("No \"Sec-WebSocket-Accept\" header");
 		Foxbox::Socket s(stderr);
@@ -72,10 +81,28 @@ Client::Client(const char * server_addr, int port, const char * query, const cha
 		return;	
 	}
 		
-	if (i->second != magic)
+	StringRef accept(headers.Get(HTTP::HEADER_SEC_WEBSOCKET_ACCEPT));
+	if (accept != StringRef(magic, sizeof(magic)))
 	{
-		Warn("Magic string \"%s\" does not match \"%s\" (key \"%s\")",
-			i->second.c_str(), magic.c_str(), key.c_str());
+		// The server didn't answer this handshake; the connection must fail (RFC 6455 4.1)
+		Error("Magic string \"%s\" does not match \"%s\" (key \"%s\")",
+			accept.str().c_str(), string(magic, sizeof(magic)).c_str(), string(key, sizeof(key)).c_str());
+		m_client.Close();
+		return;
+	}
+	if (headers.Has(HTTP::HEADER_SEC_WEBSOCKET_EXTENSIONS))
+	{
+		DeflateParams params;
+		if (!m_deflate_config.enabled
+			|| !Deflate::Accept(headers.Get(HTTP::HEADER_SEC_WEBSOCKET_EXTENSIONS), m_deflate_config, params))
+		{
+			Error("Server agreed to extensions \"%s\" that weren't offered",
+				headers.Get(HTTP::HEADER_SEC_WEBSOCKET_EXTENSIONS).str().c_str());
+			m_client.Close();
+			return;
+		}
+		m_deflate.reset(new Deflate(params, m_deflate_config));
+		m_parser.Compression(true);
 	}
 	//Debug("Handshake on client done.");
 	m_valid = true;
@@ -94,6 +121,10 @@ Server::Server(const Server & cpy) : WS::Socket(m_server), m_server(cpy.m_server
 bool Server::Listen()
 {
 	m_valid = false;
+	m_close_sent = false;
+	m_close_code = CLOSE_ABNORMAL;
+	m_parser.Reset();
+	m_deflate.reset();
 	if (!m_server.Listen())
 		return false;
 	//Debug("Handshaking...");
@@ -102,26 +133,39 @@ bool Server::Listen()
 	{
 		Error("Failed to process HTTP request");
 	}
-	map<string, string> & headers = handshake.Headers();
-	auto i = headers.find("Sec-WebSocket-Key");
-	if (i == headers.end())
+	HTTP::Headers & headers = handshake.Headers();
+	if (!headers.Has(HTTP::HEADER_SEC_WEBSOCKET_KEY))
 	{
 		Error("No Sec-WebSocket-Key header!");
-		for (i = headers.begin(); i != headers.end(); ++i)
+		for (size_t i = 0; i < headers.Size(); ++i)
 		{
-			Error("Key: %s = %s", i->first.c_str(), i->second.c_str());
+			Error("Key: %s = %s", headers.Name(i).str().c_str(), headers.Value(i).str().c_str());
 		}
 		return false;
 	}
 	//Debug("Finished handshake");
-	string magic = Foxbox::WS::Magic(i->second);
+	char magic[WEBSOCKET_ACCEPT_SIZE + 1];
+	Foxbox::WS::Magic(headers.Get(HTTP::HEADER_SEC_WEBSOCKET_KEY), magic);
+	magic[WEBSOCKET_ACCEPT_SIZE] = '\0';
 	
 	m_server.Send("HTTP/1.1 101 Switching Protocols\r\n");
 	m_server.Send("Upgrade: WebSocket\r\n");
 	m_server.Send("Connection: Upgrade\r\n");
-	m_server.Send("Sec-WebSocket-Accept: %s\r\n", magic.c_str());
-	m_server.Send("Sec-WebSocket-Protocol: %s\r\n\r\n", 
-		headers["Sec-WebSocket-Protocol"].c_str());
+	m_server.Send("Sec-WebSocket-Accept: %s\r\n", magic);
+	// Agree to the client's first choice of subprotocol, if it offered any
+	string protocol(headers.Get(HTTP::HEADER_SEC_WEBSOCKET_PROTOCOL));
+	protocol.resize(min(protocol.find(','), protocol.size()));
+	if (!protocol.empty())
+		m_server.Send("Sec-WebSocket-Protocol: %s\r\n", protocol.c_str());
+	DeflateParams params;
+	string extensions;
+	if (Deflate::Negotiate(headers.Get(HTTP::HEADER_SEC_WEBSOCKET_EXTENSIONS), m_deflate_config, params, extensions))
+	{
+		m_server.Send("Sec-WebSocket-Extensions: %s\r\n", extensions.c_str());
+		m_deflate.reset(new Deflate(params, m_deflate_config));
+		m_parser.Compression(true);
+	}
+	m_server.Send("\r\n");
 	m_valid = true;
 	return true;
 }
@@ -134,209 +178,525 @@ bool Socket::Valid()
 	return m_valid;
 }
 
-string Magic(const string & key)
-{										
-	string result = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-	unsigned char hash[SHA1HashSize];
-	const unsigned char * d = (const unsigned char*)(result.c_str());
-	//SHA1(d, result.size(), hash);
-	SHA1Context sha;
-	SHA1Reset(&sha);
-	SHA1Input(&sha, d, result.size());
-	SHA1Result(&sha, hash);	
-	return base64_encode(hash, SHA1HashSize);
+/** Appended to a Sec-WebSocket-Key before hashing it (RFC 6455 4.2.2) **/
+static const char g_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const char g_base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/** Encode size bytes as 4 * ceil(size / 3) characters, padded with '=' **/
+static void Base64(const uint8_t * in, size_t size, char * out)
+{
+	for (; size >= 3; in += 3, size -= 3, out += 4)
+	{
+		uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+		out[0] = g_base64[v >> 18];
+		out[1] = g_base64[(v >> 12) & 0x3f];
+		out[2] = g_base64[(v >> 6) & 0x3f];
+		out[3] = g_base64[v & 0x3f];
+	}
+	if (size == 0)
+		return;
+	uint32_t v = (in[0] << 16) | ((size > 1) ? (in[1] << 8) : 0);
+	out[0] = g_base64[v >> 18];
+	out[1] = g_base64[(v >> 12) & 0x3f];
+	out[2] = (size > 1) ? g_base64[(v >> 6) & 0x3f] : '=';
+	out[3] = '=';
 }
 
-bool Socket::Send(const char * message, ...)
+#define SHA1_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+/** Extend a block's 16 words to the 80 of its message schedule **/
+static void SHA1Expand(uint32_t w[80])
 {
-	if (!m_tcp_socket.Valid()) 
-		return false; 
-		
-	int32_t mask = (m_use_mask) ? rand() : 0;
-	uint8_t mask_str[4];
-	memcpy(mask_str+0, &mask, sizeof(mask));
-	
-	va_list ap;
-	va_start(ap, message);
-		
-	//Debug("Message is \"%s\"", message);
-		
-	int size = vsnprintf(NULL, 0, message, ap);
-	va_end(ap);
-	if (size < 0)
+	for (unsigned i = 16; i < 80; ++i)
+		w[i] = SHA1_ROTL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+}
+
+/** Mix one block's message schedule into the hash **/
+static void SHA1Compress(uint32_t h[5], const uint32_t w[80])
+{
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	// Five rounds at a time, naming the variables in turn rather than moving them
+	#define SHA1_ROUND(a, b, c, d, e, f, k, i) \
+		e += SHA1_ROTL(a, 5) + (f) + (k) + w[i]; \
+		b = SHA1_ROTL(b, 30);
+	#define SHA1_ROUNDS(f, k, i) \
+		SHA1_ROUND(a, b, c, d, e, f(b, c, d), k, i) \
+		SHA1_ROUND(e, a, b, c, d, f(a, b, c), k, i + 1) \
+		SHA1_ROUND(d, e, a, b, c, f(e, a, b), k, i + 2) \
+		SHA1_ROUND(c, d, e, a, b, f(d, e, a), k, i + 3) \
+		SHA1_ROUND(b, c, d, e, a, f(c, d, e), k, i + 4)
+	#define SHA1_CHOOSE(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+	#define SHA1_PARITY(x, y, z) ((x) ^ (y) ^ (z))
+	#define SHA1_MAJORITY(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+	for (unsigned i = 0; i < 20; i += 5)
 	{
-		
-		Error("Error in vsnprintf(3) - %s", StrError(errno));
-		return false;
+		SHA1_ROUNDS(SHA1_CHOOSE, 0x5a827999, i)
 	}
-	
-	uint8_t * buffer = new uint8_t[size+20];
-	
-	int written = size+2;
-	uint8_t * payload = buffer+2;
-	buffer[0] = 0x81; // first and last frame, opcode of frame is text
-	buffer[1] = ((mask != 0) ? 0x80 : 0x00);
-	
-	if (size < 126) 
+	for (unsigned i = 20; i < 40; i += 5)
 	{
-		buffer[1] |= size;
-		//Debug("Short message %s", message);
+		SHA1_ROUNDS(SHA1_PARITY, 0x6ed9eba1, i)
 	}
-	else if (size < SHRT_MAX)
+	for (unsigned i = 40; i < 60; i += 5)
 	{
-		buffer[1] |= 126;
-		int16_t t(size);
-		memcpy(payload, &t, sizeof(t)); 
-		payload += sizeof(t);
-		written += sizeof(t);
+		SHA1_ROUNDS(SHA1_MAJORITY, 0x8f1bbcdc, i)
 	}
-	else if (size < LLONG_MAX)
+	for (unsigned i = 60; i < 80; i += 5)
 	{
-		buffer[1] |= 127;
-		int64_t t(size);
-		memcpy(payload, &t, sizeof(t));
-		payload += sizeof(t);
-		written += sizeof(t);
+		SHA1_ROUNDS(SHA1_PARITY, 0xca62c1d6, i)
 	}
-	//Debug("Buffer[1] is %u (size is %d)", (uint8_t)buffer[1], size);
-	if (mask != 0)
-	{
-		*(payload++) = mask_str[0];
-		*(payload++) = mask_str[1];
-		*(payload++) = mask_str[2];
-		*(payload++) = mask_str[3];
-		written += 4;
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+#ifdef WEBSOCKET_SHA_NI
+/** The CPU has the SHA extensions (and SSE4.1 and SSSE3, which go with them) **/
+static bool HasSHA()
+{
+	unsigned a, b, c, d;
+	if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1) || !(c & bit_SSSE3))
+		return false;
+	return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29));
+}
+
+/**
+ * Hash one 64 byte block with the SHA extensions
+ * Each group does four rounds, while the message schedule is extended four
+ * 	words at a time for the groups to come (Intel's SHA extensions paper).
+ */
+__attribute__((target("sha,sse4.1,ssse3"))) static void SHA1BlockNI(uint32_t h[5], const uint8_t * block)
+{
+	const __m128i order = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)h), 0x1b);
+	__m128i e[2] = {_mm_set_epi32(h[4], 0, 0, 0), _mm_setzero_si128()};
+	const __m128i abcd_start = abcd;
+	const __m128i e_start = e[0];
+	__m128i m[4];
+	for (unsigned i = 0; i < 4; ++i)
+		m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16 * i)), order);
+
+	#define SHA1NI_GROUP(i) \
+		e[(i) & 1] = ((i) == 0) ? _mm_add_epi32(e[0], m[0]) : _mm_sha1nexte_epu32(e[(i) & 1], m[(i) & 3]); \
+		e[((i) + 1) & 1] = abcd; \
+		if ((i) >= 3 && (i) <= 18) \
+			m[((i) + 1) & 3] = _mm_sha1msg2_epu32(m[((i) + 1) & 3], m[(i) & 3]); \
+		abcd = _mm_sha1rnds4_epu32(abcd, e[(i) & 1], (i) / 5); \
+		if ((i) >= 1 && (i) <= 16) \
+			m[((i) + 3) & 3] = _mm_sha1msg1_epu32(m[((i) + 3) & 3], m[(i) & 3]); \
+		if ((i) >= 2 && (i) <= 17) \
+			m[((i) + 2) & 3] = _mm_xor_si128(m[((i) + 2) & 3], m[(i) & 3]);
+	SHA1NI_GROUP(0) SHA1NI_GROUP(1) SHA1NI_GROUP(2) SHA1NI_GROUP(3) SHA1NI_GROUP(4)
+	SHA1NI_GROUP(5) SHA1NI_GROUP(6) SHA1NI_GROUP(7) SHA1NI_GROUP(8) SHA1NI_GROUP(9)
+	SHA1NI_GROUP(10) SHA1NI_GROUP(11) SHA1NI_GROUP(12) SHA1NI_GROUP(13) SHA1NI_GROUP(14)
+	SHA1NI_GROUP(15) SHA1NI_GROUP(16) SHA1NI_GROUP(17) SHA1NI_GROUP(18) SHA1NI_GROUP(19)
+	#undef SHA1NI_GROUP
+
+	e[0] = _mm_sha1nexte_epu32(e[0], e_start);
+	abcd = _mm_add_epi32(abcd, abcd_start);
+	_mm_storeu_si128((__m128i*)h, _mm_shuffle_epi32(abcd, 0x1b));
+	h[4] = _mm_extract_epi32(e[0], 3);
+}
+#endif
+
+/** Message schedule of the second block of a 60 byte message; it only holds padding, so never changes **/
+struct SHA1Padding
+{
+	SHA1Padding()
+	{
+		memset(w, 0, sizeof(w));
+		memset(block, 0, sizeof(block));
+		w[15] = (WEBSOCKET_KEY_SIZE + sizeof(g_guid) - 1) * 8;
+		block[62] = w[15] >> 8;
+		block[63] = w[15] & 0xff;
+		SHA1Expand(w);
 	}
-	va_list ap2;
-	va_start(ap2, message);
-	if (vsnprintf((char*)payload, size+1, message, ap2) < 0)
+	uint32_t w[80];
+	uint8_t block[64]; /** The same, as bytes **/
+};
+
+/**
+ * A key of the usual size and the GUID make 60 bytes, which (padded) hash
+ * 	as two blocks: the first has the key in its first 6 words, the second
+ * 	is the same for every key, so its message schedule is worked out once.
+ * 	Other keys go through the general SHA1.
+ */
+void Magic(const StringRef & key, char * accept)
+{
+	uint8_t hash[SHA1HashSize];
+	if (key.size() != WEBSOCKET_KEY_SIZE)
 	{
-		va_end(ap2);
-		Error("Error in vsnprintf(3) - %s", StrError(errno));
-		return false;
+		string input(key.str() + g_guid);
+		SHA1Context sha;
+		SHA1Reset(&sha);
+		SHA1Input(&sha, (const uint8_t*)input.data(), input.size());
+		SHA1Result(&sha, hash);
 	}
-	va_end(ap2);
-	//Debug("Buffer is %s", buffer);
-	//Debug("Payload is %s", payload);
-	if (mask != 0)
+	else
 	{
-		
-		
-		//Debug("mask is %.8x", mask);
-		for (int i = 0; i < size; ++i)
+		uint8_t block[64];
+		memcpy(block, key.data(), WEBSOCKET_KEY_SIZE);
+		memcpy(block + WEBSOCKET_KEY_SIZE, g_guid, sizeof(g_guid) - 1);
+		block[60] = 0x80;
+		block[61] = block[62] = block[63] = 0;
+		uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+		static const SHA1Padding padding;
+#ifdef WEBSOCKET_SHA_NI
+		static const bool sha_ni = HasSHA();
+		if (sha_ni)
 		{
-			//Debug("Payload[%d] is %c %.4x and mask[%d] is %.4x", i, payload[i], payload[i], i%4,mask_str[i%4]);
-			payload[i] = (uint8_t)(payload[i] ^ (uint8_t)(mask_str[i%4]));
-			//Debug("Payload[%d] is %.4x and EOF is %.4x", i, payload[i], EOF);
+			SHA1BlockNI(h, block);
+			SHA1BlockNI(h, padding.block);
+		}
+		else
+#endif
+		{
+			uint32_t w[80];
+			for (unsigned i = 0; i < 16; ++i)
+				w[i] = (block[4*i] << 24) | (block[4*i+1] << 16) | (block[4*i+2] << 8) | block[4*i+3];
+			SHA1Expand(w);
+			SHA1Compress(h, w);
+			SHA1Compress(h, padding.w);
+		}
+		for (unsigned i = 0; i < 5; ++i)
+		{
+			hash[4*i] = h[i] >> 24;
+			hash[4*i+1] = h[i] >> 16;
+			hash[4*i+2] = h[i] >> 8;
+			hash[4*i+3] = h[i];
 		}
 	}
-	//Debug("Buffer is %s", buffer);
-	//Debug("Payload is %s", payload);
-	//Debug("Write %d bytes, %d in payload", written, size);
-	
-	size_t w = m_tcp_socket.Write(buffer, (size_t)written*sizeof(uint8_t));
-	if (w != (size_t)written)
-	{
-		Error("Wrote %u instead of %lli bytes", w, written);
-	}
-	delete [] buffer;
-	return (w == (size_t)written);
+	Base64(hash, sizeof(hash), accept);
 }
 
-bool Socket::GetMessage(string & buffer, double timeout)
+string Magic(const string & key)
 {
-	
-	bool result = GetMessage(timeout);
-	//Debug("Buffer %s, result %d", m_recv_buffer.c_str(), result);
-	if (result)
-	  buffer += m_recv_buffer;
-	return result;
+	char accept[WEBSOCKET_ACCEPT_SIZE];
+	Magic(StringRef(key), accept);
+	return string(accept, sizeof(accept));
 }
 
-bool Socket::GetMessage(double timeout)
+void NewKey(Random & random, char * key)
 {
-	
-	if (!m_tcp_socket.CanReceive(timeout)) return false;
-	
-	uint8_t c = 0x00;
-	
-	int32_t mask = 0;
-	int64_t size = 0;
-	m_recv_buffer.clear();
-	m_recv_tokeniser.str("");
-	bool finished = false;
-	while (!finished)
+	uint8_t nonce[16];
+	random.Fill(nonce, sizeof(nonce));
+	Base64(nonce, sizeof(nonce), key);
+}
+
+bool Socket::Send(const char * message, ...)
+{
+	char stack[1024];
+	va_list ap;
+	va_start(ap, message);
+	int size = vsnprintf(stack, sizeof(stack), message, ap);
+	va_end(ap);
+	if (size < 0)
 	{
-		m_tcp_socket.Read(&c, sizeof(uint8_t)); 
-		finished = ((c & (1 << 7)) == 0x80);
-//		Debug("start of frame is %.2x", c);
-		if ((c & (1 << 0)) != 0x01) // check op code
+		Error("Error in vsnprintf(3) - %s", StrError(errno));
+		return false;
+	}
+	if ((size_t)size < sizeof(stack))
+		return SendFrame(TEXT, stack, size);
+	string heap(size + 1, '\0');
+	va_start(ap, message);
+	vsnprintf(&heap[0], heap.size(), message, ap);
+	va_end(ap);
+	return SendFrame(TEXT, heap.data(), size);
+}
+
+/** Write all of iov (count entries; modified) @returns false on error **/
+static bool WriteAll(int fd, struct iovec * v, int count)
+{
+	while (count > 0)
+	{
+		ssize_t written = writev(fd, v, count);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0)
 		{
-			//Error("Only understand Text frames");
+			Error("Error in writev(2) - %s", StrError(errno));
 			return false;
 		}
-		
-		
-		m_tcp_socket.Read(&c, 1); // contains mask and payload length
-		
-		// Payload length
-		size = (c & ~(1 << 7));
-		
-		if (size == 126)
+		while (count > 0 && (size_t)written >= v->iov_len)
 		{
-			// read next 2 bytes
-			int16_t t(0);
-			m_tcp_socket.Read(&t, sizeof(t));
-			size = t;
+			written -= v->iov_len;
+			++v;
+			--count;
 		}
-		else if (size == 127)
+		if (count > 0)
 		{
-			// read next 8 bytes
-			size = 0;
-			m_tcp_socket.Read(&size, sizeof(size));
+			v->iov_base = (char*)v->iov_base + written;
+			v->iov_len -= written;
 		}
-		//Debug("Mask + Payload %.2x, mask %.2x", c, (c & (1<<7)));
-		//Debug("Payload %lli (%.2x)", size, (c & ~(1 << 7)));
-		
-		if ((c & (1 << 7)) == 0x80) // mask bit is set
+	}
+	return true;
+}
+
+bool Socket::SendFrame(Opcode opcode, const void * data, size_t size, bool fin)
+{
+	if (!m_tcp_socket.Valid())
+		return false;
+	if ((opcode & 0x8) && (size > WSFRAME_MAX_CONTROL || !fin))
+	{
+		Error("Control frames can't be fragmented or longer than %d bytes", WSFRAME_MAX_CONTROL);
+		return false;
+	}
+	// Only whole messages are compressed (a stream's fragments go as they are)
+	bool compressed = m_deflate && fin && (opcode == TEXT || opcode == BINARY) && m_deflate->Wanted(size);
+	if (compressed)
+	{
+		if (!m_deflate->Compress(data, size, m_compressed))
+			return false;
+		data = m_compressed.data();
+		size = m_compressed.size();
+	}
+	Header header(opcode, size, fin);
+	header.rsv = compressed ? 0x4 : 0;
+	header.masked = m_use_mask;
+	header.key = (m_use_mask) ? m_random.Next() : 0;
+	uint8_t head[WSFRAME_MAX_HEADER];
+	struct iovec iov[2];
+	iov[0].iov_base = head;
+	iov[0].iov_len = EncodeHeader(head, header);
+	iov[1].iov_base = (void*)data;
+	iov[1].iov_len = size;
+	// A compressed payload is already a copy, so it is masked where it is
+	if (compressed && m_use_mask)
+		Mask(&m_compressed[0], size, header.key);
+	if (!m_use_mask || compressed)
+	{
+		if (WriteAll(m_tcp_socket.GetFD(), iov, (size > 0) ? 2 : 1))
+			return true;
+		m_valid = false;
+		return false;
+	}
+	// Masked a piece at a time in a copy; the caller's data is left alone
+	const char * payload = (const char*)data;
+	size_t done = 0;
+	do
+	{
+		size_t n = min(size - done, (size_t)WEBSOCKET_FRAGMENT);
+		m_send_buffer.assign(payload + done, n);
+		Mask(&m_send_buffer[0], n, header.key, done);
+		iov[1].iov_base = &m_send_buffer[0];
+		iov[1].iov_len = n;
+		bool first = (done == 0);
+		if (!WriteAll(m_tcp_socket.GetFD(), first ? iov : iov + 1, (first ? 1 : 0) + ((n > 0) ? 1 : 0)))
 		{
-			m_tcp_socket.Read(&mask, sizeof(mask));
-			
-			//Debug("Mask set, mask is %u (%.4x)", mask, mask);
+			m_valid = false;
+			return false;
 		}
-		
-		// read the payload
-		//TODO: Optimise memory allocations
-		uint8_t * buffer = new uint8_t[size+1];
-		size_t read = m_tcp_socket.Read(buffer, size*sizeof(uint8_t));
-		buffer[read] = 0;
-		if (read != (size_t)size)
+		done += n;
+	} while (done < size);
+	return true;
+}
+
+bool Socket::SendStream(Opcode opcode, Foxbox::Socket & input, size_t fragment)
+{
+	fragment = max(fragment, (size_t)1);
+	m_fragment.resize(fragment);
+	bool first = true;
+	bool eof = false;
+	while (!eof)
+	{
+		// Fill a whole fragment, so only the last frame is short
+		size_t size = 0;
+		while (size < fragment)
 		{
-			Warn("Didn't read all bytes; read %u instead of %d", read, size);
+			int n = input.GetRaw(&m_fragment[size], fragment - size);
+			if (n <= 0)
+			{
+				eof = true;
+				break;
+			}
+			size += n;
 		}
-		
-		unsigned old_size = m_recv_buffer.size();
-		m_recv_buffer.reserve(old_size + size);
-		
-		
-		uint8_t mask_str[4];
-		memcpy(mask_str, &mask, sizeof(mask));
-		
-		for (unsigned i = 0; i < size; ++i)
+		if (!SendFrame(first ? opcode : CONTINUATION, m_fragment.data(), size, eof))
+			return false;
+		first = false;
+	}
+	if (m_fragment.capacity() > WEBSOCKET_FRAGMENT)
+		string().swap(m_fragment);
+	return true;
+}
+
+void Socket::SendClose(unsigned code, const StringRef & reason)
+{
+	if (m_close_sent || !m_tcp_socket.Valid())
+		return;
+	uint8_t payload[WSFRAME_MAX_CONTROL];
+	size_t size = min(reason.size(), (size_t)WSFRAME_MAX_CONTROL - 2);
+	payload[0] = code >> 8;
+	payload[1] = code & 0xff;
+	memcpy(payload + 2, reason.data(), size);
+	m_close_sent = SendFrame(CLOSE, payload, size + 2);
+}
+
+bool Socket::Close(unsigned code, const StringRef & reason, double timeout)
+{
+	SendClose(code, reason);
+	// Discard whatever the peer sends until its close frame (Next answers it)
+	FrameParser::Message message;
+	FrameParser::Result result = FrameParser::MESSAGE;
+	while (m_valid && m_close_sent && (result == FrameParser::MESSAGE || result == FrameParser::PIECE))
+		result = Next(message, timeout);
+	Close();
+	return m_close_sent;
+}
+
+void Socket::Fail(unsigned code)
+{
+	Warn("Closing WebSocket with status %u", code);
+	SendClose(code);
+	Close();
+}
+
+bool Socket::Receive(double timeout)
+{
+	if (!m_tcp_socket.CanReceive(timeout))
+		return false;
+	char * space = m_parser.Space(WEBSOCKET_FRAGMENT);
+	ssize_t received;
+	do
+	{
+		received = read(m_tcp_socket.GetFD(), space, WEBSOCKET_FRAGMENT);
+	} while (received < 0 && errno == EINTR);
+	if (received <= 0)
+	{
+		Close();
+		return false;
+	}
+	m_parser.Received(received);
+	return true;
+}
+
+FrameParser::Result Socket::Next(FrameParser::Message & message, double timeout)
+{
+	while (true)
+	{
+		FrameParser::Result result = m_parser.Next(message);
+		switch (result)
 		{
-			if (mask != 0)
-				buffer[i] ^= mask_str[i%4];
-			m_recv_buffer += (char)(buffer[i]);
+			case FrameParser::MORE:
+				// Once a message has started the rest is waited for regardless
+				if (!Receive(m_parser.Partial() ? -1 : timeout))
+					return FrameParser::MORE;
+				break;
+			case FrameParser::CONTROL:
+				if (!Control(message))
+					return FrameParser::FAILED;
+				break;
+			case FrameParser::FAILED:
+				Fail(m_parser.Failure());
+				return FrameParser::FAILED;
+			default:
+				if (message.compressed && !Inflate(message))
+					return FrameParser::FAILED;
+				return result;
 		}
-		delete [] buffer;
+	}
+}
 
+bool Socket::Inflate(FrameParser::Message & message)
+{
+	if (m_inflated.capacity() > WSFRAME_KEEP_BUFFER)
+		string().swap(m_inflated);
+	m_inflated.clear();
+	unsigned failure = m_deflate->Decompress(message.data, message.size, message.last, m_inflated, m_parser.MaxMessage());
+	if (failure != 0)
+	{
+		Fail(failure);
+		return false;
 	}
-	//Debug("Got message %s", m_recv_buffer.c_str());
-	m_recv_tokeniser.str(m_recv_buffer);
+	message.data = m_inflated.data();
+	message.size = m_inflated.size();
+	if (!m_parser.CheckInflated(message))
+	{
+		Fail(CLOSE_INVALID_DATA);
+		return false;
+	}
+	return true;
+}
+
+bool Socket::Control(const FrameParser::Message & message)
+{
+	switch (message.opcode)
+	{
+		case PING:
+			return SendFrame(PONG, message.data, message.size);
+		case PONG:
+			return true; // Unsolicited pongs are allowed (RFC 6455 5.5.3)
+		case CLOSE:
+		{
+			m_close_code = CLOSE_NO_STATUS;
+			if (message.size >= 2)
+				m_close_code = ((uint8_t)message.data[0] << 8) | (uint8_t)message.data[1];
+			// A lone byte, or a code that must not be sent, fails the connection
+			if (message.size == 1 || (message.size >= 2 && !ValidCloseCode(m_close_code)))
+				m_close_code = CLOSE_PROTOCOL_ERROR;
+			// Echo the status code
+			SendClose((m_close_code == CLOSE_NO_STATUS) ? CLOSE_NORMAL : m_close_code);
+			Close();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Socket::GetMessage(string & buffer, double timeout, Opcode * opcode)
+{
+	StringRef message;
+	if (!GetMessage(message, timeout, opcode))
+		return false;
+	buffer.append(message.data(), message.size());
+	return true;
+}
+
+bool Socket::GetMessage(StringRef & view, double timeout, Opcode * opcode)
+{
+	m_parser.Streaming(false);
+	FrameParser::Message message;
+	if (Next(message, timeout) != FrameParser::MESSAGE)
+		return false;
+	view = StringRef(message.data, message.size);
+	if (opcode != NULL)
+		*opcode = (Opcode)message.opcode;
+	return true;
+}
+
+bool Socket::GetMessage(double timeout, Opcode * opcode)
+{
+	m_recv_tokeniser.str("");
+	StringRef message;
+	if (!GetMessage(message, timeout, opcode))
+		return false;
+	m_recv_tokeniser.str(message.str());
 	m_recv_tokeniser.clear();
 	return true;
 }
 
+bool Socket::GetStream(const Receiver & receiver, double timeout, Opcode * opcode)
+{
+	m_parser.Streaming(true);
+	bool wanted = true;
+	FrameParser::Message message;
+	do
+	{
+		if (Next(message, timeout) != FrameParser::PIECE)
+		{
+			m_parser.Streaming(false);
+			return false;
+		}
+		if (opcode != NULL)
+			*opcode = (Opcode)message.opcode;
+		if (wanted)
+			wanted = receiver(message.data, message.size, message.last);
+	} while (!message.last);
+	m_parser.Streaming(false);
+	return true;
+}
+
 bool Socket::GetToken(string & buffer, const char * delims, double timeout, bool inclusive)
 {
 	//Debug("Tokenise \"%s\"", m_recv_tokeniser.str().c_str());
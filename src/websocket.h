@@ -12,13 +12,35 @@
 
 #include "tcp.h"
 #include "http.h"
+#include "wsframe.h"
+#include "wsdeflate.h"
 
+#include <functional>
+#include <memory>
 #include <sstream>
 
 namespace Foxbox
 {
 	namespace WS
 	{
+		/** Bytes per frame when streaming, and most buffered when receiving a stream **/
+		#define WEBSOCKET_FRAGMENT 65536
+
+		/** Length of a Sec-WebSocket-Key (16 bytes in base64) **/
+		#define WEBSOCKET_KEY_SIZE 24
+		/** Length of a Sec-WebSocket-Accept (a SHA1 hash in base64) **/
+		#define WEBSOCKET_ACCEPT_SIZE 28
+
+		/** The Sec-WebSocket-Accept answering a Sec-WebSocket-Key **/
+		std::string Magic(const std::string & key);
+		/**
+		 * Write the Sec-WebSocket-Accept for key into accept (WEBSOCKET_ACCEPT_SIZE
+		 * 	characters, not terminated), without allocating
+		 */
+		void Magic(const StringRef & key, char * accept);
+		/** Write a new Sec-WebSocket-Key into key (WEBSOCKET_KEY_SIZE characters, not terminated) **/
+		void NewKey(Random & random, char * key);
+
 			/**
 			 * A WebSocket based on Foxbox::Socket 
 			 *  You should not construct this class; use WS::Server and
@@ -31,22 +53,67 @@ namespace Foxbox
 				//(Inheriting from TCP::Socket is a trap that leads to 
 				//	C++ inheritance nightmares)
 				public:
-					virtual ~Socket() {}
+					/** Called with each piece of a message as it arrives; return false to stop **/
+					typedef std::function<bool(const char * data, size_t size, bool last)> Receiver;
+
+					/** The TCP socket owns the file descriptor **/
+					virtual ~Socket() {m_sfd = -1; m_file = NULL;}
 					
 					// override virtual functions of Foxbox::Socket
+					/** Send a text message **/
 					virtual bool Send(const char * message, ...);
 					virtual bool GetToken(std::string & buffer, 
 						const char * delims = " \t\r\n", double timeout=-1, 
 						bool inclusive=false);
 					virtual bool Get(std::string & buffer, size_t num_chars, double timeout = -1);
 					virtual bool Valid();
-					inline bool Send(const std::string & buffer) {return Send(buffer.c_str());}
-					virtual void Close() {m_tcp_socket.Close();}
+					inline bool Send(const std::string & buffer) {return SendFrame(TEXT, buffer.data(), buffer.size());}
+					/** Close the TCP connection without a closing handshake **/
+					virtual void Close() {m_valid = false; m_tcp_socket.Close();}
 					
 					TCP::Socket & TCP() {return m_tcp_socket;}
 
-					/** Get message in its entirity **/
-					bool GetMessage(std::string & buffer, double timeout=-1);
+					/** Send one frame (fin false for all but the last frame of a message) **/
+					bool SendFrame(Opcode opcode, const void * data, size_t size, bool fin = true);
+					bool SendBinary(const void * data, size_t size) {return SendFrame(BINARY, data, size);}
+					/**
+					 * Send everything read from input (until EOF) as one message, in
+					 * 	frames of fragment bytes, so it needn't fit in memory
+					 * Wrap a file with Foxbox::Socket(FILE*) to send it.
+					 */
+					bool SendStream(Opcode opcode, Foxbox::Socket & input, size_t fragment = WEBSOCKET_FRAGMENT);
+					/** Send a ping (the reply is handled by GetMessage) **/
+					bool Ping(const void * data = NULL, size_t size = 0) {return SendFrame(PING, data, size);}
+					/**
+					 * Closing handshake: send a close frame, wait (up to timeout) for the
+					 * 	peer's, then close the TCP connection
+					 */
+					bool Close(unsigned code, const StringRef & reason = StringRef(), double timeout = 1);
+
+					/**
+					 * Get message in its entirity
+					 * Pings are answered and a close frame answered and the connection
+					 * 	closed while waiting for it.
+					 * @param opcode Set to TEXT or BINARY
+					 */
+					bool GetMessage(std::string & buffer, double timeout=-1, Opcode * opcode = NULL);
+					/**
+					 * Get a message without copying it (unless it was fragmented)
+					 * @param message Valid until the next call to receive from this socket
+					 */
+					bool GetMessage(StringRef & message, double timeout=-1, Opcode * opcode = NULL);
+					/**
+					 * Get a message a piece at a time, as it arrives (no size limit, and
+					 * 	frames are not buffered whole)
+					 * If receiver returns false the rest of the message is discarded.
+					 */
+					bool GetStream(const Receiver & receiver, double timeout=-1, Opcode * opcode = NULL);
+					/** Largest message GetMessage accepts (larger ones close with 1009) **/
+					void MaxMessage(size_t max_message) {m_parser.MaxMessage(max_message);}
+					/** Close with 1007 if text that isn't UTF-8 is received (on by default) **/
+					void Validation(bool validate) {m_parser.Validation(validate);}
+					/** Status code of the close frame received (CLOSE_ABNORMAL if none) **/
+					unsigned CloseCode() const {return m_close_code;}
 					
 					
 				protected:
@@ -60,15 +127,35 @@ namespace Foxbox
 					/** Sending/Receing uses this TCP socket **/
 					TCP::Socket & m_tcp_socket; 
 					bool m_use_mask;
+					Random m_random; /** Masking keys **/
 					bool m_valid;
 					std::string m_send_buffer;
-					std::string m_recv_buffer;
+					FrameParser m_parser;
+					DeflateConfig m_deflate_config; /** What to agree to (disabled unless set) **/
+					std::unique_ptr<Deflate> m_deflate; /** Set if permessage-deflate was agreed **/
+					std::string m_compressed; /** The message being sent, compressed **/
+					std::string m_inflated; /** The message (or piece) received, decompressed **/
 					std::stringstream m_recv_tokeniser;
+					std::string m_fragment; /** Used by SendStream **/
+					bool m_close_sent;
+					unsigned m_close_code;
 					
 				private:
 					/** Other constructors wrap to this **/
 					Socket(TCP::Socket & tcp_socket, bool use_mask);
-					bool GetMessage(double timeout=-1);
+					bool GetMessage(double timeout=-1, Opcode * opcode = NULL);
+					/** Wait (up to timeout) for bytes and read what has arrived into m_parser **/
+					bool Receive(double timeout);
+					/** The next message (or piece), answering control frames on the way **/
+					FrameParser::Result Next(FrameParser::Message & message, double timeout);
+					/** Answer a control frame @returns false if the connection closed **/
+					bool Control(const FrameParser::Message & message);
+					/** Decompress a message (or piece) in place of the original @returns false if the connection failed **/
+					bool Inflate(FrameParser::Message & message);
+					/** Send a close frame, if one hasn't been sent **/
+					void SendClose(unsigned code, const StringRef & reason = StringRef());
+					/** Close because the peer broke the protocol **/
+					void Fail(unsigned code);
 			};		
 			
 			/** A WebSocket Server **/
@@ -79,6 +166,8 @@ namespace Foxbox
 					Server(const Server & cpy);
 					virtual ~Server() {}
 					bool Listen();
+					/** Agree to permessage-deflate if a client offers it (from the next Listen) **/
+					void Compression(const DeflateConfig & config) {m_deflate_config = config;}
 				private:
 					TCP::Server m_server;
 			};
@@ -87,8 +176,9 @@ namespace Foxbox
 			class Client : public WS::Socket
 			{
 				public:
+					/** @param deflate Offer permessage-deflate (NULL not to) **/
 					Client(const char * server_addr, int port, 
-						const char * query, const char * proto);
+						const char * query, const char * proto, const DeflateConfig * deflate = NULL);
 					virtual ~Client() {}
 				private:
 					TCP::Client m_client;
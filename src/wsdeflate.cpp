@@ -0,0 +1,325 @@
+/**
+ * @file wsdeflate.cpp
+ * @brief WebSocket permessage-deflate compression - Definitions
+ * @see wsdeflate.h - Declarations
+ */
+
+#include "wsdeflate.h"
+#include "wsframe.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+namespace Foxbox {namespace WS
+{
+
+/** zlib's state, besides the windows and hash tables **/
+#define WSDEFLATE_OVERHEAD (16 << 10)
+/** Decompressed bytes to make room for at first **/
+#define WSDEFLATE_CHUNK 16384
+
+/** deflate's hash table shrinks with its window **/
+static int MemLevel(int bits)
+{
+	return max(1, min(8, bits - 7));
+}
+
+/** Bytes zlib allocates for a connection (see zconf.h) **/
+static size_t Memory(const DeflateParams & params)
+{
+	return ((size_t)1 << (params.send_bits + 2)) + ((size_t)1 << (MemLevel(params.send_bits) + 9))
+		+ ((size_t)1 << params.receive_bits) + WSDEFLATE_OVERHEAD;
+}
+
+/**
+ * Shrink the windows until they fit in the memory allowed
+ * The compressor's is bigger for its size, so it goes first. zlib can't
+ * 	compress with a 256 byte window, so neither goes below 512.
+ */
+static void Fit(const DeflateConfig & config, DeflateParams & params, bool limit_receive)
+{
+	while (Memory(params) > config.max_memory)
+	{
+		if (params.send_bits > 9 && (!limit_receive || params.send_bits + 2 >= params.receive_bits))
+			--params.send_bits;
+		else if (limit_receive && params.receive_bits > 9)
+			--params.receive_bits;
+		else
+			break;
+	}
+}
+
+static string Trim(const string & s)
+{
+	size_t start = s.find_first_not_of(" \t");
+	if (start == string::npos)
+		return string();
+	return s.substr(start, s.find_last_not_of(" \t") + 1 - start);
+}
+
+static vector<string> Split(const string & s, char delim)
+{
+	vector<string> parts;
+	size_t start = 0;
+	while (start <= s.size())
+	{
+		size_t end = min(s.find(delim, start), s.size());
+		parts.push_back(Trim(s.substr(start, end - start)));
+		start = end + 1;
+	}
+	return parts;
+}
+
+/** An extension and its parameters: name; a; b=c **/
+struct Extension
+{
+	Extension(const string & s) : name(), params()
+	{
+		vector<string> parts(Split(s, ';'));
+		name = parts[0];
+		for (size_t i = 1; i < parts.size(); ++i)
+		{
+			size_t equals = parts[i].find('=');
+			string value = (equals == string::npos) ? string() : Trim(parts[i].substr(equals + 1));
+			if (value.size() >= 2 && value[0] == '"' && value[value.size()-1] == '"')
+				value = value.substr(1, value.size() - 2);
+			params.push_back(make_pair(Trim(parts[i].substr(0, equals)), value));
+		}
+	}
+	/** Each parameter may appear once (RFC 7692 7) **/
+	bool Unique() const
+	{
+		for (size_t i = 0; i < params.size(); ++i)
+		{
+			for (size_t j = 0; j < i; ++j)
+			{
+				if (params[i].first == params[j].first)
+					return false;
+			}
+		}
+		return true;
+	}
+	string name;
+	vector<pair<string, string> > params;
+};
+
+/** Parse a window size (8 to 15) **/
+static bool Bits(const string & value, int & bits)
+{
+	if (value.empty() || value.size() > 2 || value.find_first_not_of("0123456789") != string::npos)
+		return false;
+	bits = atoi(value.c_str());
+	return bits >= 8 && bits <= 15;
+}
+
+bool Deflate::Negotiate(const StringRef & offers, const DeflateConfig & config, DeflateParams & params,
+	string & response)
+{
+	if (!config.enabled)
+		return false;
+	for (auto & offer : Split(offers.str(), ','))
+	{
+		Extension extension(offer);
+		if (extension.name != "permessage-deflate" || !extension.Unique())
+			continue;
+		DeflateParams p;
+		bool valid = true;
+		bool limit_send = false;
+		bool limit_receive = false;
+		for (auto & param : extension.params)
+		{
+			if (param.first == "server_no_context_takeover" && param.second.empty())
+				p.send_no_context = true;
+			else if (param.first == "client_no_context_takeover" && param.second.empty())
+				p.receive_no_context = true;
+			else if (param.first == "server_max_window_bits")
+				valid = valid && (limit_send = Bits(param.second, p.send_bits));
+			else if (param.first == "client_max_window_bits")
+				valid = valid && (limit_receive = (param.second.empty() || Bits(param.second, p.receive_bits)));
+			else
+				valid = false;
+		}
+		// zlib can't keep to a 256 byte window
+		if (!valid || p.send_bits < 9)
+			continue;
+		p.send_bits = min(p.send_bits, config.max_window_bits);
+		if (limit_receive)
+			p.receive_bits = min(p.receive_bits, config.max_window_bits);
+		if (!config.context_takeover)
+			p.send_no_context = p.receive_no_context = true;
+		Fit(config, p, limit_receive);
+
+		response = "permessage-deflate";
+		if (p.send_no_context)
+			response += "; server_no_context_takeover";
+		if (p.receive_no_context)
+			response += "; client_no_context_takeover";
+		if (limit_send)
+			response += "; server_max_window_bits=" + to_string(p.send_bits);
+		if (limit_receive)
+			response += "; client_max_window_bits=" + to_string(p.receive_bits);
+		params = p;
+		return true;
+	}
+	return false;
+}
+
+/** What a client asks for **/
+static DeflateParams Requested(const DeflateConfig & config)
+{
+	DeflateParams p;
+	p.send_bits = p.receive_bits = config.max_window_bits;
+	p.send_no_context = p.receive_no_context = !config.context_takeover;
+	Fit(config, p, true);
+	return p;
+}
+
+string Deflate::Offer(const DeflateConfig & config)
+{
+	DeflateParams p(Requested(config));
+	string offer("permessage-deflate; client_max_window_bits");
+	if (p.receive_bits < 15)
+		offer += "; server_max_window_bits=" + to_string(p.receive_bits);
+	if (!config.context_takeover)
+		offer += "; server_no_context_takeover; client_no_context_takeover";
+	return offer;
+}
+
+bool Deflate::Accept(const StringRef & response, const DeflateConfig & config, DeflateParams & params)
+{
+	DeflateParams p(Requested(config));
+	int offered = p.receive_bits;
+	// Unless the server says otherwise it may use any window
+	p.receive_bits = 15;
+	vector<string> extensions(Split(response.str(), ','));
+	Extension extension(extensions[0]);
+	if (extensions.size() != 1 || extension.name != "permessage-deflate" || !extension.Unique())
+		return false;
+	for (auto & param : extension.params)
+	{
+		int bits = 15;
+		if (param.first == "server_no_context_takeover" && param.second.empty())
+			p.receive_no_context = true;
+		else if (param.first == "client_no_context_takeover" && param.second.empty())
+			p.send_no_context = true;
+		else if (param.first == "server_max_window_bits" && Bits(param.second, bits) && bits <= offered)
+			p.receive_bits = bits;
+		else if (param.first == "client_max_window_bits" && Bits(param.second, bits) && bits >= 9)
+			p.send_bits = min(p.send_bits, bits);
+		else
+			return false;
+	}
+	params = p;
+	return true;
+}
+
+Deflate::Deflate(const DeflateParams & params, const DeflateConfig & config) : m_params(params), m_config(config),
+	m_deflate(), m_inflate(), m_deflating(false), m_inflating(false)
+{
+
+}
+
+Deflate::~Deflate()
+{
+	if (m_deflating)
+		deflateEnd(&m_deflate);
+	if (m_inflating)
+		inflateEnd(&m_inflate);
+}
+
+bool Deflate::Compress(const void * data, size_t size, string & out)
+{
+	if (!m_deflating)
+	{
+		memset(&m_deflate, 0, sizeof(m_deflate));
+		if (deflateInit2(&m_deflate, m_config.level, Z_DEFLATED, -m_params.send_bits, MemLevel(m_params.send_bits),
+			Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			Error("Couldn't initialise deflate - %s", m_deflate.msg ? m_deflate.msg : "?");
+			return false;
+		}
+		m_deflating = true;
+	}
+	// Room for the flush as well
+	out.resize(deflateBound(&m_deflate, size) + 16);
+	m_deflate.next_in = (Bytef*)data;
+	m_deflate.avail_in = size;
+	size_t used = 0;
+	while (true)
+	{
+		m_deflate.next_out = (Bytef*)&out[used];
+		m_deflate.avail_out = out.size() - used;
+		int result = deflate(&m_deflate, Z_SYNC_FLUSH);
+		used = out.size() - m_deflate.avail_out;
+		if (result != Z_OK && result != Z_BUF_ERROR)
+		{
+			Error("Error compressing - %s", m_deflate.msg ? m_deflate.msg : "?");
+			return false;
+		}
+		if (m_deflate.avail_out > 0)
+			break;
+		out.resize(2 * out.size());
+	}
+	// The flush ends with an empty block, which the receiver puts back (RFC 7692 7.2.1)
+	if (used >= 4 && memcmp(&out[used - 4], "\0\0\xff\xff", 4) == 0)
+		used -= 4;
+	out.resize(used);
+	if (m_params.send_no_context)
+		deflateReset(&m_deflate);
+	return true;
+}
+
+unsigned Deflate::Decompress(const void * data, size_t size, bool last, string & out, size_t limit)
+{
+	if (!m_inflating)
+	{
+		memset(&m_inflate, 0, sizeof(m_inflate));
+		// A bigger window than the peer's does no harm (and zlib wants 512 bytes at least)
+		if (inflateInit2(&m_inflate, -max(m_params.receive_bits, 9)) != Z_OK)
+		{
+			Error("Couldn't initialise inflate - %s", m_inflate.msg ? m_inflate.msg : "?");
+			return CLOSE_UNEXPECTED;
+		}
+		m_inflating = true;
+	}
+	static const uint8_t tail[4] = {0x00, 0x00, 0xff, 0xff};
+	for (unsigned part = 0; part < (last ? 2u : 1u); ++part)
+	{
+		m_inflate.next_in = (Bytef*)((part == 0) ? data : tail);
+		m_inflate.avail_in = (part == 0) ? size : sizeof(tail);
+		do
+		{
+			// One byte more than the limit shows that it was exceeded
+			size_t used = out.size();
+			size_t room = max(used, (size_t)WSDEFLATE_CHUNK);
+			if (limit - used < room)
+				room = limit - used + 1;
+			out.resize(used + room);
+			m_inflate.next_out = (Bytef*)&out[used];
+			m_inflate.avail_out = room;
+			int result = inflate(&m_inflate, Z_SYNC_FLUSH);
+			out.resize(used + room - m_inflate.avail_out);
+			if (out.size() > limit)
+				return CLOSE_TOO_BIG;
+			if (result == Z_STREAM_END)
+			{
+				// The peer finished the stream (BFINAL); what follows starts a new one
+				inflateReset(&m_inflate);
+				continue;
+			}
+			if (result == Z_BUF_ERROR && m_inflate.avail_out > 0)
+				break;
+			if (result != Z_OK && result != Z_BUF_ERROR)
+				return CLOSE_INVALID_DATA;
+		} while (m_inflate.avail_in > 0 || m_inflate.avail_out == 0);
+	}
+	if (last && m_params.receive_no_context)
+		inflateReset(&m_inflate);
+	return 0;
+}
+
+}}
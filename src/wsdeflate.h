@@ -0,0 +1,101 @@
+/**
+ * @file wsdeflate.h
+ * @brief WebSocket permessage-deflate compression - Declarations
+ * @see wsdeflate.cpp - Definitions
+ * @see RFC-7692 http://tools.ietf.org/html/rfc7692
+ */
+
+#ifndef _WSDEFLATE_H
+#define _WSDEFLATE_H
+
+#include <string>
+#include <zlib.h>
+
+#include "stringref.h"
+
+namespace Foxbox
+{
+	namespace WS
+	{
+		/** Messages smaller than this are sent uncompressed by default **/
+		#define WSDEFLATE_THRESHOLD 256
+		/** Default memory for one connection's compressor and decompressor **/
+		#define WSDEFLATE_MAX_MEMORY (320 << 10)
+
+		/** What an endpoint will agree to; the same for all its connections **/
+		struct DeflateConfig
+		{
+			DeflateConfig() : enabled(true), max_window_bits(15), max_memory(WSDEFLATE_MAX_MEMORY),
+				threshold(WSDEFLATE_THRESHOLD), level(6), context_takeover(true) {}
+			bool enabled;
+			/** Largest sliding window, as a power of 2 (9 to 15) **/
+			int max_window_bits;
+			/** For both directions of a connection; windows are shrunk to fit **/
+			size_t max_memory;
+			/** Smaller messages are sent uncompressed **/
+			size_t threshold;
+			/** zlib compression level (1 to 9) **/
+			int level;
+			/** Compress each message with the window left by those before (in both directions) **/
+			bool context_takeover;
+		};
+
+		/** What was agreed for a connection, from this end's point of view **/
+		struct DeflateParams
+		{
+			DeflateParams() : send_bits(15), receive_bits(15), send_no_context(false), receive_no_context(false) {}
+			int send_bits; /** Window of our compressor **/
+			int receive_bits; /** Window of the peer's compressor **/
+			bool send_no_context; /** Reset our compressor after each message **/
+			bool receive_no_context; /** The peer resets its compressor after each message **/
+		};
+
+		/**
+		 * One connection's compressor and decompressor
+		 * Each message is compressed to the end of a sync flush, without the
+		 * 	trailing 00 00 ff ff; the decompressor puts it back. The zlib streams
+		 * 	are only allocated once used, so a connection that only exchanges
+		 * 	small messages costs nothing.
+		 * Not thread safe.
+		 */
+		class Deflate
+		{
+			public:
+				Deflate(const DeflateParams & params, const DeflateConfig & config);
+				virtual ~Deflate();
+
+				/** Server: choose from the client's Sec-WebSocket-Extensions @returns false if nothing acceptable was offered **/
+				static bool Negotiate(const StringRef & offers, const DeflateConfig & config, DeflateParams & params,
+					std::string & response);
+				/** Client: the Sec-WebSocket-Extensions to offer **/
+				static std::string Offer(const DeflateConfig & config);
+				/** Client: check the server's Sec-WebSocket-Extensions @returns false if the connection must fail **/
+				static bool Accept(const StringRef & response, const DeflateConfig & config, DeflateParams & params);
+
+				/** Is a message this big worth compressing **/
+				bool Wanted(size_t size) const {return size >= m_config.threshold;}
+				/** Compress a whole message into out @returns false on error **/
+				bool Compress(const void * data, size_t size, std::string & out);
+				/**
+				 * Decompress part of a message, appending to out
+				 * @param last The end of the message
+				 * @param limit Largest out may grow to
+				 * @returns 0, or the close code to fail the connection with
+				 */
+				unsigned Decompress(const void * data, size_t size, bool last, std::string & out, size_t limit);
+
+			private:
+				Deflate(const Deflate & cpy) = delete;
+				Deflate & operator=(const Deflate & cpy) = delete;
+
+				DeflateParams m_params;
+				DeflateConfig m_config;
+				z_stream m_deflate;
+				z_stream m_inflate;
+				bool m_deflating; /** m_deflate is initialised **/
+				bool m_inflating;
+		};
+	}
+}
+
+#endif //_WSDEFLATE_H
@@ -0,0 +1,601 @@
+/**
+ * @file wsframe.cpp
+ * @brief WebSocket framing primitives - Definitions
+ * @see wsframe.h - Declarations
+ */
+
+#include "wsframe.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define WSFRAME_AVX2
+#endif
+
+using namespace std;
+
+namespace Foxbox {namespace WS
+{
+
+size_t DecodeHeader(const uint8_t * data, size_t available, Header & header)
+{
+	if (available < 2 || available < HeaderSize(data))
+		return 0;
+	header.fin = (data[0] & 0x80) != 0;
+	header.rsv = (data[0] >> 4) & 0x7;
+	header.opcode = data[0] & 0xf;
+	header.masked = (data[1] & 0x80) != 0;
+	header.size = data[1] & 0x7f;
+	size_t i = 2;
+	if (header.size >= 126)
+	{
+		unsigned bytes = (header.size == 126) ? 2 : 8;
+		header.size = 0;
+		for (unsigned j = 0; j < bytes; ++j)
+			header.size = (header.size << 8) | data[i++];
+	}
+	header.key = 0;
+	if (header.masked)
+	{
+		memcpy(&header.key, data + i, sizeof(header.key));
+		i += sizeof(header.key);
+	}
+	return i;
+}
+
+size_t EncodeHeader(uint8_t * out, const Header & header)
+{
+	out[0] = (header.fin ? 0x80 : 0) | ((header.rsv & 0x7) << 4) | (header.opcode & 0xf);
+	out[1] = header.masked ? 0x80 : 0;
+	size_t i = 2;
+	if (header.size < 126)
+		out[1] |= header.size;
+	else
+	{
+		unsigned bytes = (header.size <= 0xffff) ? 2 : 8;
+		out[1] |= (bytes == 2) ? 126 : 127;
+		for (unsigned j = 0; j < bytes; ++j)
+			out[i++] = header.size >> (8 * (bytes - 1 - j));
+	}
+	if (header.masked)
+	{
+		memcpy(out + i, &header.key, sizeof(header.key));
+		i += sizeof(header.key);
+	}
+	return i;
+}
+
+FrameParser::FrameParser(bool masked, size_t max_message) : m_masked(masked), m_max_message(max_message),
+	m_compression(false), m_streaming(false), m_validate(true), m_utf8(), m_buffer(), m_start(0), m_end(0), m_message(), m_joined(),
+	m_type(CONTINUATION), m_compressed(false), m_header(),
+	m_in_frame(false), m_done(0), m_failure(0)
+{
+
+}
+
+void FrameParser::Reset()
+{
+	m_start = m_end = 0;
+	m_message.clear();
+	m_type = CONTINUATION;
+	m_in_frame = false;
+	m_failure = 0;
+	m_compression = false;
+	m_utf8.Reset();
+}
+
+char * FrameParser::Space(size_t size)
+{
+	if (m_end + size > m_buffer.size())
+	{
+		// Reclaim what was consumed before growing
+		if (m_start > 0)
+		{
+			memmove(&m_buffer[0], &m_buffer[m_start], m_end - m_start);
+			m_end -= m_start;
+			m_start = 0;
+		}
+		if (m_end + size > m_buffer.size())
+			m_buffer.resize(max(m_end + size, 2 * m_buffer.size()));
+	}
+	return &m_buffer[m_end];
+}
+
+void FrameParser::Append(const void * data, size_t size)
+{
+	memcpy(Space(size), data, size);
+	Received(size);
+}
+
+unsigned FrameParser::Check(const Header & header) const
+{
+	// RSV1 may only mark the first frame of a data message
+	unsigned rsv1 = (m_compression && !header.Control() && header.opcode != CONTINUATION) ? 0x4 : 0;
+	if (header.masked != m_masked || (header.rsv & ~rsv1) != 0)
+		return CLOSE_PROTOCOL_ERROR;
+	// The most significant bit of a 64 bit length must be 0 (RFC 6455 5.2)
+	if ((header.size >> 63) != 0)
+		return CLOSE_PROTOCOL_ERROR;
+	if (header.Control())
+	{
+		if (header.opcode > PONG || !header.fin || header.size > WSFRAME_MAX_CONTROL)
+			return CLOSE_PROTOCOL_ERROR;
+		return 0;
+	}
+	if (header.opcode > BINARY || (header.opcode == CONTINUATION) != (m_type != CONTINUATION))
+		return CLOSE_PROTOCOL_ERROR;
+	// Subtracted rather than added, so a huge length can't wrap around
+	if (!m_streaming && (m_message.size() > m_max_message || header.size > m_max_message - m_message.size()))
+		return CLOSE_TOO_BIG;
+	return 0;
+}
+
+bool FrameParser::CheckText(const char * data, size_t size, bool last)
+{
+	bool valid = m_utf8.Update(data, size) && (!last || m_utf8.Complete());
+	if (last)
+		m_utf8.Reset();
+	return valid;
+}
+
+bool FrameParser::CheckInflated(const Message & message)
+{
+	return !m_validate || message.opcode != TEXT || CheckText(message.data, message.size, message.last);
+}
+
+FrameParser::Result FrameParser::Next(Message & message)
+{
+	if (m_failure != 0)
+		return FAILED;
+	// Views returned by the last call are finished with
+	if (m_start == m_end)
+	{
+		m_start = m_end = 0;
+		if (m_buffer.size() > WSFRAME_KEEP_BUFFER)
+			std::string().swap(m_buffer);
+	}
+	while (!m_in_frame)
+	{
+		uint8_t * p = (uint8_t*)&m_buffer[m_start];
+		size_t header_size = DecodeHeader(p, m_end - m_start, m_header);
+		if (header_size == 0)
+			return MORE;
+		unsigned failure = Check(m_header);
+		if (failure != 0)
+			return Fail(failure);
+		bool control = m_header.Control();
+		if (!control && m_streaming)
+		{
+			if (m_type == CONTINUATION)
+			{
+				m_type = m_header.opcode;
+				m_compressed = (m_header.rsv & 0x4) != 0;
+			}
+			m_start += header_size;
+			m_in_frame = true;
+			m_done = 0;
+			break;
+		}
+		// The whole frame, unmasked in place
+		// (Checked again, from scratch, until it is all here)
+		if (m_header.size > m_end - m_start - header_size)
+			return MORE;
+		char * payload = (char*)p + header_size;
+		if (m_header.masked)
+			Mask(payload, m_header.size, m_header.key);
+		m_start += header_size + m_header.size;
+		if (!control && m_type == CONTINUATION)
+		{
+			m_type = m_header.opcode;
+			m_compressed = (m_header.rsv & 0x4) != 0;
+		}
+		message.opcode = control ? m_header.opcode : m_type;
+		message.last = true;
+		message.compressed = !control && m_compressed;
+		if (control)
+		{
+			// A close frame's reason is text too
+			if (m_validate && m_header.opcode == CLOSE && m_header.size > 2
+				&& !ValidUTF8(payload + 2, m_header.size - 2))
+				return Fail(CLOSE_INVALID_DATA);
+			message.data = payload;
+			message.size = m_header.size;
+			return CONTROL;
+		}
+		if (m_validate && m_type == TEXT && !m_compressed && !CheckText(payload, m_header.size, m_header.fin))
+			return Fail(CLOSE_INVALID_DATA);
+		if (m_header.fin && m_message.empty())
+		{
+			// The usual case: the message is one frame, and is returned where it is
+			message.data = payload;
+			message.size = m_header.size;
+			m_type = CONTINUATION;
+			return MESSAGE;
+		}
+		m_message.append(payload, m_header.size);
+		if (m_header.fin)
+		{
+			// Kept until the next message is joined, and m_message's buffer reused
+			m_joined.swap(m_message);
+			m_message.clear();
+			message.data = m_joined.data();
+			message.size = m_joined.size();
+			m_type = CONTINUATION;
+			return MESSAGE;
+		}
+	}
+
+	// Streaming: whatever of the frame's payload has arrived
+	uint64_t left = m_header.size - m_done;
+	size_t size = min((uint64_t)(m_end - m_start), left);
+	if (size == 0 && left > 0)
+		return MORE;
+	char * payload = &m_buffer[m_start];
+	if (m_header.masked)
+		Mask(payload, size, m_header.key, m_done);
+	m_start += size;
+	m_done += size;
+	bool last = m_header.fin && m_done == m_header.size;
+	if (m_validate && m_type == TEXT && !m_compressed && !CheckText(payload, size, last))
+		return Fail(CLOSE_INVALID_DATA);
+	message.opcode = m_type;
+	message.data = payload;
+	message.size = size;
+	message.last = last;
+	message.compressed = m_compressed;
+	if (m_done == m_header.size)
+		m_in_frame = false;
+	if (message.last)
+		m_type = CONTINUATION;
+	return PIECE;
+}
+
+#ifdef WSFRAME_AVX2
+/** 32 bytes at a time; the caller checks the CPU has AVX2 @returns bytes masked **/
+__attribute__((target("avx2"))) static size_t MaskAVX2(uint8_t * data, size_t size, uint64_t pattern)
+{
+	const __m256i key = _mm256_set1_epi64x(pattern);
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+		_mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(v, key));
+	}
+	return i;
+}
+#endif
+
+void Mask(void * buffer, size_t size, uint32_t key, size_t offset)
+{
+	uint8_t * data = (uint8_t*)buffer;
+	// Rotate the key so byte 0 of data lines up with byte 0 of the pattern
+	uint8_t k[8];
+	for (unsigned i = 0; i < 8; ++i)
+		k[i] = ((const uint8_t*)&key)[(offset + i) & 3];
+	uint64_t pattern;
+	memcpy(&pattern, k, sizeof(pattern));
+
+	size_t i = 0;
+#ifdef WSFRAME_AVX2
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	if (avx2 && size >= 32)
+		i = MaskAVX2(data, size, pattern);
+#endif
+#ifdef __SSE2__
+	const __m128i wide = _mm_set1_epi64x(pattern);
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+		_mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(v, wide));
+	}
+#endif
+	// i is a multiple of 8 here, so the pattern still lines up
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		word ^= pattern;
+		memcpy(data + i, &word, sizeof(word));
+	}
+	for (; i < size; ++i)
+		data[i] ^= k[i & 7];
+}
+
+/** Take c as the next byte of text **/
+inline bool UTF8Validator::Step(uint8_t c)
+{
+	if (m_need > 0)
+	{
+		if (c < m_low || c > m_high)
+			return false;
+		m_low = 0x80;
+		m_high = 0xbf;
+		--m_need;
+		return true;
+	}
+	if (c < 0x80)
+		return true;
+	if (c < 0xc2 || c > 0xf4)
+		return false;
+	// The second byte's range rules out overlong forms, surrogates and code points past U+10FFFF
+	m_need = (c < 0xe0) ? 1 : (c < 0xf0) ? 2 : 3;
+	m_low = (c == 0xe0) ? 0xa0 : (c == 0xf0) ? 0x90 : 0x80;
+	m_high = (c == 0xed) ? 0x9f : (c == 0xf4) ? 0x8f : 0xbf;
+	return true;
+}
+
+#ifdef WSFRAME_AVX2
+/** What is wrong with a pair of bytes, if anything **/
+enum
+{
+	UTF8_TOO_SHORT = 0x01, /** A lead byte (or ASCII) followed by a lead byte or ASCII **/
+	UTF8_TOO_LONG = 0x02, /** ASCII followed by a continuation byte **/
+	UTF8_OVERLONG_3 = 0x04,
+	UTF8_TOO_LARGE = 0x08, /** Past U+10FFFF **/
+	UTF8_SURROGATE = 0x10,
+	UTF8_OVERLONG_2 = 0x20,
+	UTF8_TOO_LARGE_1000 = 0x40,
+	UTF8_OVERLONG_4 = 0x40,
+	UTF8_TWO_CONTS = 0x80, /** Two continuation bytes; an error unless a 3 or 4 byte lead came first **/
+	UTF8_CARRY = UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS
+};
+
+/** Indexed by the high nibble of the first byte of a pair **/
+static const uint8_t g_utf8_high1[16] = {
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+	UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+	UTF8_TOO_SHORT,
+	UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+	UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+/** Indexed by the low nibble of the first byte **/
+static const uint8_t g_utf8_low1[16] = {
+	UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+	UTF8_CARRY | UTF8_OVERLONG_2,
+	UTF8_CARRY,
+	UTF8_CARRY,
+	UTF8_CARRY | UTF8_TOO_LARGE,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+/** Indexed by the high nibble of the second byte **/
+static const uint8_t g_utf8_high2[16] = {
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+/**
+ * Check 32 bytes at a time, starting between characters
+ * Each byte's errors are looked up with the byte before it; those that can
+ * 	only be told from further back (the third and fourth bytes of a character)
+ * 	are checked by shifting in bytes from the block before.
+ * @param done Set to where checking stopped: the end of the last whole character
+ * @returns false if the text is invalid
+ */
+__attribute__((target("avx2"))) static bool UTF8AVX2(const uint8_t * data, size_t size, size_t & done)
+{
+	const __m256i high1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)g_utf8_high1));
+	const __m256i low1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)g_utf8_low1));
+	const __m256i high2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)g_utf8_high2));
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	// Bytes past these at the end of a block start characters it doesn't finish
+	const __m256i incomplete = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+	__m256i previous = _mm256_setzero_si256();
+	__m256i previous_incomplete = _mm256_setzero_si256();
+	__m256i error = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		__m256i input = _mm256_loadu_si256((const __m256i*)(data + i));
+		if (_mm256_movemask_epi8(input) == 0)
+		{
+			// ASCII; but it mustn't follow a character the last block started
+			error = _mm256_or_si256(error, previous_incomplete);
+		}
+		else
+		{
+			__m256i joined = _mm256_permute2x128_si256(previous, input, 0x21);
+			__m256i prev1 = _mm256_alignr_epi8(input, joined, 15);
+			__m256i prev2 = _mm256_alignr_epi8(input, joined, 14);
+			__m256i prev3 = _mm256_alignr_epi8(input, joined, 13);
+			__m256i special = _mm256_and_si256(
+				_mm256_and_si256(
+					_mm256_shuffle_epi8(high1, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+					_mm256_shuffle_epi8(low1, _mm256_and_si256(prev1, nibble))),
+				_mm256_shuffle_epi8(high2, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+			// Two continuation bytes are right where two or three bytes back is a 3 or 4 byte lead
+			__m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80)));
+			__m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80)));
+			__m256i expected = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+			error = _mm256_or_si256(error, _mm256_xor_si256(expected, special));
+			previous_incomplete = _mm256_subs_epu8(input, incomplete);
+		}
+		if (!_mm256_testz_si256(error, error))
+			return false;
+		previous = input;
+	}
+	// Leave a character the last block didn't finish to be checked with what follows
+	for (size_t back = 1; back <= 3 && back <= i; ++back)
+	{
+		uint8_t c = data[i - back];
+		if (c < 0x80)
+			break;
+		if (c >= 0xc0)
+		{
+			if (back < ((c >= 0xf0) ? 4u : (c >= 0xe0) ? 3u : 2u))
+				i -= back;
+			break;
+		}
+	}
+	done = i;
+	return true;
+}
+#endif
+
+bool UTF8Validator::Update(const void * buffer, size_t size)
+{
+	const uint8_t * data = (const uint8_t*)buffer;
+	size_t i = 0;
+	// Finish a character the last piece started
+	for (; i < size && m_need > 0; ++i)
+	{
+		if (!Step(data[i]))
+			return false;
+	}
+#ifdef WSFRAME_AVX2
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	if (avx2 && size - i >= 32)
+	{
+		size_t done = 0;
+		if (!UTF8AVX2(data + i, size - i, done))
+			return false;
+		i += done;
+	}
+#endif
+	while (i < size)
+	{
+		if (m_need == 0)
+		{
+#ifdef __SSE2__
+			while (i + 16 <= size && _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(data + i))) == 0)
+				i += 16;
+#endif
+			for (; i + 8 <= size; i += 8)
+			{
+				uint64_t word;
+				memcpy(&word, data + i, sizeof(word));
+				if ((word & 0x8080808080808080ULL) != 0)
+					break;
+			}
+			if (i == size)
+				break;
+		}
+		if (!Step(data[i++]))
+			return false;
+	}
+	return true;
+}
+
+bool ValidUTF8(const void * data, size_t size)
+{
+	UTF8Validator validator;
+	return validator.Update(data, size) && validator.Complete();
+}
+
+bool ValidCloseCode(unsigned code)
+{
+	// 1012-1014 were registered with IANA after RFC 6455
+	if (code >= 1000 && code <= 1014)
+		return code != 1004 && code != CLOSE_NO_STATUS && code != CLOSE_ABNORMAL;
+	return code >= 3000 && code <= 4999;
+}
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8); \
+	c += d; b ^= c; b = ROTL(b, 7);
+
+/** "expand 32-byte k" **/
+static const uint32_t g_sigma[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+
+Random::Random(Seed) : m_used(sizeof(m_block) / sizeof(uint32_t))
+{
+	memcpy(m_state, g_sigma, sizeof(g_sigma));
+	bool seeded = false;
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		seeded = (read(fd, m_state + 4, 12 * sizeof(uint32_t)) == 12 * sizeof(uint32_t));
+		close(fd);
+	}
+	if (!seeded)
+	{
+		Error("Couldn't read /dev/urandom - %s; seeding from the clock", StrError(errno));
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		m_state[4] ^= now.tv_sec;
+		m_state[5] ^= now.tv_nsec;
+		m_state[6] ^= getpid();
+	}
+}
+
+Random::Random() : m_used(sizeof(m_block) / sizeof(uint32_t))
+{
+	static thread_local Random seeder((Seed()));
+	memcpy(m_state, g_sigma, sizeof(g_sigma));
+	seeder.Fill(m_state + 4, 12 * sizeof(uint32_t));
+}
+
+Random::~Random()
+{
+	// Don't leave the key lying around
+	memset(m_state, 0, sizeof(m_state));
+	memset(m_block, 0, sizeof(m_block));
+}
+
+void Random::Refill()
+{
+	uint32_t x[16];
+	memcpy(x, m_state, sizeof(x));
+	for (unsigned i = 0; i < 10; ++i)
+	{
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (unsigned i = 0; i < 16; ++i)
+		m_block[i] = x[i] + m_state[i];
+	// 64 bit block counter (words 12 and 13)
+	if (++m_state[12] == 0)
+		++m_state[13];
+	m_used = 0;
+}
+
+void Random::Fill(void * buffer, size_t size)
+{
+	uint8_t * out = (uint8_t*)buffer;
+	while (size > 0)
+	{
+		uint32_t word = Next();
+		size_t n = min(size, sizeof(word));
+		memcpy(out, &word, n);
+		out += n;
+		size -= n;
+	}
+}
+
+}}
@@ -0,0 +1,244 @@
+/**
+ * @file wsframe.h
+ * @brief WebSocket framing primitives - Declarations
+ * @see wsframe.cpp - Definitions
+ * @see websocket.h - WS::Socket frames messages with these
+ * @see RFC-6455 http://tools.ietf.org/html/rfc6455
+ */
+
+#ifndef _WSFRAME_H
+#define _WSFRAME_H
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Foxbox
+{
+	namespace WS
+	{
+		/** Longest frame header: 2 bytes, 8 of extended length and 4 of masking key **/
+		#define WSFRAME_MAX_HEADER 14
+		/** Longest control frame payload **/
+		#define WSFRAME_MAX_CONTROL 125
+		/** Largest message a FrameParser accepts by default **/
+		#define WSFRAME_MAX_MESSAGE (64 << 20)
+		/** A FrameParser keeps a buffer this big when empty; bigger ones are freed **/
+		#define WSFRAME_KEEP_BUFFER (256 << 10)
+
+		enum Opcode {CONTINUATION = 0x0, TEXT = 0x1, BINARY = 0x2, CLOSE = 0x8, PING = 0x9, PONG = 0xA};
+
+		/** Status codes sent in close frames (RFC 6455 7.4.1) **/
+		enum CloseCode
+		{
+			CLOSE_NORMAL = 1000,
+			CLOSE_GOING_AWAY = 1001,
+			CLOSE_PROTOCOL_ERROR = 1002,
+			CLOSE_UNSUPPORTED = 1003,
+			CLOSE_NO_STATUS = 1005, /** Received a close frame without a code (never sent) **/
+			CLOSE_ABNORMAL = 1006, /** Connection dropped without a close frame (never sent) **/
+			CLOSE_INVALID_DATA = 1007,
+			CLOSE_POLICY = 1008,
+			CLOSE_TOO_BIG = 1009,
+			CLOSE_EXTENSION = 1010,
+			CLOSE_UNEXPECTED = 1011
+		};
+		/** May a close frame carry code: those defined (not 1005, 1006, 1015) or 3000 to 4999 (RFC 6455 7.4) **/
+		bool ValidCloseCode(unsigned code);
+
+		/** A frame header **/
+		struct Header
+		{
+			Header() : opcode(0), fin(true), rsv(0), masked(false), key(0), size(0) {}
+			Header(unsigned op, uint64_t s, bool f = true) : opcode(op), fin(f), rsv(0), masked(false), key(0), size(s) {}
+			unsigned opcode;
+			bool fin; /** Last frame of the message **/
+			unsigned rsv; /** RSV1-3 bits (0x4, 0x2, 0x1) **/
+			bool masked;
+			uint32_t key; /** Masking key as it appears in the frame **/
+			uint64_t size; /** Of the payload **/
+
+			bool Control() const {return (opcode & 0x8) != 0;}
+		};
+
+		/** Size of a header from its first two bytes **/
+		inline size_t HeaderSize(const uint8_t * start)
+		{
+			unsigned length = start[1] & 0x7f;
+			return 2 + ((length == 126) ? 2 : (length == 127) ? 8 : 0) + ((start[1] & 0x80) ? 4 : 0);
+		}
+		/** Decode a header @returns its size, or 0 if more than available bytes are needed **/
+		size_t DecodeHeader(const uint8_t * data, size_t available, Header & header);
+		/** Encode a header into out (WSFRAME_MAX_HEADER bytes), lengths in network order @returns its size **/
+		size_t EncodeHeader(uint8_t * out, const Header & header);
+
+		/**
+		 * XOR data with a masking key (RFC 6455 5.3), in place
+		 * Works a 64 bit word at a time, or 16/32 bytes at a time with SSE2/AVX2
+		 * 	(AVX2 is used if the CPU has it, whatever the build flags).
+		 * @param key The 4 key bytes as they appear in the frame (memcpy'd)
+		 * @param offset Bytes of the payload before data (to unmask in pieces)
+		 */
+		void Mask(void * data, size_t size, uint32_t key, size_t offset = 0);
+
+		/**
+		 * Checks that text is UTF-8 (RFC 3629) as it arrives, in any number of pieces
+		 * ASCII is skipped 16 bytes at a time with SSE2. With AVX2 (if the CPU
+		 * 	has it) any text is checked 32 bytes at a time, by looking up the
+		 * 	errors each pair of bytes could make in tables indexed by their nibbles
+		 * 	(Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per
+		 * 	Byte"). A character split between pieces is finished a byte at a time.
+		 */
+		class UTF8Validator
+		{
+			public:
+				UTF8Validator() : m_need(0), m_low(0x80), m_high(0xbf) {}
+				virtual ~UTF8Validator() {}
+
+				/** Check the next piece @returns false if the text is invalid, whatever follows **/
+				bool Update(const void * data, size_t size);
+				/** The text so far ends with a whole character **/
+				bool Complete() const {return m_need == 0;}
+				void Reset() {m_need = 0; m_low = 0x80; m_high = 0xbf;}
+
+			private:
+				bool Step(uint8_t c);
+
+				unsigned m_need; /** Continuation bytes still to come **/
+				uint8_t m_low; /** Range the next continuation byte must be in **/
+				uint8_t m_high;
+		};
+		/** Is data all UTF-8 **/
+		bool ValidUTF8(const void * data, size_t size);
+
+		/**
+		 * Decodes frames from a growable receive buffer
+		 * Receive into Space() (or Append), then call Next() until it wants MORE.
+		 * 	Headers are decoded and payloads unmasked where they lie, and a
+		 * 	message in a single frame is returned as a view of the buffer; only
+		 * 	a fragmented message is copied, to join its fragments. Consumed bytes
+		 * 	are reclaimed by moving what is left to the front when more space is
+		 * 	needed, so one buffer serves the whole connection.
+		 * In streaming mode data frames are returned in PIECEs as they arrive,
+		 * 	whatever their size, rather than as whole messages.
+		 * Every frame is checked against RFC 6455; a bad one FAILs with the close
+		 * 	code to send. Text is checked to be UTF-8 frame by frame, as it is
+		 * 	unmasked, so a bad message fails before the rest of it arrives.
+		 */
+		class FrameParser
+		{
+			public:
+				enum Result
+				{
+					MORE, /** Need more bytes **/
+					MESSAGE, /** A whole data message **/
+					CONTROL, /** A ping, pong or close frame **/
+					PIECE, /** Part of a data message (streaming mode) **/
+					FAILED /** Protocol error; close with Failure() **/
+				};
+				/** Valid until the next call to Next, Space or Append **/
+				struct Message
+				{
+					Message() : opcode(0), data(NULL), size(0), last(true), compressed(false) {}
+					unsigned opcode; /** TEXT, BINARY, or a control opcode **/
+					const char * data;
+					size_t size;
+					bool last; /** The last piece of its message (PIECE) **/
+					bool compressed; /** RSV1 was set on its first frame (permessage-deflate) **/
+				};
+
+				/** @param masked Frames must be masked (parsing what a client sent) **/
+				FrameParser(bool masked, size_t max_message = WSFRAME_MAX_MESSAGE);
+				virtual ~FrameParser() {}
+
+				/** Room for at least size more bytes; receive into it, then call Received **/
+				char * Space(size_t size);
+				void Received(size_t size) {m_end += size;}
+				void Append(const void * data, size_t size);
+
+				Result Next(Message & message);
+
+				/** Close code after FAILED **/
+				unsigned Failure() const {return m_failure;}
+				/** Bytes received but not yet returned **/
+				size_t Buffered() const {return m_end - m_start;}
+				/** Part of a frame or message has arrived **/
+				bool Partial() const {return m_type != CONTINUATION || m_end > m_start;}
+				/** Largest message (not streaming) **/
+				void MaxMessage(size_t max_message) {m_max_message = max_message;}
+				size_t MaxMessage() const {return m_max_message;}
+				/** Allow RSV1 on the first frame of a message (an extension such as permessage-deflate was agreed) **/
+				void Compression(bool allowed) {m_compression = allowed;}
+				void Streaming(bool streaming) {m_streaming = streaming;}
+				/** Check that text is UTF-8 (on by default) **/
+				void Validation(bool validate) {m_validate = validate;}
+				/**
+				 * Check a compressed message (or piece) once decompressed, which Next
+				 * 	can't @returns false if the connection must fail with CLOSE_INVALID_DATA
+				 */
+				bool CheckInflated(const Message & message);
+				/** Forget everything (for a new connection) **/
+				void Reset();
+
+			private:
+				Result Fail(unsigned code) {m_failure = code; return FAILED;}
+				/** Check a header against the protocol @returns 0 or the close code **/
+				unsigned Check(const Header & header) const;
+				/** Check a piece of the text message being received @returns false if it isn't UTF-8 **/
+				bool CheckText(const char * data, size_t size, bool last);
+
+				bool m_masked;
+				size_t m_max_message;
+				bool m_compression;
+				bool m_streaming;
+				bool m_validate;
+				UTF8Validator m_utf8; /** Of the text message being received **/
+				std::string m_buffer;
+				size_t m_start; /** Next byte to decode **/
+				size_t m_end; /** End of received bytes **/
+				std::string m_message; /** Fragments joined so far **/
+				std::string m_joined; /** The last message joined (returned as a view) **/
+				unsigned m_type; /** Opcode of the message being received (CONTINUATION between messages) **/
+				bool m_compressed; /** The message being received is **/
+				Header m_header; /** Of the frame being streamed **/
+				bool m_in_frame; /** Streaming a frame's payload **/
+				uint64_t m_done; /** Bytes of the streamed frame's payload returned **/
+				unsigned m_failure;
+		};
+
+		/**
+		 * ChaCha20 keystream; unpredictable numbers (for masking keys) cheaply
+		 * Each generator is seeded from its thread's generator, which is seeded
+		 * 	once from /dev/urandom, so constructing one makes no system calls.
+		 * Not thread safe; give each connection (or thread) its own.
+		 */
+		class Random
+		{
+			public:
+				Random();
+				virtual ~Random();
+
+				uint32_t Next()
+				{
+					if (m_used == sizeof(m_block) / sizeof(uint32_t))
+						Refill();
+					return m_block[m_used++];
+				}
+				/** Fill buffer with random bytes **/
+				void Fill(void * buffer, size_t size);
+
+			private:
+				struct Seed {};
+				/** Seed from /dev/urandom (only the per thread generator does this) **/
+				Random(Seed);
+				/** Generate the next block of keystream **/
+				void Refill();
+
+				uint32_t m_state[16];
+				uint32_t m_block[16];
+				unsigned m_used; /** Words of m_block already returned **/
+		};
+	}
+}
+
+#endif //_WSFRAME_H
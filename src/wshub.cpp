@@ -0,0 +1,130 @@
+/**
+ * @file wshub.cpp
+ * @brief Publish/subscribe for WebSocket sessions - Definitions
+ * @see wshub.h - Declarations
+ */
+
+#include "wshub.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace Foxbox {namespace WS
+{
+
+Hub::Hub(size_t limit) : m_limit(limit), m_dropped(0), m_mutex(), m_topics(), m_subscriptions(), m_next_id(1)
+{
+
+}
+
+void Hub::Subscribe(const SessionPtr & session, const string & topic, Policy policy)
+{
+	lock_guard<mutex> lock(m_mutex);
+	Topic & t = m_topics[topic];
+	if (t.id == 0)
+		t.id = m_next_id++;
+	SubscriberList * subscribers = t.subscribers ? new SubscriberList(*t.subscribers) : new SubscriberList();
+	for (auto & s : *subscribers)
+	{
+		if (s.session == session)
+		{
+			s.policy = policy;
+			t.subscribers.reset(subscribers);
+			return;
+		}
+	}
+	subscribers->push_back(Subscriber{session, policy});
+	t.subscribers.reset(subscribers);
+	m_subscriptions[session.get()].push_back(topic);
+}
+
+void Hub::Remove(const SessionPtr & session, const string & topic)
+{
+	auto t = m_topics.find(topic);
+	if (t == m_topics.end())
+		return;
+	SubscriberList * subscribers = new SubscriberList(*t->second.subscribers);
+	subscribers->erase(remove_if(subscribers->begin(), subscribers->end(),
+		[&session](const Subscriber & s) {return s.session == session;}), subscribers->end());
+	if (subscribers->empty())
+	{
+		delete subscribers;
+		m_topics.erase(t);
+	}
+	else
+		t->second.subscribers.reset(subscribers);
+}
+
+void Hub::Unsubscribe(const SessionPtr & session, const string & topic)
+{
+	lock_guard<mutex> lock(m_mutex);
+	auto s = m_subscriptions.find(session.get());
+	if (s == m_subscriptions.end())
+		return;
+	auto i = find(s->second.begin(), s->second.end(), topic);
+	if (i == s->second.end())
+		return;
+	s->second.erase(i);
+	if (s->second.empty())
+		m_subscriptions.erase(s);
+	Remove(session, topic);
+}
+
+void Hub::Unsubscribe(const SessionPtr & session)
+{
+	lock_guard<mutex> lock(m_mutex);
+	auto s = m_subscriptions.find(session.get());
+	if (s == m_subscriptions.end())
+		return;
+	for (auto & topic : s->second)
+		Remove(session, topic);
+	m_subscriptions.erase(s);
+}
+
+bool Hub::Find(const string & topic, Topic & found)
+{
+	lock_guard<mutex> lock(m_mutex);
+	auto t = m_topics.find(topic);
+	if (t == m_topics.end())
+		return false;
+	found = t->second;
+	return true;
+}
+
+size_t Hub::Send(const Topic & topic, const Frame & frame)
+{
+	size_t limit = m_limit;
+	size_t sent = 0;
+	for (auto & s : *topic.subscribers)
+	{
+		if (s.session->Send(frame, limit, (s.policy == COALESCE) ? topic.id : 0))
+			++sent;
+	}
+	m_dropped += topic.subscribers->size() - sent;
+	return sent;
+}
+
+size_t Hub::Publish(const string & topic, Opcode opcode, const void * data, size_t size)
+{
+	Topic t;
+	if (!Find(topic, t))
+		return 0;
+	return Send(t, MakeFrame(opcode, data, size));
+}
+
+size_t Hub::Publish(const string & topic, const Frame & frame)
+{
+	Topic t;
+	if (!Find(topic, t))
+		return 0;
+	return Send(t, frame);
+}
+
+size_t Hub::Subscribers(const string & topic)
+{
+	Topic t;
+	return Find(topic, t) ? t.subscribers->size() : 0;
+}
+
+}}
@@ -0,0 +1,103 @@
+/**
+ * @file wshub.h
+ * @brief Publish/subscribe for WebSocket sessions - Declarations
+ * @see wshub.cpp - Definitions
+ * @see wsserver.h - The sessions subscribed
+ */
+
+#ifndef _WSHUB_H
+#define _WSHUB_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "wsserver.h"
+
+namespace Foxbox
+{
+	namespace WS
+	{
+		/** Bytes a subscriber may have queued before it is treated as slow **/
+		#define HUB_LIMIT (1 << 20)
+
+		/**
+		 * Named topics, and messages published to every subscriber of one
+		 * A message is framed once and the Frame shared by every subscriber's
+		 * 	queue, so each subscriber costs a reference count; sessions write
+		 * 	their queues with writev(2).
+		 * A subscriber with more than the limit queued is slow. Under DROP it
+		 * 	misses messages until it catches up; under COALESCE a message replaces
+		 * 	the last one of its topic still queued, so it always gets the latest
+		 * 	(eg: prices) if not every step.
+		 * Thread safe. Subscriber lists are copied when they change, so Publish
+		 * 	only locks to find the topic, and never while queueing.
+		 * Usage: unsubscribe sessions from the EventServer's CloseHandler
+		 */
+		class Hub
+		{
+			public:
+				enum Policy {DROP, COALESCE};
+				typedef EventServer::SessionPtr SessionPtr;
+
+				Hub(size_t limit = HUB_LIMIT);
+				virtual ~Hub() {}
+
+				void Subscribe(const SessionPtr & session, const std::string & topic, Policy policy = DROP);
+				void Unsubscribe(const SessionPtr & session, const std::string & topic);
+				/** From every topic **/
+				void Unsubscribe(const SessionPtr & session);
+
+				/** @returns Subscribers the message was queued for **/
+				size_t Publish(const std::string & topic, Opcode opcode, const void * data, size_t size);
+				size_t Publish(const std::string & topic, const std::string & text)
+				{
+					return Publish(topic, TEXT, text.data(), text.size());
+				}
+				size_t Publish(const std::string & topic, const Frame & frame);
+
+				size_t Subscribers(const std::string & topic);
+				/** Bytes queued before a subscriber is slow **/
+				void Limit(size_t limit) {m_limit = limit;}
+				/** Messages not queued for slow (or closed) subscribers **/
+				uint64_t Dropped() const {return m_dropped;}
+
+			private:
+				Hub(const Hub & cpy) = delete;
+				Hub & operator=(const Hub & cpy) = delete;
+
+				struct Subscriber
+				{
+					SessionPtr session;
+					Policy policy;
+				};
+				typedef std::vector<Subscriber> SubscriberList;
+				struct Topic
+				{
+					Topic() : id(0), subscribers() {}
+					uint64_t id; /** Key for coalescing **/
+					std::shared_ptr<const SubscriberList> subscribers; /** Replaced, never changed **/
+				};
+
+				/** Find a topic's subscribers @returns false if it has none **/
+				bool Find(const std::string & topic, Topic & found);
+				/** Queue frame for each subscriber @returns how many took it **/
+				size_t Send(const Topic & topic, const Frame & frame);
+				/** Remove session from topic (m_mutex held) **/
+				void Remove(const SessionPtr & session, const std::string & topic);
+
+				std::atomic<size_t> m_limit;
+				std::atomic<uint64_t> m_dropped;
+				std::mutex m_mutex;
+				std::unordered_map<std::string, Topic> m_topics;
+				/** Topics each session is subscribed to **/
+				std::unordered_map<EventServer::Session*, std::vector<std::string> > m_subscriptions;
+				uint64_t m_next_id;
+		};
+	}
+}
+
+#endif //_WSHUB_H
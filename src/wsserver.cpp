@@ -0,0 +1,704 @@
+/**
+ * @file wsserver.cpp
+ * @brief Event driven WebSocket server - Definitions
+ * @see wsserver.h - Declarations
+ */
+
+#include "wsserver.h"
+#include "websocket.h"
+#include "timerwheel.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+using namespace std;
+
+namespace Foxbox {namespace WS
+{
+
+/** Bytes read from a connection at a time **/
+#define WSSERVER_READ_SIZE 16384
+/** Largest handshake request accepted **/
+#define WSSERVER_MAX_HEAD 16384
+/** Seconds a connection has to send its handshake **/
+#define WSSERVER_HANDSHAKE_TIMEOUT 10
+/** Seconds the peer has to answer a close frame **/
+#define WSSERVER_CLOSE_TIMEOUT 5
+/** Frames written by one writev(2) **/
+#define WSSERVER_IOV 64
+/** Events a session always waits for **/
+#define WSSERVER_READ_EVENTS (EPOLLIN | EPOLLRDHUP)
+
+typedef EventServer::Session Session;
+
+Frame MakeFrame(Opcode opcode, const void * data, size_t size, unsigned rsv)
+{
+	Header h(opcode, size);
+	h.rsv = rsv;
+	uint8_t header[WSFRAME_MAX_HEADER];
+	size_t header_size = EncodeHeader(header, h);
+	string * frame = new string();
+	frame->reserve(header_size + size);
+	frame->append((const char*)header, header_size);
+	if (size > 0)
+		frame->append((const char*)data, size);
+	return Frame(frame);
+}
+
+Session::Session(EventServer & server, IOThread * io, int fd, uint64_t id) : m_server(server), m_io(io), m_fd(fd),
+	m_id(id), m_watch(NULL), m_timer(), m_ping_timer(), m_ping_sent(0), m_first_ping(0), m_missed(0), m_rtt(-1),
+	m_head(), m_request(), m_protocol(), m_parser(true, server.m_max_message),
+	m_deflate(), m_deflate_mutex(), m_compressed(), m_inflated(), m_open(false), m_reading(true), m_writing(false), m_paused(false), m_batching(false), m_finish(false), m_close_code(CLOSE_ABNORMAL), m_mutex(),
+	m_queue(), m_offset(0), m_in_flight(0), m_flushing(false), m_close_sent(false), m_queued(0)
+{
+	m_peer[0] = '\0';
+	m_parser.Validation(server.m_validate);
+}
+
+Session::~Session()
+{
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+bool Session::Send(Opcode opcode, const void * data, size_t size)
+{
+	if (!m_deflate || (opcode != TEXT && opcode != BINARY) || !m_deflate->Wanted(size))
+		return Queue(MakeFrame(opcode, data, size), false);
+	// Each message is compressed with the window left by the one before, so they must go in that order
+	lock_guard<mutex> lock(m_deflate_mutex);
+	if (!m_deflate->Compress(data, size, m_compressed))
+		return false;
+	return Queue(MakeFrame(opcode, m_compressed.data(), m_compressed.size(), 0x4), false);
+}
+
+void Session::Close(unsigned code, const StringRef & reason)
+{
+	SessionPtr self(shared_from_this());
+	string text(reason);
+	OnLoop([self, code, text]()
+	{
+		if (self->m_fd >= 0 && self->m_open)
+			self->SendClose(code, text);
+	});
+}
+
+void Session::OnLoop(const function<void()> & task)
+{
+	unique_lock<mutex> lock(m_mutex);
+	if (m_io == NULL)
+		return;
+	if (!m_io->loop.InLoop())
+	{
+		m_io->loop.Post(task);
+		return;
+	}
+	lock.unlock();
+	task();
+}
+
+void Session::Readable(uint32_t events)
+{
+	// Handlers may drop the last reference to this session
+	SessionPtr self(shared_from_this());
+	m_batching = true;
+	while (m_fd >= 0 && (events & ~(uint32_t)EPOLLOUT) != 0)
+	{
+		size_t head = m_head.size();
+		char * space;
+		if (m_open)
+			space = m_parser.Space(WSSERVER_READ_SIZE);
+		else
+		{
+			m_head.resize(head + WSSERVER_READ_SIZE);
+			space = &m_head[head];
+		}
+		ssize_t n = recv(m_fd, space, WSSERVER_READ_SIZE, 0);
+		if (!m_open)
+			m_head.resize(head + max(n, (ssize_t)0));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0)
+		{
+			Finish(m_close_code);
+			return;
+		}
+		if (!m_open && m_reading)
+			Handshake();
+		else if (!m_open)
+			m_head.clear(); // Rejected
+		else if (m_reading)
+		{
+			m_parser.Received(n);
+			Dispatch();
+		}
+		// Stop reading from a peer that isn't reading what it is sent
+		if (m_fd >= 0 && m_server.m_max_queued > 0 && m_queued > m_server.m_max_queued)
+		{
+			m_paused = true;
+			Watch();
+			break;
+		}
+		// A short read emptied the socket; don't ask again just to hear EAGAIN
+		if ((size_t)n < WSSERVER_READ_SIZE)
+			break;
+	}
+	m_batching = false;
+	Flush();
+}
+
+void Session::Handshake()
+{
+	size_t head = m_request.Parse(m_head.data(), m_head.size());
+	if (head == 0)
+	{
+		if (m_head.size() > WSSERVER_MAX_HEAD)
+			Reject("400 Bad Request");
+		return;
+	}
+	Answer(m_head.data() + head, m_head.size() - head);
+	string().swap(m_head);
+}
+
+void Session::Answer(const char * rest, size_t size)
+{
+	HTTP::Headers & headers = m_request.Headers();
+	if (!m_request.Valid() || !headers.Get(HTTP::HEADER_UPGRADE).EqualsIgnoreCase("websocket")
+		|| !headers.Has(HTTP::HEADER_SEC_WEBSOCKET_KEY))
+		Reject("400 Bad Request");
+	else if (headers.Get(HTTP::HEADER_SEC_WEBSOCKET_VERSION) != "13")
+		Reject("426 Upgrade Required\r\nSec-WebSocket-Version: 13");
+	else
+		Upgrade(rest, size);
+}
+
+void Session::Reject(const char * status)
+{
+	string response("HTTP/1.1 ");
+	response += status;
+	response += "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	m_reading = false;
+	m_finish = true;
+	Queue(Frame(new string(response)), true);
+}
+
+void Session::Upgrade(const char * rest, size_t size)
+{
+	HTTP::Headers & headers = m_request.Headers();
+	string response("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: ");
+	char accept[WEBSOCKET_ACCEPT_SIZE];
+	Magic(headers.Get(HTTP::HEADER_SEC_WEBSOCKET_KEY), accept);
+	response.append(accept, sizeof(accept));
+	response += "\r\n";
+	// Agree to the client's first choice of subprotocol, if it offered any
+	m_protocol = headers.Get(HTTP::HEADER_SEC_WEBSOCKET_PROTOCOL);
+	m_protocol.resize(min(m_protocol.find(','), m_protocol.size()));
+	if (!m_protocol.empty())
+		response += "Sec-WebSocket-Protocol: " + m_protocol + "\r\n";
+	DeflateParams params;
+	string extensions;
+	if (Deflate::Negotiate(headers.Get(HTTP::HEADER_SEC_WEBSOCKET_EXTENSIONS), m_server.m_deflate_config, params,
+		extensions))
+	{
+		response += "Sec-WebSocket-Extensions: " + extensions + "\r\n";
+		m_deflate.reset(new Deflate(params, m_server.m_deflate_config));
+		m_parser.Compression(true);
+	}
+	response += "\r\n";
+
+	m_io->loop.Cancel(m_timer);
+	m_open = true;
+	++m_server.m_sessions;
+	Queue(Frame(new string(response)), false);
+	// The client may not have waited for the response
+	m_parser.Append(rest, size);
+	if (m_server.m_ping_interval > 0)
+		m_io->loop.Schedule(m_ping_timer, m_server.m_ping_interval, [this]() {Ping();});
+	if (m_server.m_on_open)
+	{
+		try
+		{
+			m_server.m_on_open(shared_from_this());
+		}
+		catch (Exception & e)
+		{
+			Error("Exception %s caught opening %s", e.what(), m_request.Path().c_str());
+			Fail(CLOSE_UNEXPECTED);
+		}
+	}
+	Dispatch();
+}
+
+void Session::Dispatch()
+{
+	SessionPtr self(shared_from_this());
+	FrameParser::Message message;
+	while (m_fd >= 0 && m_reading)
+	{
+		FrameParser::Result result = m_parser.Next(message);
+		if (result == FrameParser::MORE)
+			return;
+		if (result == FrameParser::FAILED)
+		{
+			Fail(m_parser.Failure());
+			return;
+		}
+		if (result == FrameParser::CONTROL)
+		{
+			Control(message);
+			continue;
+		}
+		if (message.compressed)
+		{
+			if (m_inflated.capacity() > WSFRAME_KEEP_BUFFER)
+				string().swap(m_inflated);
+			m_inflated.clear();
+			unsigned failure = m_deflate->Decompress(message.data, message.size, true, m_inflated, m_parser.MaxMessage());
+			if (failure != 0)
+			{
+				Fail(failure);
+				return;
+			}
+			message.data = m_inflated.data();
+			message.size = m_inflated.size();
+			if (!m_parser.CheckInflated(message))
+			{
+				Fail(CLOSE_INVALID_DATA);
+				return;
+			}
+		}
+		if (m_server.m_on_message)
+		{
+			try
+			{
+				m_server.m_on_message(self, (Opcode)message.opcode, StringRef(message.data, message.size));
+			}
+			catch (Exception & e)
+			{
+				Error("Exception %s caught handling a message on %s", e.what(), m_request.Path().c_str());
+				Fail(CLOSE_UNEXPECTED);
+			}
+		}
+	}
+}
+
+void Session::Control(const FrameParser::Message & message)
+{
+	switch (message.opcode)
+	{
+		case PING:
+			Queue(MakeFrame(PONG, message.data, message.size), false);
+			break;
+		case PONG:
+			Pong(message);
+			break;
+		case CLOSE:
+		{
+			m_close_code = CLOSE_NO_STATUS;
+			if (message.size >= 2)
+				m_close_code = ((uint8_t)message.data[0] << 8) | (uint8_t)message.data[1];
+			// A lone byte, or a code that must not be sent, fails the connection
+			if (message.size == 1 || (message.size >= 2 && !ValidCloseCode(m_close_code)))
+				m_close_code = CLOSE_PROTOCOL_ERROR;
+			// Echo the status code (unless this answers ours), and close once it is written
+			m_reading = false;
+			m_finish = true;
+			SendClose((m_close_code == CLOSE_NO_STATUS) ? CLOSE_NORMAL : m_close_code, StringRef());
+			Flush();
+			break;
+		}
+	}
+}
+
+bool Session::Queue(const Frame & frame, bool close, size_t limit, uint64_t key)
+{
+	unique_lock<mutex> lock(m_mutex);
+	if (m_close_sent || m_io == NULL)
+		return false;
+	if (limit > 0 && m_queued > limit)
+	{
+		if (key == 0)
+			return false;
+		// Frames being (or partly) written stay as they are
+		size_t fixed = max(m_in_flight, (size_t)(m_offset > 0));
+		for (size_t i = m_queue.size(); i > fixed; --i)
+		{
+			Pending & pending = m_queue[i - 1];
+			if (pending.key != key)
+				continue;
+			m_queued += frame->size() - pending.frame->size();
+			pending.frame = frame;
+			return true;
+		}
+	}
+	m_close_sent = close;
+	m_queue.push_back(Pending{frame, key});
+	m_queued += frame->size();
+	// One Flush at a time writes everything queued
+	if (m_flushing)
+		return true;
+	m_flushing = true;
+	lock.unlock();
+	// Replies to what is being read are written together, after it
+	if (m_io->loop.InLoop() && m_batching)
+		return true;
+	SessionPtr self(shared_from_this());
+	OnLoop([self]() {self->Flush();});
+	return true;
+}
+
+void Session::Flush()
+{
+	while (m_fd >= 0)
+	{
+		struct iovec iov[WSSERVER_IOV];
+		int count = 0;
+		size_t total = 0;
+		// Other threads only append (or replace frames after these), so the frames stay put while written
+		unique_lock<mutex> lock(m_mutex);
+		for (auto i = m_queue.begin(); i != m_queue.end() && count < WSSERVER_IOV; ++i, ++count)
+		{
+			size_t skip = (count == 0) ? m_offset : 0;
+			iov[count].iov_base = (void*)(i->frame->data() + skip);
+			iov[count].iov_len = i->frame->size() - skip;
+			total += iov[count].iov_len;
+		}
+		if (count == 0)
+		{
+			m_flushing = false;
+			break;
+		}
+		m_in_flight = count;
+		lock.unlock();
+
+		ssize_t written = writev(m_fd, iov, count);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			Finish(CLOSE_ABNORMAL);
+			return;
+		}
+		lock.lock();
+		for (size_t left = max(written, (ssize_t)0); left > 0; )
+		{
+			size_t size = m_queue.front().frame->size();
+			if (left < size - m_offset)
+			{
+				m_offset += left;
+				break;
+			}
+			left -= size - m_offset;
+			m_queued -= size;
+			m_offset = 0;
+			m_queue.pop_front();
+		}
+		m_in_flight = 0;
+		lock.unlock();
+		if (m_paused && m_queued <= m_server.m_max_queued / 2)
+		{
+			m_paused = false;
+			Watch();
+		}
+		if (written < 0 || (size_t)written < total)
+		{
+			// The socket buffer is full; carry on when it drains
+			if (!m_writing)
+			{
+				m_writing = true;
+				Watch();
+			}
+			return;
+		}
+	}
+	if (m_fd < 0)
+		return;
+	if (m_writing)
+	{
+		m_writing = false;
+		Watch();
+	}
+	if (m_finish)
+		Finish(m_close_code);
+}
+
+void Session::Watch()
+{
+	// Errors and hang ups are reported whatever is asked for
+	uint32_t events = m_paused ? 0 : WSSERVER_READ_EVENTS;
+	if (m_writing)
+		events |= EPOLLOUT;
+	m_io->loop.Modify(m_watch, events);
+}
+
+/**
+ * A ping carries the time it was sent, which its pong echoes
+ * One still unanswered when the next is due counts as missed; the peer is
+ * 	dropped without a closing handshake it evidently won't take part in.
+ */
+void Session::Ping()
+{
+	if (m_fd < 0 || !m_reading)
+		return;
+	if (m_ping_sent != 0 && ++m_missed >= m_server.m_max_missed)
+	{
+		Warn("Dropping WebSocket from %s after %u unanswered pings", m_peer, (unsigned)m_missed);
+		Finish(CLOSE_ABNORMAL);
+		return;
+	}
+	m_ping_sent = TimerWheel::Now();
+	if (m_first_ping == 0)
+		m_first_ping = m_ping_sent;
+	Queue(MakeFrame(PING, &m_ping_sent, sizeof(m_ping_sent)), false);
+	m_io->loop.Schedule(m_ping_timer, m_server.m_ping_interval, [this]() {Ping();});
+}
+
+/** Pongs the peer sent unprompted, or that don't carry one of our times, are ignored (RFC 6455 5.5.3) **/
+void Session::Pong(const FrameParser::Message & message)
+{
+	int64_t sent;
+	if (message.size != sizeof(sent))
+		return;
+	memcpy(&sent, message.data, sizeof(sent));
+	if (sent < m_first_ping || sent > m_ping_sent || m_first_ping == 0)
+		return;
+	int64_t rtt = TimerWheel::Now() - sent;
+	// Smoothed like TCP's (RFC 6298)
+	m_rtt = (m_rtt < 0) ? rtt : m_rtt + (rtt - m_rtt) / 8;
+	m_missed = 0;
+	if (sent == m_ping_sent)
+		m_ping_sent = 0;
+}
+
+void Session::Fail(unsigned code)
+{
+	Warn("Closing WebSocket from %s with %u", m_peer, code);
+	m_reading = false;
+	m_finish = true;
+	m_close_code = code;
+	SendClose(code, StringRef());
+	Flush();
+}
+
+void Session::SendClose(unsigned code, const StringRef & reason)
+{
+	uint8_t payload[WSFRAME_MAX_CONTROL];
+	size_t size = min(reason.size(), (size_t)WSFRAME_MAX_CONTROL - 2);
+	payload[0] = code >> 8;
+	payload[1] = code & 0xff;
+	memcpy(payload + 2, reason.data(), size);
+	if (!Queue(MakeFrame(CLOSE, payload, size + 2), true))
+		return;
+	// Don't wait forever for a peer that neither answers nor reads
+	m_io->loop.Schedule(m_timer, WSSERVER_CLOSE_TIMEOUT, [this]() {Finish(m_close_code);});
+}
+
+void Session::Finish(unsigned code)
+{
+	if (m_fd < 0)
+		return;
+	SessionPtr self(shared_from_this());
+	m_io->loop.Cancel(m_timer);
+	m_io->loop.Cancel(m_ping_timer);
+	m_io->loop.Remove(m_watch);
+	close(m_fd);
+	m_fd = -1;
+	m_mutex.lock();
+	m_close_sent = true;
+	m_queue.clear();
+	m_queued = 0;
+	m_offset = 0;
+	m_in_flight = 0;
+	m_mutex.unlock();
+	m_io->sessions.erase(self);
+	if (!m_open)
+		return;
+	--m_server.m_sessions;
+	if (!m_server.m_on_close)
+		return;
+	try
+	{
+		m_server.m_on_close(self, code);
+	}
+	catch (Exception & e)
+	{
+		Error("Exception %s caught closing %s", e.what(), m_request.Path().c_str());
+	}
+}
+
+EventServer::EventServer(int port, unsigned io_threads) : m_port(port), m_io_count(io_threads),
+	m_on_open(), m_on_message(), m_on_close(), m_max_message(WSFRAME_MAX_MESSAGE), m_validate(true),
+	m_ping_interval(0),
+	m_max_missed(3), m_deflate_config(), m_max_queued(WSSERVER_MAX_QUEUED),
+	m_listen_fd(-1), m_io(), m_next_id(1), m_sessions(0), m_running(false), m_mutex(), m_stopped()
+{
+	m_deflate_config.enabled = false;
+	if (m_io_count == 0)
+		m_io_count = max(1u, thread::hardware_concurrency());
+}
+
+EventServer::~EventServer()
+{
+	Stop();
+	Shutdown();
+}
+
+void EventServer::Start()
+{
+	if (!m_io.empty())
+		return;
+	m_running = true;
+	for (unsigned i = 0; i < m_io_count; ++i)
+	{
+		IOThread * io = new IOThread();
+		m_io.push_back(io);
+		io->thread = thread(&EventLoop::Run, &io->loop);
+	}
+	if (m_port < 0)
+		return;
+
+	m_listen_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m_listen_fd < 0)
+		Fatal("Error creating TCP socket - %s", StrError(errno));
+	int tmp = 1;
+	if (setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &tmp, sizeof(tmp)) != 0)
+		Fatal("Error in setsockopt(2) - %s", StrError(errno));
+
+	struct sockaddr_in name;
+	memset(&name, 0, sizeof(name));
+	name.sin_family = AF_INET;
+	name.sin_addr.s_addr = htonl(INADDR_ANY);
+	name.sin_port = htons(m_port);
+	if (bind(m_listen_fd, (struct sockaddr*)&name, sizeof(name)) < 0)
+		Fatal("Error binding socket - %s", StrError(errno));
+	if (listen(m_listen_fd, SOMAXCONN) < 0)
+		Fatal("Error listening - %s", StrError(errno));
+
+	for (auto io : m_io)
+	{
+		if (io->loop.Add(m_listen_fd, EPOLLIN | EPOLLEXCLUSIVE, [this, io](uint32_t) {Accept(io);}) == NULL)
+			Fatal("Couldn't watch listening socket");
+	}
+}
+
+void EventServer::Run()
+{
+	Start();
+	unique_lock<mutex> lock(m_mutex);
+	while (m_running)
+		m_stopped.wait(lock);
+	lock.unlock();
+	Shutdown();
+}
+
+void EventServer::Stop()
+{
+	m_mutex.lock();
+	m_running = false;
+	m_mutex.unlock();
+	m_stopped.notify_all();
+}
+
+/**
+ * Stop the IO threads, then drop every connection
+ * Sessions kept by handlers outlive their IO thread; they can't send once it has gone.
+ */
+void EventServer::Shutdown()
+{
+	for (auto io : m_io)
+		io->loop.Stop();
+	for (auto io : m_io)
+	{
+		if (io->thread.joinable())
+			io->thread.join();
+	}
+	for (auto io : m_io)
+	{
+		vector<SessionPtr> sessions(io->sessions.begin(), io->sessions.end());
+		for (auto & session : sessions)
+		{
+			session->Finish(CLOSE_GOING_AWAY);
+			lock_guard<mutex> lock(session->m_mutex);
+			session->m_io = NULL;
+		}
+		delete io;
+	}
+	m_io.clear();
+	if (m_listen_fd >= 0)
+		close(m_listen_fd);
+	m_listen_fd = -1;
+}
+
+void EventServer::Adopt(HTTP::Request & request, int fd, string & rest)
+{
+	if (m_io.empty())
+	{
+		Error("Can't adopt a connection before Start");
+		close(fd);
+		return;
+	}
+	uint64_t id = m_next_id++;
+	IOThread * io = m_io[id % m_io.size()];
+	SessionPtr session(new Session(*this, io, fd, id));
+	struct sockaddr_in address;
+	socklen_t size = sizeof(address);
+	if (getpeername(fd, (struct sockaddr*)&address, &size) == 0)
+		inet_ntop(AF_INET, &address.sin_addr, session->m_peer, sizeof(session->m_peer));
+	session->m_request = request;
+	session->m_head.swap(rest);
+	io->loop.Post([io, session]()
+	{
+		Session * s = session.get();
+		s->m_watch = io->loop.Add(s->m_fd, WSSERVER_READ_EVENTS, [s](uint32_t events) {s->Readable(events);});
+		if (s->m_watch == NULL)
+			return;
+		io->sessions.insert(session);
+		s->m_batching = true;
+		s->Answer(s->m_head.data(), s->m_head.size());
+		string().swap(s->m_head);
+		s->m_batching = false;
+		s->Flush();
+	});
+}
+
+void EventServer::Accept(IOThread * io)
+{
+	while (true)
+	{
+		struct sockaddr_in address;
+		socklen_t size = sizeof(address);
+		int fd = accept4(m_listen_fd, (struct sockaddr*)&address, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+				Error("Error accepting connection - %s", StrError(errno));
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+		int tmp = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &tmp, sizeof(tmp));
+		SessionPtr session(new Session(*this, io, fd, m_next_id++));
+		inet_ntop(AF_INET, &address.sin_addr, session->m_peer, sizeof(session->m_peer));
+		Session * s = session.get();
+		session->m_watch = io->loop.Add(fd, WSSERVER_READ_EVENTS, [s](uint32_t events) {s->Readable(events);});
+		if (session->m_watch == NULL)
+			continue;
+		io->sessions.insert(session);
+		io->loop.Schedule(session->m_timer, WSSERVER_HANDSHAKE_TIMEOUT, [s]() {s->Finish(CLOSE_ABNORMAL);});
+	}
+}
+
+}}
@@ -0,0 +1,278 @@
+/**
+ * @file wsserver.h
+ * @brief Event driven WebSocket server - Declarations
+ * @see wsserver.cpp - Definitions
+ * @see eventloop.h - IO threads
+ * @see wsframe.h - Framing
+ * @see websocket.h - WS::Server, a blocking server for one peer at a time
+ */
+
+#ifndef _WSSERVER_H
+#define _WSSERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <netinet/in.h>
+
+#include "http.h"
+#include "eventloop.h"
+#include "wsframe.h"
+#include "wsdeflate.h"
+
+namespace Foxbox
+{
+	namespace WS
+	{
+		/** Bytes queued for a session before it is no longer read from, by default **/
+		#define WSSERVER_MAX_QUEUED (4 << 20)
+
+		/** A framed message, ready to write to any number of connections **/
+		typedef std::shared_ptr<const std::string> Frame;
+
+		/** Frame a message once (unmasked, as a server sends it) @param rsv RSV bits of the frame **/
+		Frame MakeFrame(Opcode opcode, const void * data, size_t size, unsigned rsv = 0);
+
+		/**
+		 * A WebSocket server for many connections at once
+		 * IO threads each run an EventLoop; they accept connections (one thread is
+		 * 	woken per connection), read the handshake and frames without blocking,
+		 * 	and call the handlers. Handlers run on the IO thread and must not block;
+		 * 	pass slow work to a WorkPool and Send the result from there.
+		 * Each Session has a queue of Frames written with writev(2) as the socket
+		 * 	allows, so sending never blocks and a Frame can be shared by many
+		 * 	sessions. Pings are answered, and the closing handshake done, for you.
+		 * 	A session with more than MaxQueued waiting isn't read from until
+		 * 	half of it has been written, so a peer that sends (pings, say) but
+		 * 	doesn't read can't make its queue grow without end.
+		 * With KeepAlive set each session is pinged from its IO thread's timer wheel;
+		 * 	pongs give its round trip time, and a peer that stops answering is
+		 * 	dropped, so dead connections don't hold their buffers and descriptors.
+		 * Connections can also be handed over by an HTTP::Server that read their
+		 * 	handshake (Adopt), so WebSockets and other requests share a port.
+		 * @see examples/wsserver.cpp
+		 */
+		class EventServer
+		{
+			private:
+				struct IOThread;
+			public:
+				/**
+				 * One connection
+				 * Handlers are given a SessionPtr, which may be kept; Send and Close
+				 * 	are thread safe, and do nothing once the connection has closed.
+				 */
+				class Session : public std::enable_shared_from_this<Session>
+				{
+					public:
+						virtual ~Session();
+
+						/** Queue a message, compressed if permessage-deflate was agreed @returns false if the session is closing **/
+						bool Send(Opcode opcode, const void * data, size_t size);
+						bool Send(const std::string & text) {return Send(TEXT, text.data(), text.size());}
+						bool SendBinary(const void * data, size_t size) {return Send(BINARY, data, size);}
+						/** Queue a framed message (no copy is made, and it isn't compressed) **/
+						bool Send(const Frame & frame) {return Queue(frame, false);}
+						/**
+						 * Queue a framed message unless more than limit bytes are queued
+						 * If key isn't 0 and the queue is over the limit, the frame replaces the
+						 * 	last one queued with the same key instead (or is queued after all if
+						 * 	there isn't one), so only the latest message for each key waits.
+						 * @returns false if the frame was dropped (or the session is closing)
+						 */
+						bool Send(const Frame & frame, size_t limit, uint64_t key = 0) {return Queue(frame, false, limit, key);}
+						/** Start the closing handshake; the connection is closed when the peer answers, or in time anyway **/
+						void Close(unsigned code = CLOSE_NORMAL, const StringRef & reason = StringRef());
+
+						/** Bytes queued but not yet sent **/
+						size_t Queued() const {return m_queued;}
+						/** The handshake request (Path, Params, Headers, Cookies) **/
+						HTTP::Request & Request() {return m_request;}
+						/** The subprotocol agreed (empty if none) **/
+						const std::string & Protocol() const {return m_protocol;}
+						const char * Peer() const {return m_peer;}
+						/** Unique within the server **/
+						uint64_t Id() const {return m_id;}
+						/** Smoothed round trip time of pings, in seconds (negative until a pong arrives) **/
+						double RTT() const {int64_t rtt = m_rtt; return (rtt < 0) ? -1 : rtt / 1e9;}
+						/** Pings in a row that went unanswered **/
+						unsigned Missed() const {return m_missed;}
+
+					private:
+						friend class EventServer;
+						Session(EventServer & server, IOThread * io, int fd, uint64_t id);
+						Session(const Session & cpy) = delete;
+						Session & operator=(const Session & cpy) = delete;
+
+						/** Run task on the IO thread (now, if this is it) **/
+						void OnLoop(const std::function<void()> & task);
+						void Readable(uint32_t events);
+						/** Read the handshake request from m_head **/
+						void Handshake();
+						/** Upgrade or refuse once m_request has been read; rest is what followed it **/
+						void Answer(const char * rest, size_t size);
+						/** Answer the handshake and pass the bytes after it to the parser **/
+						void Upgrade(const char * rest, size_t size);
+						/** Refuse the handshake with an HTTP status line (and headers) **/
+						void Reject(const char * status);
+						/** Handle whatever frames the parser has **/
+						void Dispatch();
+						void Control(const FrameParser::Message & message);
+						/** Send the next keepalive ping, or give up on the peer **/
+						void Ping();
+						/** Time the pong to one of our pings **/
+						void Pong(const FrameParser::Message & message);
+						/** Queue a frame; close makes it the last @returns false if it wasn't queued **/
+						bool Queue(const Frame & frame, bool close, size_t limit = 0, uint64_t key = 0);
+						/** Write as much of the queue as the socket takes **/
+						void Flush();
+						/** Wait for the events wanted: input unless paused, output while writing (IO thread) **/
+						void Watch();
+						/** Send a close frame (if one wasn't) and close when it has been written **/
+						void Fail(unsigned code);
+						/** Queue a close frame and give the peer time to answer (IO thread) **/
+						void SendClose(unsigned code, const StringRef & reason);
+						/** Close the connection now, and tell the handler (IO thread) **/
+						void Finish(unsigned code);
+
+						EventServer & m_server;
+						IOThread * m_io;
+						int m_fd;
+						uint64_t m_id;
+						EventLoop::Watch * m_watch;
+						EventLoop::Timer m_timer; /** Handshake or closing deadline **/
+						EventLoop::Timer m_ping_timer;
+						int64_t m_ping_sent; /** When the last ping went (TimerWheel::Now; 0 once answered) **/
+						int64_t m_first_ping; /** When the first went (older pongs aren't ours) **/
+						std::atomic<unsigned> m_missed;
+						std::atomic<int64_t> m_rtt; /** Nanoseconds **/
+						char m_peer[INET_ADDRSTRLEN];
+						std::string m_head; /** Handshake received so far **/
+						HTTP::Request m_request;
+						std::string m_protocol;
+						FrameParser m_parser;
+						std::unique_ptr<Deflate> m_deflate; /** Set if permessage-deflate was agreed **/
+						std::mutex m_deflate_mutex; /** Held from compressing a message until it is queued **/
+						std::string m_compressed;
+						std::string m_inflated; /** The message received, decompressed **/
+						bool m_open; /** Handshake done **/
+						bool m_reading; /** Frames are still wanted (not after a close frame or error) **/
+						bool m_writing; /** Waiting for EPOLLOUT **/
+						bool m_paused; /** Not reading until the queue drains **/
+						bool m_batching; /** Reading; Flush after, not for each frame queued **/
+						bool m_finish; /** Close once the queue is written **/
+						unsigned m_close_code; /** Passed to the CloseHandler **/
+
+						std::mutex m_mutex; /** Guards the members below (but m_queued is atomic to read) **/
+						struct Pending
+						{
+							Frame frame;
+							uint64_t key; /** For replacing (0 for none) **/
+						};
+						std::deque<Pending> m_queue;
+						size_t m_offset; /** Bytes of the first frame already written **/
+						size_t m_in_flight; /** Frames at the front being written (they mustn't be replaced) **/
+						bool m_flushing; /** A Flush is pending or waiting for EPOLLOUT **/
+						bool m_close_sent; /** Nothing may follow the close frame **/
+						std::atomic<size_t> m_queued;
+				};
+				typedef std::shared_ptr<Session> SessionPtr;
+
+				/** Handshake done **/
+				typedef std::function<void(const SessionPtr & session)> OpenHandler;
+				/** A whole message; message is only valid during the call **/
+				typedef std::function<void(const SessionPtr & session, Opcode opcode, const StringRef & message)> MessageHandler;
+				/**
+				 * Connection closed
+				 * @param code From the peer's close frame, or the one sent if the peer broke
+				 * 	the protocol (CLOSE_ABNORMAL if the connection just dropped)
+				 */
+				typedef std::function<void(const SessionPtr & session, unsigned code)> CloseHandler;
+
+				/**
+				 * @param port Port to listen on (-1 not to listen, and only Adopt connections)
+				 * @param io_threads Number of IO threads (0 for one per core)
+				 */
+				EventServer(int port, unsigned io_threads = 0);
+				virtual ~EventServer();
+
+				void OnOpen(const OpenHandler & handler) {m_on_open = handler;}
+				void OnMessage(const MessageHandler & handler) {m_on_message = handler;}
+				void OnClose(const CloseHandler & handler) {m_on_close = handler;}
+				/** Largest message accepted (larger ones close with 1009); set before Start **/
+				void MaxMessage(size_t max_message) {m_max_message = max_message;}
+				/** Close sessions that send text that isn't UTF-8 with 1007 (on by default); set before Start **/
+				void Validation(bool validate) {m_validate = validate;}
+				/**
+				 * Ping every session every interval seconds (0 not to) and drop those
+				 * 	that miss max_missed pongs in a row; set before Start
+				 */
+				void KeepAlive(double interval, unsigned max_missed = 3) {m_ping_interval = interval; m_max_missed = max_missed;}
+				/** Agree to permessage-deflate if a client offers it; set before Start **/
+				void Compression(const DeflateConfig & config) {m_deflate_config = config;}
+				/** Stop reading from a session while more than this is queued for it (0 for no limit); set before Start **/
+				void MaxQueued(size_t max_queued) {m_max_queued = max_queued;}
+
+				/** Start listening and the IO threads **/
+				void Start();
+				/**
+				 * Take over a connection whose handshake another server read; thread safe,
+				 * 	once started. The session answers it as if it had read it itself.
+				 * Suits HTTP::Server::SetUpgradeHandler
+				 * @param fd Connected socket (non-blocking), closed by the session
+				 * @param rest What was received after the handshake (taken, not copied)
+				 */
+				void Adopt(HTTP::Request & request, int fd, std::string & rest);
+				/** Start (if needed) and block until Stop() is called, then shut down **/
+				void Run();
+				/** Make Run() return; thread safe, and may be called from a handler **/
+				void Stop();
+
+				int Port() const {return m_port;}
+				/** Sessions open (handshake done) **/
+				size_t Sessions() const {return m_sessions;}
+
+			private:
+				EventServer(const EventServer & cpy) = delete;
+				EventServer & operator=(const EventServer & cpy) = delete;
+
+				/** An IO thread and the connections it owns **/
+				struct IOThread
+				{
+					EventLoop loop;
+					std::thread thread;
+					std::unordered_set<SessionPtr> sessions;
+				};
+
+				void Accept(IOThread * io);
+				void Shutdown();
+
+				int m_port;
+				unsigned m_io_count;
+				OpenHandler m_on_open;
+				MessageHandler m_on_message;
+				CloseHandler m_on_close;
+				size_t m_max_message;
+				bool m_validate;
+				double m_ping_interval;
+				unsigned m_max_missed;
+				DeflateConfig m_deflate_config;
+				size_t m_max_queued;
+				int m_listen_fd;
+				std::vector<IOThread*> m_io;
+				std::atomic<uint64_t> m_next_id;
+				std::atomic<size_t> m_sessions;
+				std::atomic<bool> m_running;
+				std::mutex m_mutex;
+				std::condition_variable m_stopped;
+		};
+	}
+}
+
+#endif //_WSSERVER_H